@@ -0,0 +1,62 @@
+#ifndef TIME_AT_ENKLAVE_ARENA_HPP
+#define TIME_AT_ENKLAVE_ARENA_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <type_traits>
+
+namespace enklave {
+    /** Allocator drawing from a std::pmr::memory_resource, like std::pmr::polymorphic_allocator, but which moves
+     * along with the memory it allocated.
+     *
+     * A std::pmr::string moved into a string bound to another resource copies its bytes, since polymorphic_allocator
+     * never propagates. Buffers passing through the slots of a \ref BoundedQueue (default-constructed, so bound to
+     * the default resource) would thus be copied twice per stage. With this allocator, moves only swap pointers and
+     * a buffer is returned to the resource it came from wherever it is destroyed.
+     */
+    template<typename T>
+    class PropagatingAllocator {
+    public:
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        PropagatingAllocator(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) noexcept
+                : memory{resource} {}
+
+        template<typename U>
+        PropagatingAllocator(const PropagatingAllocator<U> &other) noexcept : memory{other.resource()} {}
+
+        T *allocate(std::size_t n) {
+            return static_cast<T *>(memory->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T *p, std::size_t n) noexcept {
+            memory->deallocate(p, n * sizeof(T), alignof(T));
+        }
+
+        std::pmr::memory_resource *resource() const noexcept {
+            return memory;
+        }
+
+        template<typename U>
+        bool operator==(const PropagatingAllocator<U> &other) const noexcept {
+            return memory == other.resource() || memory->is_equal(*other.resource());
+        }
+
+        template<typename U>
+        bool operator!=(const PropagatingAllocator<U> &other) const noexcept {
+            return !(*this == other);
+        }
+
+    private:
+        std::pmr::memory_resource *memory;
+    };
+
+    /// String whose buffer comes from a memory resource and travels with it when moved, see \ref PropagatingAllocator.
+    using ArenaString = std::basic_string<char, std::char_traits<char>, PropagatingAllocator<char>>;
+}
+
+#endif //TIME_AT_ENKLAVE_ARENA_HPP
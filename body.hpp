@@ -0,0 +1,210 @@
+#ifndef TIME_AT_ENKLAVE_BODY_HPP
+#define TIME_AT_ENKLAVE_BODY_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "encoded_words.hpp"
+#include "enklave.hpp"
+#include "rules.hpp"
+
+namespace enklave {
+    /** Decode quoted-printable text (RFC 2045), streaming every decoded byte into sink.
+     *
+     * Soft line breaks ("=" at the end of a line) are removed, "=XX" becomes the byte XX, and malformed escapes are
+     * passed through unchanged. Nothing is allocated.
+     *
+     * @param text Encoded text.
+     * @param sink Callable taking a char.
+     */
+    template<typename Sink>
+    void decode_quoted_printable(std::string_view text, Sink &&sink) {
+        for (std::size_t i = 0; i < text.size(); ++i) {
+            const auto c = text[i];
+            if (c != '=') {
+                sink(c);
+                continue;
+            }
+            if (i + 1 < text.size() && text[i + 1] == '\n') { // Soft line break.
+                i += 1;
+            } else if (i + 2 < text.size() && text[i + 1] == '\r' && text[i + 2] == '\n') {
+                i += 2;
+            } else if (i + 2 < text.size() && detail::hex_value(text[i + 1]) >= 0 &&
+                       detail::hex_value(text[i + 2]) >= 0) {
+                sink(static_cast<char>(detail::hex_value(text[i + 1]) << 4 | detail::hex_value(text[i + 2])));
+                i += 2;
+            } else {
+                sink(c);
+            }
+        }
+    }
+
+    namespace detail {
+        /// Position of needle in data, ignoring the case of ASCII letters; npos if there is none.
+        std::size_t find_ignoring_case(std::string_view data, std::string_view needle, std::size_t from = 0) {
+            if (needle.empty() || data.size() < needle.size())
+                return std::string_view::npos;
+            for (auto pos = from; pos + needle.size() <= data.size(); ++pos) {
+                std::size_t i = 0;
+                while (i < needle.size() && ascii_lower(data[pos + i]) == ascii_lower(needle[i]))
+                    ++i;
+                if (i == needle.size())
+                    return pos;
+            }
+            return std::string_view::npos;
+        }
+
+        /// Position of the first field named name (with its colon) that starts a line of data; npos if there is none.
+        std::size_t find_field_ignoring_case(std::string_view data, std::string_view name, std::size_t from = 0) {
+            for (auto pos = find_ignoring_case(data, name, from); pos != std::string_view::npos;
+                 pos = find_ignoring_case(data, name, pos + 1)) {
+                if (pos == 0 || data[pos - 1] == '\n')
+                    return pos;
+            }
+            return std::string_view::npos;
+        }
+
+        /// Whether the Content-Type field at data[pos] is text/html.
+        bool is_html_type(std::string_view data, std::size_t pos) {
+            constexpr std::string_view name{"Content-Type:"};
+            auto type = data.substr(pos + name.size());
+            type = type.substr(std::min(type.find_first_not_of(" \t"), type.size()));
+            return find_ignoring_case(type.substr(0, 9), "text/html") == 0;
+        }
+    }
+
+    /// Content of the text/html part of a mail.
+    struct HtmlPart {
+        /// Bytes of the part after its header block, up to the end of the given message.
+        std::string_view content;
+        bool quoted_printable = false;
+    };
+
+    /** Find the text/html part of a mail: the mail itself if it is text/html, or the first text/html part of a
+     * multipart mail.
+     *
+     * Parts are not parsed recursively; the first "Content-Type: text/html" after the header block of the mail is
+     * taken, and its header block reaches back to the boundary line before it.
+     *
+     * @param header Header block of the mail.
+     * @param body Bytes of the mail after its header block (or a prefix of them).
+     * @return The part, or an empty optional if there is none in body.
+     */
+    std::optional<HtmlPart> find_html_part(std::string_view header, std::string_view body) {
+        constexpr std::string_view content_type{"Content-Type:"};
+        constexpr std::string_view encoding{"Content-Transfer-Encoding: quoted-printable"};
+        const auto mail_type = detail::find_field_ignoring_case(header, content_type);
+        if (mail_type != std::string_view::npos && detail::is_html_type(header, mail_type))
+            return HtmlPart{body, detail::find_field_ignoring_case(header, encoding) != std::string_view::npos};
+
+        for (auto pos = detail::find_field_ignoring_case(body, content_type); pos != std::string_view::npos;
+             pos = detail::find_field_ignoring_case(body, content_type, pos + 1)) {
+            if (!detail::is_html_type(body, pos))
+                continue;
+            const auto boundary = body.rfind("\n--", pos);
+            const auto part_begin = boundary == std::string_view::npos ? 0 : boundary + 1;
+            const auto part_end = find_header_end(body, pos);
+            if (part_end == std::string_view::npos)
+                return std::nullopt;
+            const auto part_header = body.substr(part_begin, part_end - part_begin);
+            return HtmlPart{body.substr(part_end),
+                            detail::find_field_ignoring_case(part_header, encoding) != std::string_view::npos};
+        }
+        return std::nullopt;
+    }
+
+    /** Decode the first bytes of the text/html part of a mail for matching literals.
+     *
+     * At most limit bytes of the (encoded) part are decoded, so the cost is bounded however large the mail is.
+     * Whitespace and no-break spaces are normalized as in \ref decode_header_text.
+     *
+     * @param header Header block of the mail.
+     * @param body Bytes of the mail after its header block (or a prefix of them).
+     * @param limit Maximum number of encoded bytes to decode.
+     * @param text Receives the result; its capacity is reused.
+     * @return View of text, or an empty optional if the mail has no text/html part.
+     */
+    std::optional<std::string_view> decode_html_text(std::string_view header, std::string_view body,
+                                                     std::size_t limit, std::string &text) {
+        const auto part = find_html_part(header, body);
+        if (!part)
+            return std::nullopt;
+        text.clear();
+        TextNormalizer normalize{text};
+        const auto content = part->content.substr(0, limit);
+        if (part->quoted_printable)
+            decode_quoted_printable(content, normalize);
+        else
+            for (auto c: content)
+                normalize(c);
+        normalize.finish();
+        return std::string_view{text};
+    }
+
+    /** Classify a mail whose header was inconclusive by the check-in and check-out patterns of its site, searched in
+     * the first bytes of its text/html part (see \ref decode_html_text).
+     *
+     * Patterns are those of the classifier of context, or of the \ref builtin_profiles without one. Throws
+     * runtime_error if the part contains the patterns of neither or both kinds, or has no text/html part.
+     *
+     * @param context Context of the thread; its text buffer is used.
+     * @param inconclusive What parsing the header found.
+     * @param header Header block of the mail.
+     * @param body Bytes of the mail after its header block (or a prefix of them).
+     * @param limit Maximum number of encoded bytes of the text/html part to scan.
+     * @return The event.
+     */
+    EnklaveEvent classify_by_body(ParseContext &context, const InconclusiveMail &inconclusive, std::string_view header,
+                                  std::string_view body, std::size_t limit) noexcept(false) {
+        static const auto builtin = default_rules();
+        const auto &sites = context.classifier() ? context.classifier()->sites() : builtin;
+        const auto site = std::find_if(sites.begin(), sites.end(), [&inconclusive](const SiteRules &rules) {
+            return rules.site == inconclusive.event.site;
+        });
+        const auto text = decode_html_text(header, body, limit, context.text_buffer());
+        if (site == sites.end() || !text)
+            throw std::runtime_error{inconclusive.what()};
+
+        auto contains_any = [&text](const std::vector<std::string> &patterns) {
+            return std::any_of(patterns.begin(), patterns.end(), [&text](const std::string &pattern) {
+                return text->find(pattern) != std::string_view::npos;
+            });
+        };
+        const bool isCheckIn = contains_any(site->check_in);
+        const bool isCheckOut = contains_any(site->check_out);
+        if (isCheckIn == isCheckOut)
+            throw std::runtime_error{inconclusive.what()};
+
+        auto result = inconclusive.event;
+        result.type = isCheckIn ? EnklaveEventType::CHECK_IN : EnklaveEventType::CHECK_OUT;
+        return result;
+    }
+
+    /** Parse a mail held in memory: by its header (see \ref parse_header_lazy), and if that is inconclusive and
+     * body_scan_bytes is not 0, by its body (see \ref classify_by_body).
+     *
+     * @param context Context of the thread.
+     * @param header Header block of the mail.
+     * @param body Bytes of the mail after its header block (or a prefix of them).
+     * @param body_scan_bytes Maximum number of bytes of the text/html part to scan; 0 disables the fallback.
+     * @param path_of_file See \ref parse_header_lazy.
+     * @return The event, see \ref parse_header_lazy.
+     */
+    template<typename PathOfFile>
+    EnklaveEvent parse_mail(ParseContext &context, std::string_view header, std::string_view body,
+                            std::size_t body_scan_bytes, PathOfFile &&path_of_file) noexcept(false) {
+        try {
+            return parse_header_lazy(context, header, path_of_file);
+        } catch (InconclusiveMail &e) {
+            if (body_scan_bytes == 0)
+                throw;
+            return classify_by_body(context, e, header, body, body_scan_bytes);
+        }
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_BODY_HPP
@@ -0,0 +1,183 @@
+#ifndef TIME_AT_ENKLAVE_BOUNDED_QUEUE_HPP
+#define TIME_AT_ENKLAVE_BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace enklave {
+    /** Bounded multi-producer multi-consumer queue connecting two stages of the ingestion pipeline.
+     *
+     * The queue is lock-free: every slot carries a sequence number that tells producers and consumers whether the slot
+     * is free or filled (see Dmitry Vyukov's bounded MPMC queue). The capacity is rounded up to a power of two.
+     *
+     * A full queue makes \ref push wait; this is the backpressure that keeps a fast stage from piling up buffers in
+     * front of a slow one. Once every producer has called \ref producer_done, \ref pop drains the remaining items and
+     * then returns false. \ref abort wakes up all waiting threads, e.g. if a stage failed with an exception.
+     *
+     * @tparam T Default constructible and movable type of the transported items.
+     */
+    template<typename T>
+    class BoundedQueue {
+    public:
+        /// Throws length_error if the capacity can't be rounded up to a power of two.
+        BoundedQueue(std::size_t capacity, unsigned producers)
+                : mask{round_up_to_power_of_two(capacity) - 1}, cells{new Cell[mask + 1]}, producers{producers} {
+            for (std::size_t i = 0; i <= mask; ++i)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        BoundedQueue(const BoundedQueue &) = delete;
+
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        /// Try to enqueue item without waiting. Returns false if the queue is full.
+        bool try_push(T &item) {
+            std::size_t pos = tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell &cell = cells[pos & mask];
+                const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.data = std::move(item);
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false; // Full.
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /// Try to dequeue an item into item without waiting. Returns false if the queue is empty.
+        bool try_pop(T &item) {
+            std::size_t pos = head.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell &cell = cells[pos & mask];
+                const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        item = std::move(cell.data);
+                        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false; // Empty.
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /** Enqueue item and wait while the queue is full.
+         *
+         * @param item Item to enqueue; moved from on success.
+         * @param waited Time spent waiting for a free slot is added to this.
+         * @return false if the queue was aborted, true otherwise.
+         */
+        bool push(T &item, std::chrono::nanoseconds &waited) {
+            if (try_push(item))
+                return true;
+
+            const auto start = std::chrono::steady_clock::now();
+            Backoff backoff;
+            while (!try_push(item)) {
+                if (aborted.load(std::memory_order_acquire))
+                    return false;
+                backoff();
+            }
+            waited += std::chrono::steady_clock::now() - start;
+            return true;
+        }
+
+        /** Dequeue an item and wait while the queue is empty but producers are still active.
+         *
+         * @param item Receives the dequeued item.
+         * @param waited Time spent waiting for an item is added to this.
+         * @return false if all producers are done and the queue is drained, or if the queue was aborted.
+         */
+        bool pop(T &item, std::chrono::nanoseconds &waited) {
+            if (try_pop(item))
+                return true;
+
+            const auto start = std::chrono::steady_clock::now();
+            Backoff backoff;
+            bool result = true;
+            while (!try_pop(item)) {
+                if (aborted.load(std::memory_order_acquire)) {
+                    result = false;
+                    break;
+                }
+                // All pushes happen before the last producer_done(), so one more attempt drains the queue reliably.
+                if (producers.load(std::memory_order_acquire) == 0) {
+                    result = try_pop(item);
+                    break;
+                }
+                backoff();
+            }
+            waited += std::chrono::steady_clock::now() - start;
+            return result;
+        }
+
+        /// Must be called once by every producer after its last push.
+        void producer_done() {
+            producers.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        /// Make all current and future waits return false.
+        void abort() {
+            aborted.store(true, std::memory_order_release);
+        }
+
+    private:
+        struct Cell {
+            std::atomic<std::size_t> sequence{0};
+            T data{};
+        };
+
+        /// Spin shortly, then yield, then sleep; waiting stages should not burn the cores the busy stage needs.
+        struct Backoff {
+            unsigned rounds = 0;
+
+            void operator()() {
+                using namespace std::chrono_literals;
+                if (++rounds < 16)
+                    return;
+                if (rounds < 64)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(50us);
+            }
+        };
+
+        static std::size_t round_up_to_power_of_two(std::size_t n) {
+            if (n > std::numeric_limits<std::size_t>::max() / 2 + 1)
+                throw std::length_error{"Queue capacity too large: " + std::to_string(n)};
+            std::size_t result = 2;
+            while (result < n)
+                result <<= 1;
+            return result;
+        }
+
+        const std::size_t mask;
+        std::unique_ptr<Cell[]> cells;
+        // Producers and consumers modify different indices; keep them on separate cache lines.
+        alignas(64) std::atomic<std::size_t> tail{0};
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<unsigned> producers;
+        std::atomic<bool> aborted{false};
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_BOUNDED_QUEUE_HPP
@@ -0,0 +1,152 @@
+#ifndef TIME_AT_ENKLAVE_COMPRESSION_HPP
+#define TIME_AT_ENKLAVE_COMPRESSION_HPP
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef ENKLAVE_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef ENKLAVE_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+// Filesystem needs some care on different compilers.
+#include <filesystem>
+
+#ifdef _WIN32
+namespace fs = std::experimental::filesystem::v1;
+#elif __linux__
+namespace fs = std::filesystem;
+#endif
+
+namespace enklave {
+    /// Compression formats of mail files recognized by their extension.
+    enum class Compression {
+        NONE,
+        /// ".gz", requires zlib.
+        GZIP,
+        /// ".zst", requires libzstd.
+        ZSTD
+    };
+
+    /// Determine the compression format of a file by the (last) extension of its name.
+    Compression compression_of(std::string_view name) {
+        auto ends_with = [name](std::string_view suffix) {
+            return name.size() > suffix.size() && name.substr(name.size() - suffix.size()) == suffix;
+        };
+        if (ends_with(".gz"))
+            return Compression::GZIP;
+        if (ends_with(".zst"))
+            return Compression::ZSTD;
+        return Compression::NONE;
+    }
+
+    /// Determine the compression format of a file by its (last) extension.
+    Compression compression_of(const fs::path &f) {
+        return compression_of(std::string_view{f.filename().native()});
+    }
+
+    /** Decompress a file chunk by chunk until the caller has seen enough.
+     *
+     * Decompression stops as soon as stop returns true, so the cost is proportional to the size of the decompressed
+     * prefix that is actually needed (e.g. the header block of a mail) and not to the size of the whole file.
+     *
+     * Throws runtime_error if the file is corrupt or support for its format is not compiled in.
+     *
+     * @param read_input Called as read_input(buffer, size) to read the next compressed bytes; returns the number of
+     * bytes read, 0 at the end of the file.
+     * @param compression Format of the file; must not be Compression::NONE.
+     * @param stop Called as stop(output, old_size) after new bytes were appended to output at position old_size.
+     * @param name Name of the file used in error messages.
+     * @return Decompressed prefix of the file.
+     */
+    template<typename ReadInput, typename StopPredicate>
+    std::string decompress_prefix([[maybe_unused]] ReadInput &&read_input, Compression compression,
+                                  [[maybe_unused]] StopPredicate &&stop, const std::string &name) noexcept(false) {
+        [[maybe_unused]] constexpr std::size_t input_chunk_size = 16384;
+        [[maybe_unused]] constexpr std::size_t output_chunk_size = 4096;
+
+        std::string output;
+
+        switch (compression) {
+            case Compression::GZIP: {
+#ifdef ENKLAVE_HAS_ZLIB
+                char input[input_chunk_size];
+                z_stream stream{};
+                if (inflateInit2(&stream, 15 + 32) != Z_OK) // 32: detect gzip and zlib headers automatically.
+                    throw std::runtime_error{"Could not initialize zlib: " + name};
+
+                int status = Z_OK;
+                while (status != Z_STREAM_END) {
+                    if (stream.avail_in == 0) {
+                        stream.avail_in = static_cast<uInt>(read_input(input, input_chunk_size));
+                        stream.next_in = reinterpret_cast<Bytef *>(input);
+                        if (stream.avail_in == 0)
+                            break; // Truncated file; use what was decompressed so far.
+                    }
+                    const auto old_size = output.size();
+                    output.resize(old_size + output_chunk_size);
+                    stream.next_out = reinterpret_cast<Bytef *>(output.data() + old_size);
+                    stream.avail_out = static_cast<uInt>(output_chunk_size);
+
+                    status = inflate(&stream, Z_NO_FLUSH);
+                    output.resize(old_size + output_chunk_size - stream.avail_out);
+                    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                        inflateEnd(&stream);
+                        throw std::runtime_error{"Corrupt gzip file: " + name};
+                    }
+                    if (stop(output, old_size))
+                        break;
+                }
+                inflateEnd(&stream);
+                return output;
+#else
+                throw std::runtime_error{"Support for gzip is not compiled in: " + name};
+#endif
+            }
+            case Compression::ZSTD: {
+#ifdef ENKLAVE_HAS_ZSTD
+                char input[input_chunk_size];
+                ZSTD_DStream *stream = ZSTD_createDStream();
+                if (!stream)
+                    throw std::runtime_error{"Could not initialize zstd: " + name};
+                ZSTD_initDStream(stream);
+
+                ZSTD_inBuffer in{input, 0, 0};
+                for (;;) {
+                    if (in.pos == in.size) {
+                        in.size = read_input(input, input_chunk_size);
+                        in.pos = 0;
+                        if (in.size == 0)
+                            break; // End of file.
+                    }
+                    const auto old_size = output.size();
+                    output.resize(old_size + output_chunk_size);
+                    ZSTD_outBuffer out{output.data() + old_size, output_chunk_size, 0};
+
+                    const std::size_t result = ZSTD_decompressStream(stream, &out, &in);
+                    output.resize(old_size + out.pos);
+                    if (ZSTD_isError(result)) {
+                        ZSTD_freeDStream(stream);
+                        throw std::runtime_error{"Corrupt zstd file: " + name};
+                    }
+                    if (stop(output, old_size))
+                        break;
+                }
+                ZSTD_freeDStream(stream);
+                return output;
+#else
+                throw std::runtime_error{"Support for zstd is not compiled in: " + name};
+#endif
+            }
+            case Compression::NONE:
+            default:
+                throw std::logic_error{"decompress_prefix requires a compressed file: " + name};
+        }
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_COMPRESSION_HPP
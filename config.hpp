@@ -1,6 +1,8 @@
 #ifndef TIME_AT_ENKLAVE_CONFIG_HPP
 #define TIME_AT_ENKLAVE_CONFIG_HPP
 
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <regex>
 
@@ -8,6 +10,62 @@ namespace enklave {
     /// Values used in more than two places (e.g. main and tests/) are defined here.
     namespace config {
         constexpr char path_with_mails[] = "../tests/data/";
+
+        /// Default number of threads listing directories in parallel when scanning recursively.
+        constexpr unsigned traversal_threads = 2;
+
+        /// Default number of threads reading header bytes in the ingestion pipeline.
+        constexpr unsigned reader_threads = 2;
+
+        /// Default number of threads parsing headers in the ingestion pipeline; 0 means one per hardware thread.
+        constexpr unsigned parser_threads = 0;
+
+        /// Default capacity of each queue between two stages of the ingestion pipeline.
+        constexpr std::size_t queue_capacity = 256;
+
+        /// Largest capacity accepted by --queue-capacity; each slot of a queue is allocated up front.
+        constexpr std::size_t max_queue_capacity = std::size_t{1} << 20;
+
+        /** Margin around a --since/--until range within which events are still ingested.
+         *
+         * Events just outside the range pair up with events inside it, such that sessions crossing a bound are found
+         * and clipped instead of being dropped. Sessions longer than this margin are missed at the bounds.
+         */
+        constexpr std::chrono::hours range_slack{24};
+
+        /** Bytes read after the header block of a mail, besides --body-scan bytes, when its body is scanned.
+         *
+         * Covers the parts preceding the text/html part of a multipart mail, e.g. a text/plain alternative.
+         */
+        constexpr std::size_t body_scan_slack = 16 * 1024;
+
+        /// Checkpoints (one per run) an \ref EventJournal collects before it is compacted.
+        constexpr std::size_t journal_compaction_checkpoints = 64;
+
+        /// Margin for coarse file timestamps when an \ref EventJournal checkpoints a scan; covers 2 s granularity.
+        constexpr std::chrono::seconds journal_timestamp_slack{2};
+
+        /// Default number of threads of a \ref QueryDaemon answering requests.
+        constexpr unsigned daemon_threads = 4;
+
+        /// Default time between two scans of the folder with mails by a \ref QueryDaemon.
+        constexpr std::chrono::seconds daemon_refresh_interval{10};
+
+        /// Maximum number of threads registered at once as readers of a \ref SnapshotPublisher.
+        constexpr std::size_t snapshot_readers = 64;
+
+        /// Maximum number of days a BUCKETS request of a \ref QueryDaemon may span.
+        constexpr std::size_t daemon_max_buckets = 3660;
+
+        /// Maximum length of a request line; a client sending longer lines is disconnected.
+        constexpr std::size_t daemon_max_request = 4096;
+
+        /// Default time after which a client of a \ref QueryDaemon that sends no request, or does not take its
+        /// answers, is disconnected.
+        constexpr std::chrono::seconds daemon_idle_timeout{60};
+
+        /// Maximum number of connections one thread of a \ref QueryDaemon serves at once; more wait to be accepted.
+        constexpr std::size_t daemon_connections_per_thread = 256;
     }
 }
 
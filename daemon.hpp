@@ -0,0 +1,478 @@
+#ifndef TIME_AT_ENKLAVE_DAEMON_HPP
+#define TIME_AT_ENKLAVE_DAEMON_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.hpp"
+#include "enklave.hpp"
+#include "query_index.hpp"
+#include "range.hpp"
+#include "snapshot.hpp"
+
+namespace enklave {
+    namespace detail {
+        /// Split a request line into its words; consecutive spaces and tabs separate like one.
+        std::vector<std::string_view> split_words(std::string_view line) {
+            std::vector<std::string_view> words;
+            std::size_t pos = 0;
+            while (true) {
+                pos = line.find_first_not_of(" \t\r", pos);
+                if (pos == std::string_view::npos)
+                    return words;
+                const auto end = std::min(line.find_first_of(" \t\r", pos), line.size());
+                words.push_back(line.substr(pos, end - pos));
+                pos = end;
+            }
+        }
+
+        /// Range of two request words as for --since and --until: the until day is included, "-" leaves a bound open.
+        std::optional<TimeRange> parse_query_range(std::string_view since, std::string_view until) {
+            TimeRange range;
+            if (since != "-") {
+                range.since = parse_day(since);
+                if (!range.since)
+                    return std::nullopt;
+            }
+            if (until != "-") {
+                const auto day = parse_day(until);
+                if (!day)
+                    return std::nullopt;
+                range.until = *day + date::days{1};
+            }
+            return range;
+        }
+
+        /// Time spent at all sites of an index within a range.
+        std::chrono::seconds total_duration(const QueryIndex &index, const TimeRange &range) {
+            std::chrono::seconds total{0};
+            for (std::size_t site = 0; site < index.sites(); ++site)
+                total += index.duration(site, range);
+            return total;
+        }
+
+        /// Create a socket with close-on-exec set; throws fs::filesystem_error.
+        int unix_socket(const fs::path &path, sockaddr_un &address) {
+            address = sockaddr_un{};
+            address.sun_family = AF_UNIX;
+            if (path.native().size() >= sizeof(address.sun_path))
+                throw fs::filesystem_error{"Socket path is too long", path,
+                                           std::make_error_code(std::errc::filename_too_long)};
+            std::memcpy(address.sun_path, path.c_str(), path.native().size());
+            const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                throw fs::filesystem_error{"Could not create socket", path,
+                                           std::error_code{errno, std::generic_category()}};
+            return fd;
+        }
+
+        /** Remove a socket file left by a daemon that is gone, such that a new one can be bound to its path.
+         *
+         * Only a socket that refuses connections is removed. Throws fs::filesystem_error if the path holds anything
+         * else or a daemon still listens on it.
+         */
+        void remove_stale_socket(const fs::path &path) {
+            struct stat st{};
+            if (::lstat(path.c_str(), &st) != 0)
+                return;
+            if (!S_ISSOCK(st.st_mode))
+                throw fs::filesystem_error{"Path for the socket is taken by another file", path,
+                                           std::make_error_code(std::errc::file_exists)};
+            sockaddr_un address{};
+            const int fd = unix_socket(path, address);
+            // Without blocking, such that a daemon with a full backlog still counts as listening.
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            const bool refused = ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 &&
+                                 errno == ECONNREFUSED;
+            ::close(fd);
+            if (!refused)
+                throw fs::filesystem_error{"Another daemon listens on socket", path,
+                                           std::make_error_code(std::errc::address_in_use)};
+            ::unlink(path.c_str());
+        }
+
+        bool send_all(int fd, std::string_view data) {
+            while (!data.empty()) {
+                const auto written = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return false;
+                data.remove_prefix(static_cast<std::size_t>(written));
+            }
+            return true;
+        }
+    }
+
+    /** Answer one request of the query protocol from an index.
+     *
+     * Requests and answers are single lines of words separated by spaces. Days are written as for --since and
+     * --until, where "-" leaves a bound open; durations are answered in seconds.
+     *
+     * - `TOTAL`: time spent at all sites, e.g. "OK 40368".
+     * - `RANGE <since> <until>`: time spent at all sites from the beginning of since to the end of until.
+     * - `MEMBER <site> [<since> <until>]`: time spent at one site, optionally within a range.
+     * - `BUCKETS <since> <until>`: time spent at all sites on every day from since to until, e.g. "OK 12984 27384".
+     *
+     * Malformed requests are answered with "ERR" and a reason; nothing is thrown.
+     *
+     * @param index Timeslots to answer from.
+     * @param request Request without its line break.
+     * @return Answer without line break.
+     */
+    std::string answer_query(const QueryIndex &index, std::string_view request) {
+        const auto words = detail::split_words(request);
+        if (words.empty())
+            return "ERR empty request";
+        const auto command = words[0];
+
+        if (command == "TOTAL" && words.size() == 1)
+            return "OK " + std::to_string(detail::total_duration(index, {}).count());
+
+        if (command == "RANGE" && words.size() == 3) {
+            const auto range = detail::parse_query_range(words[1], words[2]);
+            if (!range)
+                return "ERR days are written as YYYY-MM-DD or -";
+            return "OK " + std::to_string(detail::total_duration(index, *range).count());
+        }
+
+        if (command == "MEMBER" && (words.size() == 2 || words.size() == 4)) {
+            const auto site = index.find_site(words[1]);
+            if (site == QueryIndex::npos)
+                return "ERR unknown site " + std::string{words[1]};
+            TimeRange range;
+            if (words.size() == 4) {
+                const auto parsed = detail::parse_query_range(words[2], words[3]);
+                if (!parsed)
+                    return "ERR days are written as YYYY-MM-DD or -";
+                range = *parsed;
+            }
+            return "OK " + std::to_string(index.duration(site, range).count());
+        }
+
+        if (command == "BUCKETS" && words.size() == 3) {
+            const auto range = detail::parse_query_range(words[1], words[2]);
+            if (!range || !range->since || !range->until)
+                return "ERR buckets need two days written as YYYY-MM-DD";
+            const auto days = date::floor<date::days>(*range->until - *range->since).count();
+            if (days <= 0 || static_cast<std::size_t>(days) > config::daemon_max_buckets)
+                return "ERR buckets need between 1 and " + std::to_string(config::daemon_max_buckets) + " days";
+            std::string answer{"OK"};
+            for (auto day = *range->since; day < *range->until; day += date::days{1}) {
+                const TimeRange bucket{day, day + date::days{1}};
+                answer += ' ';
+                answer += std::to_string(detail::total_duration(index, bucket).count());
+            }
+            return answer;
+        }
+        return "ERR unknown request " + std::string{request.substr(0, 64)};
+    }
+
+    /// Threads and refresh rate of a \ref QueryDaemon.
+    struct DaemonConfig {
+        /// Threads accepting connections and answering their requests; at most config::snapshot_readers.
+        unsigned threads = config::daemon_threads;
+        /// Time between two refreshes of the events, see QueryDaemon::refresh.
+        std::chrono::milliseconds refresh_interval = config::daemon_refresh_interval;
+        /// Shared memory object every new index is also published to, see \ref SharedResultsWriter; empty if none.
+        std::string shared_results;
+        /// Time after which a client that sends no request, or does not take its answers, is disconnected.
+        std::chrono::milliseconds idle_timeout = config::daemon_idle_timeout;
+    };
+
+    /** Server answering queries (see \ref answer_query) from events held in memory over a Unix domain socket.
+     *
+     * The events are ingested once when the daemon starts and then again every DaemonConfig::refresh_interval on a
+     * thread of their own; the index is only rebuilt if their fingerprint changed, and then published as a new
+     * snapshot (see \ref SnapshotPublisher). A fixed set of threads accepts connections on the listening socket; each
+     * of them waits on all of its clients at once and answers every line a client sends, such that clients keeping
+     * their connection open never hold up others. Idle clients are disconnected after DaemonConfig::idle_timeout.
+     * Every answer pins the current snapshot without locking, so ingestion never blocks queries nor the other way
+     * round, and answers take two binary searches per site plus the round trip. Throws fs::filesystem_error if the
+     * socket can't be bound; a socket file left by a daemon that is gone is replaced, any other file is kept.
+     */
+    class QueryDaemon {
+    public:
+        /// Returns all events, e.g. by scanning the folder with mails again; may throw runtime_error.
+        using Ingest = std::function<std::vector<EnklaveEvent>()>;
+
+        QueryDaemon(fs::path socket, Ingest ingest, DaemonConfig daemon_config = {})
+                : socket_path{std::move(socket)}, ingest{std::move(ingest)}, daemon_config{daemon_config} {
+            if (!this->daemon_config.shared_results.empty())
+                exporter.emplace(this->daemon_config.shared_results);
+            refresh();
+
+            detail::remove_stale_socket(socket_path);
+            sockaddr_un address{};
+            listener = detail::unix_socket(socket_path, address);
+            if (::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+                ::listen(listener, SOMAXCONN) != 0) {
+                const int error = errno;
+                ::close(listener);
+                throw fs::filesystem_error{"Could not listen on socket", socket_path,
+                                           std::error_code{error, std::generic_category()}};
+            }
+            // Workers poll before they accept; another one may have taken the connection in the meantime.
+            ::fcntl(listener, F_SETFL, ::fcntl(listener, F_GETFL) | O_NONBLOCK);
+            if (::pipe2(stop_pipe, O_CLOEXEC) != 0) {
+                const int error = errno;
+                ::close(listener);
+                throw fs::filesystem_error{"Could not create pipe", socket_path,
+                                           std::error_code{error, std::generic_category()}};
+            }
+
+            const auto workers = std::clamp<std::size_t>(daemon_config.threads, 1, config::snapshot_readers);
+            try {
+                for (std::size_t i = 0; i < workers; ++i)
+                    threads.emplace_back([this] { serve(); });
+                threads.emplace_back([this] { keep_current(); });
+            } catch (...) {
+                // No destructor runs for a daemon that failed to start; join the threads started so far.
+                stop();
+                throw;
+            }
+        }
+
+        QueryDaemon(const QueryDaemon &) = delete;
+
+        QueryDaemon &operator=(const QueryDaemon &) = delete;
+
+        ~QueryDaemon() {
+            stop();
+        }
+
+        /// Stop all threads after the requests they answer, and remove the socket. Safe to call more than once.
+        void stop() {
+            {
+                std::lock_guard lock{mutex};
+                if (stopping)
+                    return;
+                stopping = true;
+            }
+            refresh_due.notify_all();
+            ::close(stop_pipe[1]); // Every poll on the read end returns.
+            for (auto &t: threads)
+                t.join();
+            ::close(stop_pipe[0]);
+            ::close(listener);
+            std::error_code ignored;
+            fs::remove(socket_path, ignored);
+        }
+
+        /** Ingest the events and publish a new index if they changed.
+         *
+         * Queries keep being answered from the previous index meanwhile. Errors of ingestion are printed and leave
+         * the previous index in place.
+         *
+         * @return Whether a new index was published.
+         */
+        bool refresh() {
+            std::lock_guard lock{refreshing};
+            try {
+                const auto events = ingest();
+                const auto fingerprint = fingerprint_of(events);
+                if (published && fingerprint == published_fingerprint)
+                    return false;
+                auto index = std::make_unique<const QueryIndex>(QueryIndex::build(events));
+                if (exporter) {
+                    const auto now = date::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+                    exporter->publish(shared_results_of(*index, {}, now));
+                }
+                snapshots.publish(std::move(index));
+                published = true;
+                published_fingerprint = fingerprint;
+                return true;
+            } catch (std::runtime_error &e) {
+                std::cerr << "Could not refresh the events: " << e.what() << std::endl;
+                return false;
+            }
+        }
+
+    private:
+        void keep_current() {
+            std::unique_lock lock{mutex};
+            while (!refresh_due.wait_for(lock, daemon_config.refresh_interval, [this] { return stopping; })) {
+                lock.unlock();
+                refresh();
+                lock.lock();
+            }
+        }
+
+        /// Client of a worker, see \ref serve.
+        struct Connection {
+            int fd;
+            /// Received bytes not yet ending in a line break.
+            std::string pending;
+            std::chrono::steady_clock::time_point active;
+        };
+
+        /** Accept connections and answer the requests of all clients of this worker.
+         *
+         * One poll waits on the listening socket and all clients, so a client keeping its connection open costs
+         * nothing while it sends no request. Requests are only received once they are readable, and answers are sent
+         * with a timeout, such that no client can hold up the others for longer than DaemonConfig::idle_timeout.
+         */
+        void serve() {
+            SnapshotPublisher<QueryIndex>::Reader reader{snapshots};
+            std::vector<Connection> clients;
+            std::vector<pollfd> fds;
+            const auto idle_timeout = daemon_config.idle_timeout;
+            while (true) {
+                // Poll ignores negative descriptors; a worker with too many clients leaves new ones to the others.
+                const bool accepting = clients.size() < config::daemon_connections_per_thread;
+                fds.assign({{stop_pipe[0], POLLIN, 0}, {accepting ? listener : -1, POLLIN, 0}});
+                auto wake = std::chrono::steady_clock::time_point::max();
+                for (const auto &client: clients) {
+                    fds.push_back({client.fd, POLLIN, 0});
+                    wake = std::min(wake, client.active + idle_timeout);
+                }
+                int timeout = -1;
+                if (!clients.empty()) {
+                    const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                            wake - std::chrono::steady_clock::now());
+                    timeout = static_cast<int>(std::max<std::int64_t>(0, left.count()));
+                }
+                if (::poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+                    break;
+                if (fds[0].revents != 0)
+                    break; // The daemon stops.
+
+                const auto now = std::chrono::steady_clock::now();
+                for (std::size_t i = 0; i < clients.size(); ++i) {
+                    auto &client = clients[i];
+                    bool keep = now - client.active < idle_timeout;
+                    if (fds[i + 2].revents != 0) {
+                        keep = answer(client, reader);
+                        client.active = now;
+                    }
+                    if (!keep) {
+                        ::close(client.fd);
+                        client.fd = -1;
+                    }
+                }
+                clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Connection &client) {
+                    return client.fd < 0;
+                }), clients.end());
+
+                if (fds[1].revents != 0) {
+                    const int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (client < 0)
+                        continue; // Taken by another worker, or the client gave up.
+                    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(idle_timeout);
+                    const timeval send_timeout{static_cast<time_t>(seconds.count()),
+                                               static_cast<suseconds_t>((idle_timeout - seconds).count() * 1000)};
+                    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                    clients.push_back({client, {}, now});
+                }
+            }
+            for (const auto &client: clients)
+                ::close(client.fd);
+        }
+
+        /** Receive what a readable client sent and answer every complete line.
+         *
+         * @return False if the connection is to be closed: the client closed it, sent a line longer than
+         * config::daemon_max_request or did not take its answers in time.
+         */
+        bool answer(Connection &client, SnapshotPublisher<QueryIndex>::Reader &reader) const {
+            char buffer[4096];
+            const auto received = ::recv(client.fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR)
+                return true;
+            if (received <= 0)
+                return false;
+            auto &pending = client.pending;
+            pending.append(buffer, static_cast<std::size_t>(received));
+
+            std::string answers;
+            std::size_t begin = 0;
+            for (auto end = pending.find('\n'); end != std::string::npos; end = pending.find('\n', begin)) {
+                const auto request = std::string_view{pending}.substr(begin, end - begin);
+                const auto index = reader.pin();
+                answers += index ? answer_query(*index, request) : "ERR no events yet";
+                answers += '\n';
+                begin = end + 1;
+            }
+            pending.erase(0, begin);
+            return pending.size() <= config::daemon_max_request && detail::send_all(client.fd, answers);
+        }
+
+        fs::path socket_path;
+        Ingest ingest;
+        DaemonConfig daemon_config;
+        int listener = -1;
+        int stop_pipe[2] = {-1, -1};
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable refresh_due;
+        bool stopping = false;
+
+        /// Serializes refreshes; queries never take it.
+        std::mutex refreshing;
+        bool published = false;
+        std::uint64_t published_fingerprint = 0;
+        SnapshotPublisher<QueryIndex> snapshots;
+        std::optional<SharedResultsWriter> exporter;
+    };
+
+    /** Send one request to a \ref QueryDaemon and wait for its answer.
+     *
+     * Throws fs::filesystem_error if the daemon can't be reached or closes the connection without answering.
+     *
+     * @param socket Path of the socket the daemon listens on.
+     * @param request Request without line break, see \ref answer_query.
+     * @return Answer without line break.
+     */
+    std::string query_daemon(const fs::path &socket, std::string_view request) {
+        sockaddr_un address{};
+        const int fd = detail::unix_socket(socket, address);
+        auto fail = [&socket, fd](const char *what) {
+            const int error = errno;
+            ::close(fd);
+            return fs::filesystem_error{what, socket, std::error_code{error, std::generic_category()}};
+        };
+        if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+            throw fail("Could not connect to daemon");
+        if (!detail::send_all(fd, std::string{request} + '\n'))
+            throw fail("Could not send request");
+
+        std::string answer;
+        char buffer[4096];
+        while (answer.find('\n') == std::string::npos) {
+            const auto received = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0) {
+                errno = received == 0 ? ECONNRESET : errno;
+                throw fail("Daemon did not answer");
+            }
+            answer.append(buffer, static_cast<std::size_t>(received));
+        }
+        ::close(fd);
+        answer.resize(answer.find('\n'));
+        return answer;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_DAEMON_HPP
@@ -0,0 +1,214 @@
+#ifndef TIME_AT_ENKLAVE_DATETIME_HPP
+#define TIME_AT_ENKLAVE_DATETIME_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+#include "include/date.h"
+
+namespace enklave {
+    namespace detail {
+        /// Cursor over a date-time value; every reader returns false (and may leave pos anywhere) on malformed input.
+        struct DateCursor {
+            std::string_view text;
+            std::size_t pos = 0;
+
+            bool at_end() const {
+                return pos >= text.size();
+            }
+
+            char peek() const {
+                return at_end() ? '\0' : text[pos];
+            }
+
+            /// Skip folding white space and comments, e.g. "(PDT)"; comments may be nested.
+            void skip_cfws() {
+                while (!at_end()) {
+                    const auto c = text[pos];
+                    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                        ++pos;
+                    } else if (c == '(') {
+                        int depth = 0;
+                        do {
+                            if (text[pos] == '\\')
+                                ++pos;
+                            else if (text[pos] == '(')
+                                ++depth;
+                            else if (text[pos] == ')')
+                                --depth;
+                            ++pos;
+                        } while (depth > 0 && !at_end());
+                    } else {
+                        return;
+                    }
+                }
+            }
+
+            /// Read between min_digits and max_digits decimal digits.
+            bool number(int min_digits, int max_digits, int &value) {
+                int digits = 0;
+                value = 0;
+                while (digits < max_digits && !at_end() && text[pos] >= '0' && text[pos] <= '9') {
+                    value = value * 10 + (text[pos] - '0');
+                    ++pos;
+                    ++digits;
+                }
+                return digits >= min_digits;
+            }
+
+            /// Read a run of ASCII letters.
+            std::string_view word() {
+                const auto begin = pos;
+                while (!at_end() && ((text[pos] >= 'a' && text[pos] <= 'z') || (text[pos] >= 'A' && text[pos] <= 'Z')))
+                    ++pos;
+                return text.substr(begin, pos - begin);
+            }
+
+            bool expect(char c) {
+                if (peek() != c)
+                    return false;
+                ++pos;
+                return true;
+            }
+        };
+
+        constexpr bool equal_ignoring_case(std::string_view a, std::string_view b) {
+            if (a.size() != b.size())
+                return false;
+            for (std::size_t i = 0; i < a.size(); ++i) {
+                if ((a[i] | 0x20) != (b[i] | 0x20))
+                    return false;
+            }
+            return true;
+        }
+
+        /// Month 1 to 12 of an English three-letter abbreviation; 0 if there is none.
+        constexpr unsigned month_of(std::string_view name) {
+            constexpr std::string_view months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep",
+                                                   "Oct", "Nov", "Dec"};
+            for (unsigned i = 0; i < 12; ++i) {
+                if (equal_ignoring_case(name, months[i]))
+                    return i + 1;
+            }
+            return 0;
+        }
+
+        /** Offset from UTC in minutes of a zone name of RFC 5322 section 4.3 ("obs-zone").
+         *
+         * Military zones and unknown names mean "unknown" and are taken as UTC, as the RFC recommends.
+         */
+        constexpr int offset_of_zone_name(std::string_view name) {
+            constexpr struct {
+                std::string_view name;
+                int hours;
+            } zones[] = {{"EST", -5}, {"EDT", -4}, {"CST", -6}, {"CDT", -5}, {"MST", -7}, {"MDT", -6}, {"PST", -8},
+                         {"PDT", -7}};
+            for (const auto &zone: zones) {
+                if (equal_ignoring_case(name, zone.name))
+                    return zone.hours * 60;
+            }
+            return 0; // UT, GMT, Z and unknown zones.
+        }
+    }
+
+    /** Convert an RFC 5322 date-time, e.g. "Fri, 13 Sep 2019 13:44:02 +0200 (CEST)", to UTC.
+     *
+     * The fixed format is read in one pass without allocating: an optional day of the week, day, month name, year
+     * (two- and three-digit years as of RFC 5322 section 4.3), time with optional seconds, and zone. Numeric zones
+     * are applied, obsolete zone names (e.g. "PDT", "GMT") are mapped to their offset, and comments such as "(UTC)"
+     * are skipped wherever white space may appear. A missing zone is taken as UTC. Whatever follows the zone is
+     * ignored.
+     *
+     * @param value Date-time, e.g. the value of a Date field.
+     * @return The point in time in UTC, or an empty optional if value is malformed.
+     */
+    std::optional<date::sys_seconds> parse_rfc5322_date(std::string_view value) noexcept {
+        detail::DateCursor cursor{value};
+        cursor.skip_cfws();
+
+        // Optional day of the week; its name is not checked against the date.
+        if (cursor.peek() > '9') {
+            if (cursor.word().size() != 3)
+                return std::nullopt;
+            cursor.skip_cfws();
+            if (!cursor.expect(','))
+                return std::nullopt;
+            cursor.skip_cfws();
+        }
+
+        int day = 0;
+        int year = 0;
+        int hours = 0;
+        int minutes = 0;
+        int seconds = 0;
+        if (!cursor.number(1, 2, day))
+            return std::nullopt;
+        cursor.skip_cfws();
+        const auto month = detail::month_of(cursor.word());
+        if (month == 0)
+            return std::nullopt;
+        cursor.skip_cfws();
+        const auto year_begin = cursor.pos;
+        if (!cursor.number(2, 4, year))
+            return std::nullopt;
+        const auto year_digits = cursor.pos - year_begin;
+        if (year_digits == 2)
+            year += year < 50 ? 2000 : 1900;
+        else if (year_digits == 3)
+            year += 1900;
+
+        cursor.skip_cfws();
+        if (!cursor.number(2, 2, hours))
+            return std::nullopt;
+        cursor.skip_cfws();
+        if (!cursor.expect(':'))
+            return std::nullopt;
+        cursor.skip_cfws();
+        if (!cursor.number(2, 2, minutes))
+            return std::nullopt;
+        cursor.skip_cfws();
+        if (cursor.expect(':')) {
+            cursor.skip_cfws();
+            if (!cursor.number(2, 2, seconds))
+                return std::nullopt;
+        }
+        // A leap second is kept as the 60th second of its minute.
+        if (hours > 23 || minutes > 59 || seconds > 60)
+            return std::nullopt;
+
+        cursor.skip_cfws();
+        int offset_minutes = 0;
+        if (cursor.peek() == '+' || cursor.peek() == '-') {
+            const bool negative = cursor.peek() == '-';
+            ++cursor.pos;
+            int zone = 0;
+            if (!cursor.number(4, 4, zone) || zone % 100 > 59)
+                return std::nullopt;
+            offset_minutes = (zone / 100 * 60 + zone % 100) * (negative ? -1 : 1);
+        } else {
+            offset_minutes = detail::offset_of_zone_name(cursor.word());
+        }
+
+        const date::year_month_day ymd{date::year{year}, date::month{month}, date::day{static_cast<unsigned>(day)}};
+        if (!ymd.ok())
+            return std::nullopt;
+        return date::sys_days{ymd} + std::chrono::hours{hours} + std::chrono::minutes{minutes - offset_minutes} +
+               std::chrono::seconds{seconds};
+    }
+
+    /** Convert the date-time of a Received field, i.e. everything after its last ";", see \ref parse_rfc5322_date.
+     *
+     * @param value Value of a Received field, e.g. "from mail.example by mx.example; Fri, 13 Sep 2019 11:44:03 +0000".
+     * @return The point in time in UTC, or an empty optional if there is none.
+     */
+    std::optional<date::sys_seconds> parse_received_date(std::string_view value) noexcept {
+        const auto semicolon = value.rfind(';');
+        if (semicolon == std::string_view::npos)
+            return std::nullopt;
+        return parse_rfc5322_date(value.substr(semicolon + 1));
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_DATETIME_HPP
@@ -0,0 +1,115 @@
+#ifndef TIME_AT_ENKLAVE_DEDUP_HPP
+#define TIME_AT_ENKLAVE_DEDUP_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "enklave.hpp"
+
+namespace enklave {
+    /** Set of 64-bit hashes that many threads insert into at once; used to drop mails that were exported twice.
+     *
+     * The set is split into shards selected by the top bits of a hash, each an open-addressing table with linear
+     * probing behind its own mutex, so threads rarely wait on each other. A table holds bare hashes in one flat vector
+     * and doubles once it is half full; an insert usually costs a single probe.
+     */
+    class ConcurrentHashSet {
+    public:
+        /** Insert a hash.
+         *
+         * @param hash Any 64-bit value; hashes are assumed to be well mixed already.
+         * @return true if the hash was not in the set before.
+         */
+        bool insert(std::uint64_t hash) {
+            if (hash == empty)
+                hash = 1; // 0 marks free slots.
+            auto &shard = shards[hash >> (64 - shard_bits)];
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            if (2 * (shard.size + 1) > shard.slots.size())
+                grow(shard);
+            const auto mask = shard.slots.size() - 1;
+            for (auto i = static_cast<std::size_t>(hash) & mask;; i = (i + 1) & mask) {
+                if (shard.slots[i] == hash)
+                    return false;
+                if (shard.slots[i] == empty) {
+                    shard.slots[i] = hash;
+                    ++shard.size;
+                    return true;
+                }
+            }
+        }
+
+        /// Number of hashes in the set.
+        std::size_t size() const {
+            std::size_t result = 0;
+            for (auto &shard: shards) {
+                std::lock_guard<std::mutex> lock{shard.mutex};
+                result += shard.size;
+            }
+            return result;
+        }
+
+    private:
+        static constexpr unsigned shard_bits = 6;
+        static constexpr std::uint64_t empty = 0;
+
+        struct Shard {
+            mutable std::mutex mutex;
+            std::vector<std::uint64_t> slots;
+            std::size_t size = 0;
+        };
+
+        static void grow(Shard &shard) {
+            std::vector<std::uint64_t> old(std::max<std::size_t>(64, 2 * shard.slots.size()), empty);
+            old.swap(shard.slots);
+            const auto mask = shard.slots.size() - 1;
+            for (auto hash: old) {
+                if (hash == empty)
+                    continue;
+                auto i = static_cast<std::size_t>(hash) & mask;
+                while (shard.slots[i] != empty)
+                    i = (i + 1) & mask;
+                shard.slots[i] = hash;
+            }
+        }
+
+        std::array<Shard, std::size_t{1} << shard_bits> shards;
+    };
+
+    /// Spread the bits of a value over all 64 bits of the result (splitmix64 finalizer).
+    std::uint64_t mix_hash(std::uint64_t key) {
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+        return key ^ (key >> 31);
+    }
+
+    /** Key identifying an event for deduplication, or 0 if the identity of the mail it was parsed from is unknown.
+     *
+     * Copies of one mail share the Message-Id (or, without one, the whole header block), time and type. The time and
+     * type are mixed into the key because Message-Ids are not reliably unique across different mails (e.g.
+     * hand-crafted or anonymized samples).
+     */
+    std::uint64_t deduplication_key(const EnklaveEvent &event) {
+        if (event.message_id_hash == 0)
+            return 0;
+        const auto when = static_cast<std::uint64_t>(event.when.time_since_epoch().count());
+        const auto type = static_cast<std::uint64_t>(event.type);
+        return mix_hash(event.message_id_hash ^ (when * 0x9e3779b97f4a7c15ull) ^ type);
+    }
+
+    /** Decide whether an event is the first copy of its mail seen by this set; thread-safe.
+     *
+     * Events without a Message-Id are never considered duplicates.
+     *
+     * @return true if the event must be kept.
+     */
+    bool first_copy(ConcurrentHashSet &seen, const EnklaveEvent &event) {
+        const auto key = deduplication_key(event);
+        return key == 0 || seen.insert(key);
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_DEDUP_HPP
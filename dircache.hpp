@@ -0,0 +1,307 @@
+#ifndef TIME_AT_ENKLAVE_DIRCACHE_HPP
+#define TIME_AT_ENKLAVE_DIRCACHE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "enklave.hpp"
+
+namespace enklave {
+    /// What a scan judges a file or directory by; see detail::stamp_of in scan.hpp.
+    struct FileStamp {
+        /// Last modification, nanoseconds since the epoch.
+        std::int64_t mtime_ns = 0;
+        /// Last status change (st_ctim), nanoseconds since the epoch; the modification time where it is unknown.
+        std::int64_t ctime_ns = 0;
+    };
+
+    /** High-water marks of scanned directories, persisted between runs.
+     *
+     * For every directory listed by a scan, the cache records its modification and status change times, the names of
+     * its subdirectories and the events parsed from its files, protected by a digest. A later scan that finds a
+     * directory with unchanged times skips listing it: the stored events are reused and only the stored
+     * subdirectories are visited. Archives sharded into per-month folders thus only list the current shards.
+     *
+     * Adding, removing or renaming a file updates both times of its directory; editing a file in place does not. The
+     * cache therefore assumes that mails are never modified once written. Tools that restore modification times (e.g.
+     * rsync or tar) can't set back the status change time, so their changes are seen as well.
+     *
+     * Which events a directory yields also depends on the settings of the scan, e.g. the rules; the cache is keyed by
+     * a fingerprint of them (see \ref cache_fingerprint_of) and discarded when they change.
+     *
+     * The cache is loaded before and saved after a run; processes that scan more than once call \ref next_run in
+     * between. During a run it is used by many threads at once.
+     */
+    class DirectoryCache {
+    public:
+        /// Event parsed from a file of a directory.
+        struct CachedEvent {
+            EnklaveEvent event;
+            /// Identity of the file, see MailEntry::file_id; tells copies stored for several links to it apart.
+            std::uint64_t file_id = 0;
+        };
+
+        /// State of one directory.
+        struct Record {
+            std::int64_t mtime_ns = 0;
+            std::int64_t ctime_ns = 0;
+            std::uint64_t digest = 0;
+            std::vector<std::string> subdirectories;
+            std::vector<CachedEvent> events;
+        };
+
+        /** Digest of the stored state of a directory; detects corrupt or hand-edited cache files.
+         *
+         * FNV-1a over the times, subdirectories and events.
+         */
+        static std::uint64_t digest_of(const Record &record) {
+            std::uint64_t hash = 14695981039346656037ull;
+            auto add = [&hash](std::string_view bytes) {
+                for (unsigned char c: bytes) {
+                    hash ^= c;
+                    hash *= 1099511628211ull;
+                }
+            };
+            add(std::to_string(record.mtime_ns));
+            add(std::to_string(record.ctime_ns));
+            for (const auto &name: record.subdirectories)
+                add(name);
+            for (const auto &[event, file_id]: record.events) {
+                add(std::to_string(event.when.time_since_epoch().count()));
+                add(std::to_string(static_cast<int>(event.type)));
+                add(std::to_string(event.message_id_hash));
+                add(std::to_string(file_id));
+                add(event.site);
+                add(event.file.native());
+            }
+            return hash;
+        }
+
+        /// @param configuration Fingerprint of the settings of the scans, see \ref cache_fingerprint_of.
+        explicit DirectoryCache(std::uint64_t configuration = 0) : configuration{configuration} {}
+
+        /** Load the cache from a file written by \ref save.
+         *
+         * A missing file yields an empty cache, and so does a file saved with another configuration. Records with a
+         * wrong digest are dropped, such that their directories are listed again.
+         *
+         * @param f Path to the cache file.
+         */
+        void load(const fs::path &f) {
+            std::ifstream ifs{f};
+            std::string line;
+            if (!getline(ifs, line) || line.compare(0, sizeof(header) - 1, header) != 0)
+                return;
+            if (line != header_line()) {
+                std::cerr << "Directory cache was saved with other settings and is rebuilt: " << f << std::endl;
+                return;
+            }
+
+            std::string directory;
+            Record record;
+            auto finish = [&]() {
+                if (directory.empty())
+                    return;
+                if (digest_of(record) == record.digest)
+                    previous.emplace(std::move(directory), std::move(record));
+                else
+                    std::cerr << "Directory cache entry is corrupt and ignored: " << directory << std::endl;
+                directory.clear();
+                record = Record{};
+            };
+
+            while (getline(ifs, line)) {
+                if (line.size() < 2)
+                    continue;
+                std::istringstream fields{line.substr(2)};
+                switch (line[0]) {
+                    case 'D': {
+                        finish();
+                        fields >> record.mtime_ns >> record.ctime_ns >> std::hex >> record.digest >> std::dec;
+                        fields.get(); // Separator before the path, which may contain spaces.
+                        getline(fields, directory);
+                        break;
+                    }
+                    case 'S':
+                        record.subdirectories.push_back(line.substr(2));
+                        break;
+                    case 'E': {
+                        std::int64_t when = 0;
+                        int type = 0;
+                        std::uint64_t message_id_hash = 0;
+                        std::uint64_t file_id = 0;
+                        std::string site;
+                        fields >> when >> type >> std::hex >> message_id_hash >> file_id >> std::dec >> site;
+                        fields.get();
+                        std::string file;
+                        getline(fields, file);
+                        EnklaveEvent event;
+                        event.type = static_cast<EnklaveEventType>(type);
+                        event.when = date::sys_seconds{std::chrono::seconds{when}};
+                        event.file = file;
+                        event.message_id_hash = message_id_hash;
+                        event.site = std::move(site);
+                        record.events.push_back({std::move(event), file_id});
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+            finish();
+        }
+
+        /// Write all directories seen during this run to a file; it is replaced atomically.
+        void save(const fs::path &f) const {
+            const fs::path temporary = f.string() + ".tmp";
+            {
+                std::ofstream ofs{temporary, std::ios::trunc};
+                ofs << header_line() << '\n';
+                std::lock_guard<std::mutex> lock{mutex};
+                for (const auto &[directory, stored]: current) {
+                    if (incomplete.count(directory) != 0)
+                        continue;
+                    Record record = stored;
+                    record.digest = digest_of(record);
+                    ofs << "D " << record.mtime_ns << ' ' << record.ctime_ns << ' ' << std::hex << record.digest
+                        << std::dec << ' ' << directory << '\n';
+                    for (const auto &name: record.subdirectories)
+                        ofs << "S " << name << '\n';
+                    for (const auto &[event, file_id]: record.events)
+                        ofs << "E " << event.when.time_since_epoch().count() << ' ' << static_cast<int>(event.type)
+                            << ' ' << std::hex << event.message_id_hash << ' ' << file_id << std::dec << ' '
+                            << event.site << ' ' << event.file.native() << '\n';
+                }
+                if (!ofs)
+                    throw fs::filesystem_error{"Could not write directory cache", temporary,
+                                               std::make_error_code(std::errc::io_error)};
+            }
+            fs::rename(temporary, f);
+        }
+
+        /** Reuse the stored state of a directory if it did not change since it was cached.
+         *
+         * On success, the stored events are kept for \ref take_reused_events and the record is carried over to the
+         * saved cache.
+         *
+         * @param directory Path of the directory as built by the scan.
+         * @param stamp Stamp of the directory, taken before it would be listed.
+         * @return Stored record or nullptr if the directory must be listed.
+         */
+        const Record *reuse(const fs::path &directory, const FileStamp &stamp) {
+            const auto found = previous.find(directory.native());
+            if (found == previous.end() || found->second.mtime_ns != stamp.mtime_ns ||
+                found->second.ctime_ns != stamp.ctime_ns)
+                return nullptr;
+
+            std::lock_guard<std::mutex> lock{mutex};
+            reused_events.insert(reused_events.end(), found->second.events.begin(), found->second.events.end());
+            current[found->first] = found->second;
+            ++reused_directories;
+            return &found->second;
+        }
+
+        /** Record a directory that was just listed.
+         *
+         * @param directory Path of the directory as built by the scan.
+         * @param stamp Stamp of the directory, taken before it was listed.
+         * @param subdirectories Names of the subdirectories found.
+         */
+        void listed(const fs::path &directory, const FileStamp &stamp, std::vector<std::string> subdirectories) {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto &record = current[directory.native()];
+            record.mtime_ns = stamp.mtime_ns;
+            record.ctime_ns = stamp.ctime_ns;
+            record.subdirectories = std::move(subdirectories);
+        }
+
+        /** Attribute an event parsed during this run to the directory of its file.
+         *
+         * The directory may still be listed; events of directories that are never recorded by \ref listed keep a
+         * modification time of 0 and are thus never reused.
+         *
+         * @param event Parsed event.
+         * @param file_id Identity of its file, see MailEntry::file_id; 0 if unknown.
+         */
+        void add_event(const EnklaveEvent &event, std::uint64_t file_id) {
+            std::lock_guard<std::mutex> lock{mutex};
+            current[event.file.parent_path().native()].events.push_back({event, file_id});
+        }
+
+        /** Mark a directory as incomplete: a file in it could not be read during this run (e.g. an I/O error, a file
+         * still being written, or a corrupt compressed file). The directory is not saved, such that the next run
+         * lists it again and retries the file.
+         */
+        void failed(const fs::path &directory) {
+            std::lock_guard<std::mutex> lock{mutex};
+            incomplete.insert(directory.native());
+        }
+
+        /** Start another run with the same cache, e.g. the next refresh of a daemon.
+         *
+         * @param completed Whether this run finished. The directories seen by a finished run become the stored
+         * state, as if the cache was saved and loaded again; directories with files that could not be read are
+         * dropped, such that they are listed again. What an aborted run saw may lack events and is discarded.
+         */
+        void next_run(bool completed = true) {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (completed) {
+                for (const auto &directory: incomplete)
+                    current.erase(directory);
+                previous = std::move(current);
+            }
+            current.clear();
+            incomplete.clear();
+            reused_events.clear();
+            reused_directories = 0;
+        }
+
+        /** Events of all directories reused during this run; moved out of the cache.
+         *
+         * A file reached through several links is stored in the directory of each of them; its copies share their
+         * CachedEvent::file_id.
+         */
+        std::vector<CachedEvent> take_reused_events() {
+            std::lock_guard<std::mutex> lock{mutex};
+            return std::move(reused_events);
+        }
+
+        /// Number of directories that were skipped during this run.
+        std::size_t reused() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            return reused_directories;
+        }
+
+    private:
+        static constexpr char header[] = "enklave-directory-cache 6";
+
+        /// First line of a cache file: format version and configuration.
+        std::string header_line() const {
+            std::ostringstream line;
+            line << header << ' ' << std::hex << configuration;
+            return line.str();
+        }
+
+        std::uint64_t configuration;
+
+        /// Loaded from disk; read-only during a run.
+        std::unordered_map<std::string, Record> previous;
+        mutable std::mutex mutex;
+        /// Directories seen during this run.
+        std::unordered_map<std::string, Record> current;
+        /// Directories seen during this run with files that could not be read, see \ref failed.
+        std::unordered_set<std::string> incomplete;
+        std::vector<CachedEvent> reused_events;
+        std::size_t reused_directories = 0;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_DIRCACHE_HPP
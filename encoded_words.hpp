@@ -0,0 +1,242 @@
+#ifndef TIME_AT_ENKLAVE_ENCODED_WORDS_HPP
+#define TIME_AT_ENKLAVE_ENCODED_WORDS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace enklave {
+    namespace detail {
+        /// Value of every base64 digit, -1 for other bytes.
+        constexpr std::array<std::int8_t, 256> base64_values = [] {
+            std::array<std::int8_t, 256> values{};
+            for (auto &value: values)
+                value = -1;
+            constexpr std::string_view digits{"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+            for (std::size_t i = 0; i < digits.size(); ++i)
+                values[static_cast<unsigned char>(digits[i])] = static_cast<std::int8_t>(i);
+            return values;
+        }();
+
+        constexpr int hex_value(char c) noexcept {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        }
+
+        constexpr char ascii_lower(char c) noexcept {
+            return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+        }
+
+        /// An encoded-word "=?charset?encoding?text?=" (RFC 2047).
+        struct EncodedWord {
+            std::string_view charset;
+            /// 'q' or 'b'.
+            char encoding;
+            std::string_view text;
+            /// Position just after the closing "?=".
+            std::size_t end;
+        };
+
+        /// Parse the encoded-word starting at data[pos]; false if there is none (it is then taken literally).
+        bool encoded_word_at(std::string_view data, std::size_t pos, EncodedWord &word) noexcept {
+            if (data.compare(pos, 2, "=?") != 0)
+                return false;
+            const auto charset_end = data.find('?', pos + 2);
+            if (charset_end == std::string_view::npos || charset_end + 2 >= data.size() ||
+                data[charset_end + 2] != '?')
+                return false;
+            const auto encoding = ascii_lower(data[charset_end + 1]);
+            if (encoding != 'q' && encoding != 'b')
+                return false;
+            const auto text_begin = charset_end + 3;
+            const auto text_end = data.find("?=", text_begin);
+            if (text_end == std::string_view::npos)
+                return false;
+            // Encoded-words contain no blanks; a "?=" further away belongs to something else.
+            const auto text = data.substr(text_begin, text_end - text_begin);
+            if (text.find_first_of(" \t\r\n") != std::string_view::npos)
+                return false;
+            word = EncodedWord{data.substr(pos + 2, charset_end - pos - 2), encoding, text, text_end + 2};
+            return true;
+        }
+
+        /// Charsets with one byte per character, in which 0xA0 is a no-break space.
+        bool is_single_byte_charset(std::string_view charset) noexcept {
+            auto starts_with = [&charset](std::string_view prefix) {
+                if (charset.size() < prefix.size())
+                    return false;
+                for (std::size_t i = 0; i < prefix.size(); ++i) {
+                    if (ascii_lower(charset[i]) != prefix[i])
+                        return false;
+                }
+                return true;
+            };
+            return starts_with("iso-8859-") || starts_with("windows-125") || starts_with("latin");
+        }
+
+        template<typename Sink>
+        void decode_q(std::string_view text, bool single_byte, Sink &sink) {
+            for (std::size_t i = 0; i < text.size(); ++i) {
+                auto c = text[i];
+                if (c == '_') {
+                    c = ' ';
+                } else if (c == '=' && i + 2 < text.size() && hex_value(text[i + 1]) >= 0 &&
+                           hex_value(text[i + 2]) >= 0) {
+                    c = static_cast<char>(hex_value(text[i + 1]) << 4 | hex_value(text[i + 2]));
+                    i += 2;
+                }
+                sink(single_byte && static_cast<unsigned char>(c) == 0xA0 ? ' ' : c);
+            }
+        }
+
+        /* Four digits are combined into one 24 bit group and emitted as three bytes; encoded-words are at most 75
+         * characters long, so a table lookup per digit is all there is to it.
+         */
+        template<typename Sink>
+        void decode_b(std::string_view text, bool single_byte, Sink &sink) {
+            std::uint32_t group = 0;
+            int digits = 0;
+            auto emit = [&](std::uint32_t byte) {
+                const auto c = static_cast<char>(byte & 0xff);
+                sink(single_byte && (byte & 0xff) == 0xA0 ? ' ' : c);
+            };
+            for (unsigned char c: text) {
+                const auto value = base64_values[c];
+                if (value < 0)
+                    continue; // Padding, or a malformed digit that is skipped.
+                group = group << 6 | static_cast<std::uint32_t>(value);
+                if (++digits == 4) {
+                    emit(group >> 16);
+                    emit(group >> 8);
+                    emit(group);
+                    group = 0;
+                    digits = 0;
+                }
+            }
+            // Two or three digits before the padding hold one or two bytes.
+            if (digits == 2) {
+                emit(group >> 4);
+            } else if (digits == 3) {
+                emit(group >> 10);
+                emit(group >> 2);
+            }
+        }
+    }
+
+    /** Decode the encoded-words (RFC 2047, "Q" and "B" encoding) of an unstructured header value, e.g. a Subject.
+     *
+     * Decoding streams into sink, called with every decoded byte; nothing is allocated. Blanks between two adjacent
+     * encoded-words are dropped, as the RFC requires. Text outside of encoded-words and malformed encoded-words are
+     * passed through unchanged. Bytes are not converted between charsets, except that a no-break space in a
+     * single-byte charset (e.g. ISO-8859-1) becomes a space.
+     *
+     * @param value Raw header value.
+     * @param sink Callable taking a char.
+     */
+    template<typename Sink>
+    void decode_encoded_words(std::string_view value, Sink &&sink) {
+        std::size_t pos = 0;
+        detail::EncodedWord word{};
+        while (pos < value.size()) {
+            const auto c = value[pos];
+            if (c == '=' && detail::encoded_word_at(value, pos, word)) {
+                const bool single_byte = detail::is_single_byte_charset(word.charset);
+                if (word.encoding == 'q')
+                    detail::decode_q(word.text, single_byte, sink);
+                else
+                    detail::decode_b(word.text, single_byte, sink);
+                pos = word.end;
+                // Look ahead over blanks (including folding) for the next encoded-word.
+                const auto next = value.find_first_not_of(" \t\r\n", pos);
+                if (next != std::string_view::npos && next != pos && detail::encoded_word_at(value, next, word))
+                    pos = next;
+                continue;
+            }
+            sink(c);
+            ++pos;
+        }
+    }
+
+    /** Sink appending decoded text to a string with normalized whitespace, for matching literals.
+     *
+     * Runs of blanks, line endings and no-break spaces (U+00A0 in UTF-8) become one space; leading and trailing
+     * whitespace is dropped. Call \ref finish after the last byte.
+     */
+    class TextNormalizer {
+    public:
+        explicit TextNormalizer(std::string &text) : text{text} {}
+
+        void operator()(char c) {
+            const auto byte = static_cast<unsigned char>(c);
+            if (pending_c2) {
+                pending_c2 = false;
+                if (byte == 0xA0) {
+                    pending_space = true;
+                    return;
+                }
+                put('\xC2');
+            }
+            if (byte == 0xC2)
+                pending_c2 = true;
+            else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+                pending_space = true;
+            else
+                put(c);
+        }
+
+        void finish() {
+            if (pending_c2)
+                put('\xC2');
+            pending_c2 = false;
+        }
+
+    private:
+        void put(char c) {
+            if (pending_space) {
+                if (!text.empty())
+                    text += ' ';
+                pending_space = false;
+            }
+            text += c;
+        }
+
+        std::string &text;
+        bool pending_space = false;
+        // First byte of a UTF-8 no-break space.
+        bool pending_c2 = false;
+    };
+
+    /** Decode a header value (see \ref decode_encoded_words) and normalize its whitespace, for matching literals.
+     *
+     * Whitespace is normalized by a \ref TextNormalizer, including the line endings of folded lines, so
+     * "=?utf-8?q?Confirmation:_=C2=A0Check_in?=" becomes "Confirmation: Check in".
+     *
+     * @param value Raw header value.
+     * @param text Receives the result; its previous content is dropped, but its capacity is reused, so a buffer
+     * refilled for every mail stops allocating once it fits the longest value.
+     * @return View of text.
+     */
+    std::string_view decode_header_text(std::string_view value, std::string &text) {
+        text.clear();
+        TextNormalizer normalize{text};
+        decode_encoded_words(value, normalize);
+        normalize.finish();
+        return text;
+    }
+
+    /// Same as \ref decode_header_text for a literal, e.g. a pattern of a rules file.
+    std::string normalize_header_text(std::string_view value) {
+        std::string text;
+        decode_header_text(value, text);
+        return text;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_ENCODED_WORDS_HPP
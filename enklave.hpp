@@ -2,14 +2,34 @@
 #define TIME_AT_ENKLAVE_ENKLAVE_HPP
 
 #include <algorithm>
+#include <cerrno>
+#include <cctype>
 #include <chrono>
+#include <cstdint>
 #include <fstream>
+#include <iostream>
+#include <memory>
 #include <numeric>
 #include <optional>
-#include <regex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "include/date.h"
+#include "compression.hpp"
 #include "config.hpp"
+#include "datetime.hpp"
+#include "encoded_words.hpp"
+#include "header_scan.hpp"
+#include "profile.hpp"
+#include "rules.hpp"
+#include "timing.hpp"
 
 // Filesystem needs some care on different compilers.
 #include <filesystem>
@@ -37,6 +57,12 @@ namespace enklave {
         EnklaveEventType type = EnklaveEventType::UNDEFINED;
         date::sys_seconds when; // Default initializes to 0 that corresponds to 1970-01-01 00:00:00.
         fs::path file; // Default initializes to empty path.
+        /** Hash of the Message-Id (or X-Pm-External-Id) of the mail, or of its whole header block if it has neither; 0
+         * if unknown. See \ref deduplication_key.
+         */
+        std::uint64_t message_id_hash = 0;
+        /// Name of the site the mail is from, see \ref SiteRules.
+        std::string site;
 
         bool operator<(const EnklaveEvent &rhs) {
             return this->when < rhs.when;
@@ -75,7 +101,7 @@ namespace enklave {
      * If the string can't be converted to date::sys_seconds or is shorter then 16 character, an empty optional is
      * returned.
      *
-     * Note: timezones will be stripped away.
+     * Note: timezones will be stripped away. Mails are parsed with \ref parse_rfc5322_date instead, which applies them.
      *
      * Very unlikely, but possible, this function can throw a bad_alloc exception.
      *
@@ -105,104 +131,696 @@ namespace enklave {
     }
 
 
-    /** Parse a file from top to bottom line-by-line.
+    namespace detail {
+        /** Value of a header field if line starts with its name; field names are case-insensitive.
+         *
+         * @param line Header line without line ending.
+         * @param name Field name including the colon, e.g. "Message-Id:".
+         * @return Value without surrounding whitespace, or an empty optional if line holds another field.
+         */
+        std::optional<std::string_view> header_field(std::string_view line, std::string_view name) noexcept {
+            if (line.size() < name.size())
+                return std::nullopt;
+            for (std::size_t i = 0; i < name.size(); ++i) {
+                const auto c = static_cast<unsigned char>(line[i]);
+                if (std::tolower(c) != std::tolower(static_cast<unsigned char>(name[i])))
+                    return std::nullopt;
+            }
+            line.remove_prefix(name.size());
+            const auto begin = line.find_first_not_of(" \t");
+            if (begin == std::string_view::npos)
+                return std::string_view{};
+            return line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+        }
+
+        /// Value without surrounding blanks and line endings, e.g. of a folded field.
+        std::string_view trim_blanks(std::string_view value) noexcept {
+            const auto begin = value.find_first_not_of(" \t\r\n");
+            if (begin == std::string_view::npos)
+                return {};
+            return value.substr(begin, value.find_last_not_of(" \t\r\n") + 1 - begin);
+        }
+
+        /// FNV-1a hash of a header value.
+        std::uint64_t hash_of(std::string_view value) noexcept {
+            std::uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c: value) {
+                hash ^= c;
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+    }
+
+    /** Find the end of the header block of a mail, i.e. the first empty line.
      *
-     * The returned object contains the information if it was a check-in or a check-out and when it happened.
-     * This function can throw runtime_errors for various reasons and thus will either throw or return a value.
+     * Both "\n" and "\r\n" line endings are supported.
      *
-     * @param f Path to a file
-     * @return EnklaveEvent.
+     * @param data Raw bytes of a mail, starting with its first header line.
+     * @param from Position to start searching for line endings; lets callers resume a search on growing data.
+     * @return Position just after the empty line, or npos if data contains no empty line.
      */
-    EnklaveEvent parse_file(const fs::path &f) noexcept(false) {
-        // Regex expressions used to extract required values from file.
+    std::size_t find_header_end(std::string_view data, std::size_t from = 0) noexcept {
+        for (auto pos = data.find('\n', from); pos != std::string_view::npos; pos = data.find('\n', pos + 1)) {
+            const auto next = pos + 1;
+            if (next < data.size() && data[next] == '\n')
+                return next + 1;
+            if (next + 1 < data.size() && data[next] == '\r' && data[next + 1] == '\n')
+                return next + 2;
+        }
+        return std::string_view::npos;
+    }
 
-        // File is from enklave (and thus relevant) if it contains a line with "header.from=enklave.de".
-        const std::regex is_from_enklave_regex{"header.from=enklave.de"};
+    /** Read the header block of a mail, i.e. everything up to the first empty line, from any source.
+     *
+     * Only the header is relevant to classify a mail, so the (potentially large) body is never read.
+     * Compressed files (see \ref compression_of) are decompressed on the fly only until the header block ends; this
+     * throws a runtime_error if the file is corrupt or the format is not supported by this build.
+     *
+     * @param header Receives the raw bytes of the header block, line endings included. Its previous content is
+     * dropped, but its capacity is reused; a buffer that is refilled for every mail stops allocating once it fits
+     * the largest header.
+     * @param read_input Called as read_input(buffer, size) to read the next bytes of the file; returns the number of
+     * bytes read, 0 at the end of the file or on errors.
+     * @param compression Format of the file.
+     * @param name Name of the file used in error messages.
+     */
+    template<typename String, typename ReadInput>
+    void read_header_into(String &header, ReadInput &&read_input, Compression compression,
+                          const std::string &name) noexcept(false) {
+        constexpr std::size_t chunk_size = 4096;
+        std::size_t end = std::string::npos;
+        header.clear();
+
+        if (compression != Compression::NONE) {
+            const auto decompressed = decompress_prefix(read_input, compression, [&end](const std::string &output,
+                                                                                         std::size_t old_size) {
+                end = find_header_end(output, old_size < 3 ? 0 : old_size - 3);
+                return end != std::string::npos;
+            }, name);
+            header.assign(decompressed.data(), std::min(end, decompressed.size()));
+            return;
+        }
+
+        for (;;) {
+            const auto old_size = header.size();
+            header.resize(old_size + chunk_size);
+            const auto read = read_input(header.data() + old_size, chunk_size);
+            header.resize(old_size + read);
+            if (read == 0)
+                return;
+
+            // Start a bit before the new chunk such that an empty line crossing the chunk boundary is found as well.
+            end = find_header_end(header, old_size < 3 ? 0 : old_size - 3);
+            if (end != std::string::npos) {
+                header.resize(end);
+                return;
+            }
+        }
+    }
 
-        // File is a check-in if it contains a line that starts with "Subject:" and contains "Check_in".
-        const std::regex check_in_regex("(^Subject).*Check_in");
+    /** Read the first bytes of a file, see \ref read_header_into; used where the header block is not enough.
+     *
+     * @param prefix Receives at most limit bytes (after decompression); its capacity is reused.
+     * @param read_input See \ref read_header_into.
+     * @param compression Format of the file.
+     * @param name Name of the file used in error messages.
+     * @param limit Maximum number of bytes.
+     */
+    template<typename String, typename ReadInput>
+    void read_prefix_into(String &prefix, ReadInput &&read_input, Compression compression, const std::string &name,
+                          std::size_t limit) noexcept(false) {
+        constexpr std::size_t chunk_size = 4096;
+        prefix.clear();
+
+        if (compression != Compression::NONE) {
+            const auto decompressed = decompress_prefix(read_input, compression, [limit](const std::string &output,
+                                                                                         std::size_t) {
+                return output.size() >= limit;
+            }, name);
+            prefix.assign(decompressed.data(), std::min(limit, decompressed.size()));
+            return;
+        }
 
-        // File is a check-out if it contains a line that starts with "Subject:" and contains "Check out".
-        const std::regex check_out_regex("(^Subject).*Check out");
+        while (prefix.size() < limit) {
+            const auto old_size = prefix.size();
+            const auto size = std::min(chunk_size, limit - old_size);
+            prefix.resize(old_size + size);
+            const auto read = read_input(prefix.data() + old_size, size);
+            prefix.resize(old_size + read);
+            if (read == 0)
+                return;
+        }
+    }
 
-        // The datetime that should be used is contained in a line that starts with "X-Pm-Date:".
-        const std::regex date_regex("^X-Pm-Date:");
+    /** Read the header block of a mail into a new string, see \ref read_header_into.
+     *
+     * @tparam String std::string or std::pmr::string.
+     * @param allocator Allocates the returned string.
+     * @return String with the raw bytes of the header block, line endings included.
+     */
+    template<typename String = std::string, typename ReadInput>
+    String read_header_from(ReadInput &&read_input, Compression compression, const std::string &name,
+                            const typename String::allocator_type &allocator = {}) noexcept(false) {
+        String header{allocator};
+        read_header_into(header, read_input, compression, name);
+        return header;
+    }
 
-        EnklaveEvent result;
-        std::ifstream ifs{f};
-        std::string line;
-        bool isCheckIn = false;
-        bool isCheckOut = false;
+    /** Read the header block of a mail file, see \ref read_header_from.
+     *
+     * If the file can't be opened or is empty, an empty string is returned.
+     *
+     * @param f Path to a file.
+     * @param allocator Allocates the returned string.
+     * @return String with the raw bytes of the header block, line endings included.
+     */
+    template<typename String = std::string>
+    String read_header(const fs::path &f, const typename String::allocator_type &allocator = {}) noexcept(false) {
+        std::ifstream ifs{f, std::ios::binary};
+        return read_header_from<String>([&ifs](char *buffer, std::size_t size) {
+            ifs.read(buffer, static_cast<std::streamsize>(size));
+            return static_cast<std::size_t>(ifs.gcount());
+        }, compression_of(f), f.string(), allocator);
+    }
 
-        if (!getline(ifs, line)) {
-            throw std::runtime_error{"Could not open file or get the first line: " + f.string()};
+    /** Buffers reused by every mail parsed on one thread, such that parsing stops allocating once they have grown to
+     * the largest mail seen.
+     *
+     * A context owns the buffer headers are read into, the field starts of the header (see \ref find_field_starts),
+     * the buffer for decoded header values, and the time spent parsing datetimes, and (on Linux) reads files through
+     * a plain file descriptor instead of a std::ifstream with its own buffer. Use one context per thread; a context
+     * is not thread-safe.
+     *
+     * A context also refers to the rules mails are classified by: the \ref builtin_profiles, or the rules of a
+     * \ref Classifier that must outlive the context.
+     */
+    class ParseContext {
+    public:
+        /// @param classifier Runtime rules, e.g. loaded with --rules; nullptr selects the built-in profiles.
+        explicit ParseContext(const Classifier *classifier = nullptr) : rules{classifier} {}
+
+        /// Runtime rules mails are classified by, or nullptr for the built-in profiles.
+        const Classifier *classifier() const {
+            return rules;
         }
 
-        // First line in file must contain is_from_enklave_regex.
-        if (!regex_search(line, is_from_enklave_regex)) {
-            throw std::runtime_error{"Parsed file is not an email from enklave: " + f.string()};
+        /// Time spent converting datetimes (see detail::finish_event) since the context was constructed.
+        std::chrono::nanoseconds date_parsing_time() const {
+            return date_parsing;
         }
 
-        /* After the first line was parsed, read the rest of the file from top to bottom and assume:
-         * - First check_in_regex OR check_out_regex appears in file determining which event it was.
-         * - In the lines afterwards the datetime of the event is found.
+        /// Number of mails whose datetime was converted since the context was constructed.
+        std::uint64_t dated_mails() const {
+            return dated;
+        }
+
+        void add_date_parsing(std::chrono::nanoseconds time) {
+            date_parsing += time;
+            ++dated;
+        }
+
+        /** Read the header block of a mail file into the buffer of this context, see \ref read_header.
+         *
+         * @param f Path to a file.
+         * @return View of the header block; valid until the next call.
          */
-        while (getline(ifs, line)) {
-            // Does the actual line identify a check-in?
-            if (regex_search(line, check_in_regex))
-                isCheckIn = true;
-
-            // Does the actual line identify a check-out?
-            if (regex_search(line, check_out_regex))
-                isCheckOut = true;
-
-            // If a valid datetime pattern is found.
-            if (regex_search(line, date_regex)) {
-                if (!isCheckIn && !isCheckOut) {
-                    throw std::runtime_error{"Parsed file is neither a check-in nor a check-out: " + f.string()};
-                } // Assume no file that is a check-in AND a check-out exists.
-
-                // Parse datetime.
-                auto datetime = parse_datetime(line);
-                if (!datetime) {
-                    throw std::runtime_error{"Datetime could not be parsed: " + f.string()};
-                }
+        std::string_view read_header(const fs::path &f) noexcept(false) {
+            read_file(f, header, [&f, this](auto &&read_input) {
+                read_header_into(header, read_input, compression_of(f), f.string());
+            });
+            return header;
+        }
+
+        /** Read the first bytes of a mail file into a buffer of this context, see \ref read_prefix_into.
+         *
+         * @param f Path to a file.
+         * @param limit Maximum number of bytes.
+         * @return View of the bytes; valid until the next call. Empty if the file can't be opened.
+         */
+        std::string_view read_prefix(const fs::path &f, std::size_t limit) noexcept(false) {
+            read_file(f, prefix, [&f, limit, this](auto &&read_input) {
+                read_prefix_into(prefix, read_input, compression_of(f), f.string(), limit);
+            });
+            return prefix;
+        }
+
+        /// Decoded header value in a buffer of this context, see \ref decode_header_text; valid until the next call.
+        std::string_view decode_header_text(std::string_view value) {
+            return enklave::decode_header_text(value, text);
+        }
+
+        /// Buffer of \ref read_prefix, for the first bytes of a mail read by other means, e.g. relative to a directory.
+        std::string &prefix_buffer() {
+            return prefix;
+        }
+
+        /// Buffer for decoded text, e.g. of a mail body; its content is overwritten by \ref decode_header_text.
+        std::string &text_buffer() {
+            return text;
+        }
+
+        /// Start of every field of header, see \ref find_field_starts; valid until the next call.
+        const std::vector<std::uint32_t> &field_starts(std::string_view header) {
+            find_field_starts(header, starts);
+            return starts;
+        }
+
+    private:
+        /// Call fill with a read_input (see \ref read_header_into) reading f; buffer is cleared if f can't be opened.
+        template<typename Fill>
+        static void read_file(const fs::path &f, std::string &buffer, Fill &&fill) noexcept(false) {
+#ifdef __linux__
+            const int fd = ::open(f.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                buffer.clear();
+                return;
+            }
+            try {
+                fill([fd](char *data, std::size_t size) -> std::size_t {
+                    for (;;) {
+                        const auto read = ::read(fd, data, size);
+                        if (read >= 0)
+                            return static_cast<std::size_t>(read);
+                        if (errno != EINTR)
+                            return 0;
+                    }
+                });
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+#else
+            std::ifstream ifs{f, std::ios::binary};
+            fill([&ifs](char *data, std::size_t size) {
+                ifs.read(data, static_cast<std::streamsize>(size));
+                return static_cast<std::size_t>(ifs.gcount());
+            });
+#endif
+        }
+
+        const Classifier *rules;
+        std::string header;
+        std::string prefix;
+        std::vector<std::uint32_t> starts;
+        std::string text;
+        std::chrono::nanoseconds date_parsing{0};
+        std::uint64_t dated = 0;
+    };
+
+    /** Thrown for a mail of a known site whose header says neither check-in nor check-out.
+     *
+     * Callers with access to the body of the mail can still classify it, see \ref classify_by_body; all others treat
+     * it like any other runtime_error.
+     */
+    class InconclusiveMail : public std::runtime_error {
+    public:
+        InconclusiveMail(const std::string &what, EnklaveEvent event) : std::runtime_error{what},
+                                                                         event{std::move(event)} {}
+
+        /// Everything but the type: site, time, file and identity of the mail.
+        EnklaveEvent event;
+    };
+
+    namespace detail {
+        /// Identity of a mail; X-Pm-External-Id is only used if there is no Message-Id.
+        struct MailIdentity {
+            std::string_view message_id;
+            std::string_view external_id;
+
+            void note(std::string_view line) {
+                if (const auto value = header_field(line, "Message-Id:"))
+                    message_id = *value;
+                else if (const auto value = header_field(line, "X-Pm-External-Id:"))
+                    external_id = *value;
+            }
+
+            std::uint64_t hash() const {
+                if (!message_id.empty())
+                    return hash_of(message_id);
+                if (!external_id.empty())
+                    return hash_of(external_id);
+                return 0;
+            }
+        };
 
-                if (isCheckIn)
-                    result = EnklaveEvent{EnklaveEventType::CHECK_IN, datetime.value(), f};
-                if (isCheckOut)
-                    result = EnklaveEvent{EnklaveEventType::CHECK_OUT, datetime.value(), f};
+        /** Time of a mail without a usable timestamp field of its site: from the last Received field, or else from
+         * the Date field.
+         *
+         * Only called for the few mails that need it, so the header is searched for the fields here instead of on the
+         * common path.
+         */
+        std::optional<date::sys_seconds> fallback_time(ParseContext &context, std::string_view header) {
+            static const FieldNames names{"Received", "Date"};
+            std::optional<std::string_view> received;
+            std::optional<std::string_view> date;
+            const auto &starts = context.field_starts(header);
+            for (std::size_t k = 0; k < starts.size(); ++k) {
+                const auto name = names.match(header, starts[k]);
+                if (name == FieldNames::npos)
+                    continue;
+                const std::size_t end = k + 1 < starts.size() ? starts[k + 1] : header.size();
+                const auto value = header.substr(starts[k] + names.length(name), end - starts[k] - names.length(name));
+                if (name == 0)
+                    received = value;
+                else if (!date)
+                    date = value;
+            }
+            if (received) {
+                if (const auto when = parse_received_date(*received))
+                    return when;
+            }
+            if (date)
+                return parse_rfc5322_date(*date);
+            return std::nullopt;
+        }
 
-                // Above runtime_erros cover parsing errors such that no sanity check on result is implemented here.
+        /** Complete result once the whole header block of a mail from site was read.
+         *
+         * The time is taken from the timestamp field of the site (e.g. X-Pm-Date) if it parses, see
+         * \ref parse_rfc5322_date, and from \ref fallback_time otherwise. Throws runtime_error if neither has a time,
+         * and \ref InconclusiveMail if the mail is neither a check-in nor a check-out.
+         *
+         * @param timestamp Value of the first timestamp field of the site, if any.
+         */
+        template<typename PathOfFile>
+        void finish_event(ParseContext &context, std::string_view header, std::optional<std::string_view> timestamp,
+                          bool isCheckIn, bool isCheckOut, const MailIdentity &identity, std::string_view site,
+                          EnklaveEvent &result, PathOfFile &&path_of_file) noexcept(false) {
+            // Two clock reads per mail; negligible next to reading its header.
+            const auto dating_start = std::chrono::steady_clock::now();
+            std::optional<date::sys_seconds> when;
+            if (timestamp)
+                when = parse_rfc5322_date(*timestamp);
+            if (!when)
+                when = fallback_time(context, header);
+            context.add_date_parsing(std::chrono::steady_clock::now() - dating_start);
+            if (!when) {
+                throw std::runtime_error{"Datetime could not be parsed: " + fs::path{path_of_file()}.string()};
             }
+
+            result.when = *when;
+            // Assume no file that is a check-in AND a check-out exists.
+            if (isCheckIn)
+                result.type = EnklaveEventType::CHECK_IN;
+            else if (isCheckOut)
+                result.type = EnklaveEventType::CHECK_OUT;
+            result.site = site;
+            result.file = path_of_file();
+            // Without a Message-Id, the header block as a whole identifies the mail, e.g. across Maildir renames.
+            result.message_id_hash = identity.hash();
+            if (result.message_id_hash == 0)
+                result.message_id_hash = hash_of(header);
+            if (result.type == EnklaveEventType::UNDEFINED)
+                throw InconclusiveMail{"Parsed file is neither a check-in nor a check-out: " + result.file.string(),
+                                       std::move(result)};
+        }
+
+        /** Classify a header block by one compiled profile, see \ref parse_header_with.
+         *
+         * @return False if the first field matches no sender rule of the profile; result is untouched then.
+         */
+        template<const auto &Profile, typename PathOfFile>
+        bool parse_header_with_profile(ParseContext &context, std::string_view header, PathOfFile &&path_of_file,
+                                       EnklaveEvent &result) noexcept(false) {
+            static_assert(dsl::is_valid(Profile), "A profile needs sender (first field only), check-in, check-out and "
+                                                  "timestamp rules");
+            static constexpr auto fields = dsl::fields_of(Profile);
+            // The fields identifying a mail come first, then the fields of the rules.
+            constexpr std::size_t identity_fields = 2;
+            static const FieldNames names = [] {
+                std::vector<std::string_view> all{"Message-Id", "X-Pm-External-Id"};
+                all.insert(all.end(), fields.names.begin(), fields.names.begin() + fields.size);
+                return FieldNames{all};
+            }();
+
+            const auto &starts = context.field_starts(header);
+            // Field k with its continuation lines and line ending.
+            auto field_at = [&](std::size_t k) {
+                const std::size_t end = k + 1 < starts.size() ? starts[k + 1] : header.size();
+                return header.substr(starts[k], end - starts[k]);
+            };
+
+            const auto first = field_at(0);
+            bool from_site = false;
+            dsl::for_each_rule<Profile>([&](auto index) {
+                constexpr auto rule = Profile.rules[decltype(index)::value];
+                if constexpr (rule.action == dsl::Action::SENDER)
+                    from_site = from_site || first.find(rule.needle) != std::string_view::npos;
+            });
+            if (!from_site)
+                return false;
+
+            bool isCheckIn = false;
+            bool isCheckOut = false;
+            std::optional<std::string_view> timestamp;
+            MailIdentity identity;
+            for (std::size_t k = 1; k < starts.size(); ++k) {
+                const auto name = names.match(header, starts[k]);
+                if (name == FieldNames::npos)
+                    continue;
+                const auto field = field_at(k);
+                const auto value = field.substr(names.length(name));
+                if (name == 0) {
+                    identity.message_id = trim_blanks(value);
+                    continue;
+                }
+                if (name == 1) {
+                    identity.external_id = trim_blanks(value);
+                    continue;
+                }
+
+                // Values are decoded (RFC 2047) once, and only for fields with contains() rules, i.e. the Subject.
+                std::optional<std::string_view> decoded;
+                auto decoded_value = [&]() {
+                    if (!decoded)
+                        decoded = context.decode_header_text(value);
+                    return *decoded;
+                };
+
+                // Unrolled for every rule; the index of each field name is a constant, so this compiles to a switch.
+                dsl::for_each_rule<Profile>([&](auto index) {
+                    constexpr auto rule = Profile.rules[decltype(index)::value];
+                    if constexpr (rule.action != dsl::Action::SENDER) {
+                        constexpr auto slot = identity_fields + fields.index_of(rule.header);
+                        if (name != slot)
+                            return;
+                        if constexpr (rule.action == dsl::Action::CHECK_IN) {
+                            if (decoded_value().find(rule.needle) != std::string_view::npos)
+                                isCheckIn = true;
+                        } else if constexpr (rule.action == dsl::Action::CHECK_OUT) {
+                            if (decoded_value().find(rule.needle) != std::string_view::npos)
+                                isCheckOut = true;
+                        } else if (!timestamp) {
+                            timestamp = value;
+                        }
+                    }
+                });
+            }
+
+            finish_event(context, header, timestamp, isCheckIn, isCheckOut, identity, Profile.site, result,
+                         path_of_file);
+            return true;
+        }
+    }
+
+    /** Parse the header block of a mail by compiled profiles (see \ref dsl).
+     *
+     * The fields of the header block are found with \ref find_field_starts, so folded fields are matched as a whole.
+     * The mail belongs to the first profile with a sender rule matching the first field. Its rules are unrolled at
+     * compile time; no pattern is compiled or interpreted at runtime.
+     *
+     * @param profiles List of profiles, e.g. \ref builtin_profiles.
+     * @param context Buffers of the calling thread.
+     * @param header Raw bytes of the header block, see \ref read_header.
+     * @param path_of_file Callable returning the path to the file the header was read from.
+     * @return EnklaveEvent.
+     */
+    template<const auto &... P, typename PathOfFile>
+    EnklaveEvent parse_header_with(dsl::Profiles<P...>, ParseContext &context, std::string_view header,
+                                   PathOfFile &&path_of_file) noexcept(false) {
+        if (header.empty()) {
+            throw std::runtime_error{"Could not open file or get the first line: " + fs::path{path_of_file()}.string()};
+        }
+
+        EnklaveEvent result;
+        if (!(detail::parse_header_with_profile<P>(context, header, path_of_file, result) || ...)) {
+            throw std::runtime_error{"Parsed file is not an email from a known site: " +
+                                     fs::path{path_of_file()}.string()};
         }
         return result;
     }
 
-    /** Read all files in a directory and return a vector with parsed data.
+    /** Parse the header block of a mail from top to bottom line-by-line.
      *
-     * Calls \ref parse_file for each file, collects the results and catches exceptions that should not stop the
-     * program.
+     * The returned object contains the information if it was a check-in or a check-out, when it happened and which
+     * site it is from. This function can throw runtime_errors for various reasons and thus will either throw or
+     * return a value.
      *
-     * Only files with with extension ".eml" are considered. Subdirectories are not included.
+     * The mail is classified by the rules of the context: the \ref builtin_profiles (see \ref parse_header_with), or
+     * runtime rules (see \ref SiteRules). All patterns of all sites of runtime rules are found in a single pass over
+     * the header bytes by the automaton of the \ref Classifier, so the cost does not grow with the number of rules.
      *
-     * @param p Path do a directory.
-     * @return Vector of EnklaveEvent.
+     * The path of the file is only requested from path_of_file if it is needed, i.e. for the returned event or an
+     * error message. Callers that know a file by its directory and name only build the full path for reported files.
+     *
+     * @param context Buffers and rules of the calling thread.
+     * @param header Raw bytes of the header block, see \ref read_header.
+     * @param path_of_file Callable returning the path to the file the header was read from.
+     * @return EnklaveEvent.
      */
-    std::vector<EnklaveEvent> parse_directory(const fs::path &p) {
-        std::cout << "Scanning for relevant files in: " << p << ":\n";
-        std::vector<EnklaveEvent> enklave_events;
-        for (const fs::directory_entry &x: fs::directory_iterator(p)) {
-            const fs::path &f = x;
-            if (f.extension() == ".eml") {
-                try {
-                    enklave_events.push_back(parse_file(f));
-                } catch (std::runtime_error &e) {
-                    std::cerr << e.what() << std::endl; // e.g. file could be opened, but parsing did not meet criteria.
-                } // Let the caller catch all other exceptions, e.g. from filesystem.
+    template<typename PathOfFile>
+    EnklaveEvent parse_header_lazy(ParseContext &context, std::string_view header,
+                                   PathOfFile &&path_of_file) noexcept(false) {
+        if (context.classifier() == nullptr)
+            return parse_header_with(builtin_profiles{}, context, header, path_of_file);
+
+        static const FieldNames subject{"Subject"};
+        // The datetime is preferably taken from the line that starts with "X-Pm-Date:", see detail::finish_event.
+        constexpr std::string_view date_field{"X-Pm-Date:"};
+
+        const auto &classifier = *context.classifier();
+        const auto &automaton = classifier.patterns();
+
+        EnklaveEvent result;
+        bool isCheckIn = false;
+        bool isCheckOut = false;
+        std::optional<std::string_view> timestamp;
+        // Site whose sender pattern is on the first line; only its check-in and check-out patterns count.
+        std::optional<std::uint16_t> site;
+        detail::MailIdentity identity;
+
+        if (header.empty()) {
+            throw std::runtime_error{"Could not open file or get the first line: " + fs::path{path_of_file()}.string()};
+        }
+
+        /* Read the header from top to bottom and assume:
+         * - The first line contains a sender pattern of the site.
+         * - A check-in OR check-out pattern appears in the "Subject" field determining which event it was.
+         */
+        auto end_of_line = [&](std::string_view line, bool first_line) {
+            if (first_line) {
+                if (!site)
+                    throw std::runtime_error{"Parsed file is not an email from a known site: " +
+                                             fs::path{path_of_file()}.string()};
+                return;
             }
+
+            identity.note(line);
+
+            if (!timestamp)
+                timestamp = detail::header_field(line, date_field);
+        };
+
+        // Apply the patterns ending when the automaton enters state.
+        auto apply_matches = [&](AhoCorasick::State state, bool first_line) {
+            if (!automaton.has_output(state))
+                return;
+            const auto [begin, end] = automaton.output(state);
+            for (auto id = begin; id != end; ++id) {
+                const auto &rule = classifier.rule(*id);
+                if (first_line) {
+                    if (rule.kind == RuleKind::SENDER && !site)
+                        site = rule.site;
+                } else if (rule.site == *site) {
+                    if (rule.kind == RuleKind::CHECK_IN)
+                        isCheckIn = true;
+                    else if (rule.kind == RuleKind::CHECK_OUT)
+                        isCheckOut = true;
+                }
+            }
+        };
+
+        std::size_t line_begin = 0;
+        bool first_line = true;
+        auto state = AhoCorasick::start;
+        for (std::size_t i = 0; i < header.size(); ++i) {
+            const auto c = static_cast<unsigned char>(header[i]);
+            if (c == '\n') {
+                end_of_line(header.substr(line_begin, i - line_begin), first_line);
+                first_line = false;
+                line_begin = i + 1;
+                // Patterns never span lines.
+                state = AhoCorasick::start;
+
+                // Check-in and check-out patterns only count on Subject fields (name compared case-insensitively), and
+                // match their decoded text with folded continuation lines joined.
+                if (line_begin >= header.size() || subject.match(header, line_begin) == FieldNames::npos)
+                    continue;
+                auto field_end = header.find('\n', line_begin);
+                while (field_end != std::string_view::npos && field_end + 1 < header.size() &&
+                       (header[field_end + 1] == ' ' || header[field_end + 1] == '\t'))
+                    field_end = header.find('\n', field_end + 1);
+                if (field_end == std::string_view::npos)
+                    field_end = header.size();
+                const auto value_begin = line_begin + subject.length(0);
+                for (unsigned char decoded: context.decode_header_text(header.substr(value_begin,
+                                                                                     field_end - value_begin))) {
+                    state = automaton.next(state, decoded);
+                    apply_matches(state, false);
+                }
+                // Continue with the line ending of the Subject field.
+                i = field_end - 1;
+                continue;
+            }
+
+            // Otherwise only sender patterns on the first line count.
+            if (!first_line)
+                continue;
+            state = automaton.next(state, c);
+            apply_matches(state, true);
         }
-        return enklave_events;
+        if (line_begin < header.size() || first_line)
+            end_of_line(header.substr(line_begin), first_line);
+
+        detail::finish_event(context, header, timestamp, isCheckIn, isCheckOut, identity,
+                             classifier.sites()[*site].site, result, path_of_file);
+        return result;
+    }
+
+    /** Parse the header block of a mail with a \ref ParseContext of the calling thread, see \ref parse_header_lazy.
+     *
+     * @param header Raw bytes of the header block, see \ref read_header.
+     * @param path_of_file Callable returning the path to the file the header was read from.
+     * @return EnklaveEvent.
+     */
+    template<typename PathOfFile>
+    EnklaveEvent parse_header_lazy(std::string_view header, PathOfFile &&path_of_file) noexcept(false) {
+        thread_local ParseContext context;
+        return parse_header_lazy(context, header, path_of_file);
+    }
+
+    /** Parse the header block of a mail, see \ref parse_header_lazy.
+     *
+     * @param header Raw bytes of the header block, see \ref read_header.
+     * @param f Path to the file the header was read from; used for the returned event and error messages.
+     * @return EnklaveEvent.
+     */
+    EnklaveEvent parse_header(std::string_view header, const fs::path &f) noexcept(false) {
+        return parse_header_lazy(header, [&f]() -> const fs::path & { return f; });
+    }
+
+    /** Parse a file from top to bottom line-by-line.
+     *
+     * Reads the header block of the file with \ref read_header and passes it to \ref parse_header.
+     * This function can throw runtime_errors for various reasons and thus will either throw or return a value.
+     *
+     * @param f Path to a file
+     * @return EnklaveEvent.
+     */
+    EnklaveEvent parse_file(const fs::path &f) noexcept(false) {
+        return parse_header(read_header(f), f);
+    }
+
+    /** Parse a file like \ref parse_file, reusing the buffers of a context.
+     *
+     * @param context Buffers of the calling thread.
+     * @param f Path to a file
+     * @return EnklaveEvent.
+     */
+    EnklaveEvent parse_file(ParseContext &context, const fs::path &f) noexcept(false) {
+        return parse_header_lazy(context, context.read_header(f), [&f]() -> const fs::path & { return f; });
     }
 
     /** Match check-ins to corresponding check-outs in pairs.
@@ -213,18 +831,28 @@ namespace enklave {
      * time-sorted vector.
      * Only the last (oldest) event is kept and younger adjacent events are deleted.
      *
+     * The vectors may use any allocator, e.g. std::pmr::vector backed by an arena for the whole run.
+     *
      * @param Vector with EnklaveEvents.
+     * @param phases Optional; receives the times of sorting, filtering and pairing.
      * @return Vector with /ref timeslot.
      */
-    std::vector<timeslot> compute_timeslots(std::vector<EnklaveEvent> &events) noexcept(false) {
-        std::vector<timeslot> result;
+    template<typename Allocator>
+    std::vector<timeslot, typename std::allocator_traits<Allocator>::template rebind_alloc<timeslot>>
+    compute_timeslots(std::vector<EnklaveEvent, Allocator> &events, PhaseStats *phases = nullptr) noexcept(false) {
+        // Timeslots are allocated like the events, e.g. from the same std::pmr arena.
+        std::vector<timeslot, typename std::allocator_traits<Allocator>::template rebind_alloc<timeslot>> result{
+                events.get_allocator()};
 
         if (events.size() < 2) {
             throw std::logic_error("At least 2 events must be provided.");
         }
 
         // Sort by time.
-        sort(events.begin(), events.end());
+        {
+            PhaseTimer timer{phases ? &phases->sort : nullptr, events.size()};
+            sort(events.begin(), events.end());
+        }
 
         auto impossible_event_predicate = [](const EnklaveEvent &first, const EnklaveEvent &second) {
             // If both events are of same type.
@@ -233,6 +861,8 @@ namespace enklave {
         };
 
         // Forgotten events require filtering; see documentation of this function.
+        PhaseTimer filter_timer{phases ? &phases->filter : nullptr};
+        const auto unfiltered = events.size();
         auto it = events.begin();
         do {
             it = adjacent_find(it, events.end(), impossible_event_predicate);
@@ -249,7 +879,9 @@ namespace enklave {
             std::cerr << events.back();
             events.pop_back();
         }
+        filter_timer.set_items(unfiltered - events.size());
 
+        PhaseTimer pair_timer{phases ? &phases->pair : nullptr, events.size() / 2};
         /* Above check ensures the manual loop will always terminate.
          *
          * Note: this loop iterates on container type EnklaveEvent.
@@ -285,7 +917,8 @@ namespace enklave {
      * @param Vector with \ref timeslot
      * @return std::chrono::seconds
      */
-    std::chrono::seconds compute_duration(const std::vector<timeslot> &slots) {
+    template<typename Allocator>
+    std::chrono::seconds compute_duration(const std::vector<timeslot, Allocator> &slots) {
         using namespace std::literals;
         return std::accumulate(slots.begin(), slots.end(), 0s, [](std::chrono::seconds accumulator, timeslot slot) {
             return accumulator + (slot.second.when - slot.first.when);
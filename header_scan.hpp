@@ -0,0 +1,229 @@
+#ifndef TIME_AT_ENKLAVE_HEADER_SCAN_HPP
+#define TIME_AT_ENKLAVE_HEADER_SCAN_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENKLAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace enklave {
+    /** Kernels finding the fields of a header block, i.e. the lines that don't continue a folded field.
+     *
+     * Every kernel appends the position of each byte at or after from that follows a "\n" and is neither a blank
+     * (" " or "\t", the start of a folded continuation line) nor the end of data.
+     */
+    namespace detail {
+        using FieldStartsKernel = void (*)(std::string_view, std::size_t, std::vector<std::uint32_t> &);
+
+        void field_starts_scalar(std::string_view data, std::size_t from, std::vector<std::uint32_t> &starts) {
+            const auto first = from == 0 ? 0 : from - 1;
+            for (auto pos = data.find('\n', first); pos != std::string_view::npos; pos = data.find('\n', pos + 1)) {
+                const auto next = pos + 1;
+                if (next < data.size() && data[next] != ' ' && data[next] != '\t')
+                    starts.push_back(static_cast<std::uint32_t>(next));
+            }
+        }
+
+#ifdef ENKLAVE_X86_DISPATCH
+        /// Append the starts for a mask of "\n" positions in data[pos, pos + bits), see \ref field_starts_scalar.
+        inline void append_field_starts(std::uint32_t mask, std::size_t pos, std::vector<std::uint32_t> &starts) {
+            while (mask != 0) {
+                starts.push_back(static_cast<std::uint32_t>(pos + static_cast<std::size_t>(__builtin_ctz(mask)) + 1));
+                mask &= mask - 1;
+            }
+        }
+
+        /* Each step tests the bytes at pos (for "\n") and at pos + 1 (for blanks), reporting fields that start in
+         * (pos, pos + width]. Steps stop one vector before the end such that the load at pos + 1 stays inside data;
+         * the rest is left to the next narrower kernel.
+         */
+        __attribute__((target("sse2")))
+        void field_starts_sse2(std::string_view data, std::size_t from, std::vector<std::uint32_t> &starts) {
+            const auto newline = _mm_set1_epi8('\n');
+            const auto space = _mm_set1_epi8(' ');
+            const auto tab = _mm_set1_epi8('\t');
+            auto pos = from == 0 ? 0 : from - 1;
+            for (; pos + 16 < data.size(); pos += 16) {
+                const auto at = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data.data() + pos));
+                const auto after = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data.data() + pos + 1));
+                const auto blank = _mm_or_si128(_mm_cmpeq_epi8(after, space), _mm_cmpeq_epi8(after, tab));
+                const auto mask = _mm_movemask_epi8(_mm_andnot_si128(blank, _mm_cmpeq_epi8(at, newline)));
+                append_field_starts(static_cast<std::uint32_t>(mask), pos, starts);
+            }
+            field_starts_scalar(data, pos + 1, starts);
+        }
+
+        __attribute__((target("avx2")))
+        void field_starts_avx2(std::string_view data, std::size_t from, std::vector<std::uint32_t> &starts) {
+            const auto newline = _mm256_set1_epi8('\n');
+            const auto space = _mm256_set1_epi8(' ');
+            const auto tab = _mm256_set1_epi8('\t');
+            auto pos = from == 0 ? 0 : from - 1;
+            for (; pos + 32 < data.size(); pos += 32) {
+                const auto at = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data.data() + pos));
+                const auto after = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data.data() + pos + 1));
+                const auto blank = _mm256_or_si256(_mm256_cmpeq_epi8(after, space), _mm256_cmpeq_epi8(after, tab));
+                const auto mask = _mm256_movemask_epi8(_mm256_andnot_si256(blank, _mm256_cmpeq_epi8(at, newline)));
+                append_field_starts(static_cast<std::uint32_t>(mask), pos, starts);
+            }
+            field_starts_sse2(data, pos + 1, starts);
+        }
+#endif
+
+        /// Fastest kernel supported by the CPU running the program.
+        FieldStartsKernel select_field_starts_kernel() {
+#ifdef ENKLAVE_X86_DISPATCH
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return field_starts_avx2;
+            if (__builtin_cpu_supports("sse2"))
+                return field_starts_sse2;
+#endif
+            return field_starts_scalar;
+        }
+    }
+
+    /** Find the start of every field of a header block, handling folded continuation lines.
+     *
+     * The "\n" positions are found in one sweep with the widest vector instructions of the CPU (AVX2 or SSE2, chosen
+     * at runtime) and a scalar fallback on other CPUs. Lines starting with a blank continue the previous field and
+     * are not reported.
+     *
+     * @param header Header block, see \ref read_header.
+     * @param starts Receives the start of every field, including 0; cleared first, its capacity is reused.
+     */
+    void find_field_starts(std::string_view header, std::vector<std::uint32_t> &starts) {
+        static const auto kernel = detail::select_field_starts_kernel();
+        starts.clear();
+        if (header.empty())
+            return;
+        starts.push_back(0);
+        kernel(header, 1, starts);
+    }
+
+    /** Set of field names (e.g. "Subject") that the start of a field is compared against.
+     *
+     * A field has a name if it starts with the name directly followed by a colon. Names are compared
+     * case-insensitively, as field names are. With SSE2, the first 16 bytes of a field are loaded once and compared
+     * against every name with one vector compare each; longer names compare their remaining bytes one by one.
+     */
+    class FieldNames {
+    public:
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        FieldNames(std::initializer_list<std::string_view> names) {
+            for (auto name: names)
+                add(name);
+        }
+
+        template<typename Names>
+        explicit FieldNames(const Names &names) {
+            for (std::string_view name: names)
+                add(name);
+        }
+
+        std::size_t size() const {
+            return entries.size();
+        }
+
+        /// Length of a name, including its colon; the value of a field starts there.
+        std::size_t length(std::size_t index) const {
+            return entries[index].pattern.size();
+        }
+
+        /** Index of the first name the field starting at data[start] has.
+         *
+         * @return Index into the names, or npos if the field has none of them.
+         */
+        std::size_t match(std::string_view data, std::size_t start) const {
+            const auto available = data.size() - start;
+            const char *field = data.data() + start;
+#ifdef __SSE2__
+            // Load 16 bytes once; near the end of data, copy the remaining bytes into a padded buffer.
+            alignas(16) char padded[16] = {};
+            if (available < 16) {
+                std::memcpy(padded, field, available);
+                field = padded;
+            }
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(field));
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                const auto &entry = entries[i];
+                if (entry.pattern.size() > available)
+                    continue;
+                const auto folded = _mm_or_si128(chunk, _mm_load_si128(reinterpret_cast<const __m128i *>(entry.fold)));
+                const auto equal = static_cast<unsigned>(_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(folded, _mm_load_si128(reinterpret_cast<const __m128i *>(entry.lower)))));
+                if ((equal & entry.prefix_mask) != entry.prefix_mask)
+                    continue;
+                if (entry.pattern.size() <= 16 || equal_rest(data.data() + start, entry.pattern, 16))
+                    return i;
+            }
+#else
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                if (entries[i].pattern.size() <= available && equal_rest(field, entries[i].pattern, 0))
+                    return i;
+            }
+#endif
+            return npos;
+        }
+
+    private:
+        struct Entry {
+            /// First 16 bytes of the pattern in lower case, and 0x20 where the pattern has a letter.
+            alignas(16) char lower[16] = {};
+            alignas(16) char fold[16] = {};
+            /// Bits of the movemask covering the pattern.
+            unsigned prefix_mask = 0;
+            /// Name followed by a colon.
+            std::string pattern;
+        };
+
+        static bool is_letter(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        }
+
+        static char to_lower(char c) {
+            return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+        }
+
+        /// Case-insensitive comparison of field[from, pattern.size()) with pattern.
+        static bool equal_rest(const char *field, std::string_view pattern, std::size_t from) {
+            for (auto i = from; i < pattern.size(); ++i) {
+                if (to_lower(field[i]) != to_lower(pattern[i]))
+                    return false;
+            }
+            return true;
+        }
+
+        void add(std::string_view name) {
+            Entry entry;
+            entry.pattern.assign(name.data(), name.size());
+            entry.pattern += ':';
+            const auto prefix = std::min<std::size_t>(entry.pattern.size(), 16);
+            for (std::size_t i = 0; i < prefix; ++i) {
+                entry.lower[i] = to_lower(entry.pattern[i]);
+                entry.fold[i] = is_letter(entry.pattern[i]) ? 0x20 : 0;
+            }
+            entry.prefix_mask = prefix == 16 ? 0xffffu : (1u << prefix) - 1;
+            entries.push_back(std::move(entry));
+        }
+
+        std::vector<Entry> entries;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_HEADER_SCAN_HPP
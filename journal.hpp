@@ -0,0 +1,444 @@
+#ifndef TIME_AT_ENKLAVE_JOURNAL_HPP
+#define TIME_AT_ENKLAVE_JOURNAL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.hpp"
+#include "dedup.hpp"
+#include "enklave.hpp"
+#include "mapped_file.hpp"
+#include "pipeline.hpp"
+
+namespace enklave {
+    namespace detail {
+        /// Append the bytes of a trivially copyable value in native byte order.
+        template<typename T>
+        void put_bytes(std::string &out, const T &value) {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        /// Read a value written by \ref put_bytes; false if fewer than sizeof(T) bytes are left.
+        template<typename T>
+        bool get_bytes(std::string_view &in, T &value) {
+            if (in.size() < sizeof(T))
+                return false;
+            std::memcpy(&value, in.data(), sizeof(T));
+            in.remove_prefix(sizeof(T));
+            return true;
+        }
+
+        /// Checksum of a journal record; FNV-1a folded to 32 bits.
+        std::uint32_t journal_checksum(std::string_view payload) {
+            const auto hash = hash_of(payload);
+            return static_cast<std::uint32_t>(hash ^ (hash >> 32));
+        }
+
+        /// Write all of data to fd; throws fs::filesystem_error.
+        void write_all(int fd, std::string_view data, const fs::path &f) {
+            while (!data.empty()) {
+                const auto written = ::write(fd, data.data(), data.size());
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw fs::filesystem_error{"Could not write journal", f,
+                                               std::error_code{errno, std::generic_category()}};
+                }
+                data.remove_prefix(static_cast<std::size_t>(written));
+            }
+        }
+
+        void sync(int fd, const fs::path &f) {
+            if (::fsync(fd) != 0)
+                throw fs::filesystem_error{"Could not sync journal", f,
+                                           std::error_code{errno, std::generic_category()}};
+        }
+    }
+
+    /** Append-only file of the events of all past runs, such that a run only parses files added since the last one.
+     *
+     * The file starts with a magic string and a version and continues with records, each a 32 bit payload size, a
+     * 32 bit checksum of the payload and the payload:
+     * - 'E': an event: time, type, content hash (of the Message-Id or header), source id (hash of the path), site
+     *   ("member" whose sessions are paired) and path.
+     * - 'C': a checkpoint: every file whose status changed before its time was scanned, followed by the directories
+     *   with files that could not be read (e.g. still empty), which the next run lists in full, see
+     *   \ref RetryDirectories. Older checkpoints without them end after the time.
+     *
+     * Numbers are stored in native byte order; the version tells a journal of another byte order apart.
+     *
+     * Opening the journal replays it with one sequential read. Appends are crash-safe: records are only appended,
+     * and new events are synced before the checkpoint that covers them. A record cut short or damaged by a crash ends
+     * the replay, and the file is truncated to the last intact record before anything is appended. Events are
+     * appended at most once: the events of the files rescanned after a crash are recognized by their key, see
+     * \ref deduplication_key.
+     *
+     * Every run adds a checkpoint. After config::journal_compaction_checkpoints of them, or if garbage was found
+     * during replay, the journal is compacted: rewritten to a new file with all events sorted by time and one
+     * checkpoint, which then replaces the old file atomically.
+     *
+     * Like the directory cache, the journal assumes that mails are never modified or deleted once written, and should
+     * be deleted after changing the rules.
+     */
+    class EventJournal {
+    public:
+        /** Open a journal, creating it if it does not exist, and replay it.
+         *
+         * Throws fs::filesystem_error if the file can't be opened or is not a journal.
+         *
+         * @param f Path to the journal file.
+         */
+        explicit EventJournal(fs::path f) : file{std::move(f)} {
+            fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0)
+                throw fs::filesystem_error{"Could not open journal", file,
+                                           std::error_code{errno, std::generic_category()}};
+            try {
+                replay();
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+        }
+
+        EventJournal(const EventJournal &) = delete;
+
+        EventJournal &operator=(const EventJournal &) = delete;
+
+        ~EventJournal() {
+            ::close(fd);
+        }
+
+        /** Point in time as stored in checkpoints: nanoseconds since the epoch, comparable to st_ctim.
+         *
+         * On Linux, this is the coarse clock the kernel stamps files with, so a file created after a call never has an
+         * earlier status change time.
+         */
+        static std::int64_t now() {
+#ifdef __linux__
+            struct timespec ts{};
+            if (::clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0)
+                return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        /// Replayed and added events, in the order they were first added.
+        const std::vector<EnklaveEvent> &events() const {
+            return journaled;
+        }
+
+        /// Time of the last checkpoint, see \ref now; 0 if there is none.
+        std::int64_t checkpoint() const {
+            return last_checkpoint;
+        }
+
+        /// Directories with files that could not be read by the run of the last checkpoint.
+        const std::vector<std::string> &retry() const {
+            return retry_directories;
+        }
+
+        /// Number of events read from the file when it was opened.
+        std::size_t replayed() const {
+            return replayed_events;
+        }
+
+        /** Add an event unless the journal holds it already; it is written by the next \ref commit.
+         *
+         * @return true if the event is new.
+         */
+        bool add(const EnklaveEvent &event) {
+            if (!keys.insert(key_of(event)).second)
+                return false;
+            journaled.push_back(event);
+            return true;
+        }
+
+        /** Append the events added since the last commit and a checkpoint, then compact the journal if it is due.
+         *
+         * @param scan_started Time, see \ref now, before the scan that found all events not yet journaled started.
+         * @param unread Directories with files that scan could not read; see \ref retry.
+         */
+        void commit(std::int64_t scan_started, std::vector<std::string> unread = {}) {
+            std::string records;
+            for (auto i = committed; i < journaled.size(); ++i)
+                append_record(records, event_payload(journaled[i]));
+            if (!records.empty()) {
+                detail::write_all(fd, records, file);
+                detail::sync(fd, file);
+            }
+            std::string checkpoint_record;
+            append_record(checkpoint_record, checkpoint_payload(scan_started, unread));
+            detail::write_all(fd, checkpoint_record, file);
+            detail::sync(fd, file);
+            committed = journaled.size();
+            last_checkpoint = scan_started;
+            retry_directories = std::move(unread);
+
+            if (garbage || ++checkpoints > config::journal_compaction_checkpoints)
+                compact();
+        }
+
+    private:
+        static constexpr char magic[8] = {'E', 'N', 'K', 'J', 'R', 'N', 'L', '\0'};
+        static constexpr std::uint32_t version = 1;
+        static constexpr std::size_t file_header_size = sizeof(magic) + sizeof(version);
+        static constexpr std::size_t record_header_size = 2 * sizeof(std::uint32_t);
+
+        /** Identity of an event in the journal, independent of the path of its file such that a mail that is moved
+         * (e.g. from new/ to cur/ in a Maildir) is journaled once. The site and time stand in for an unknown mail.
+         */
+        static std::uint64_t key_of(const EnklaveEvent &event) {
+            const auto key = deduplication_key(event);
+            if (key != 0)
+                return key;
+            const auto when = static_cast<std::uint64_t>(event.when.time_since_epoch().count());
+            return mix_hash(detail::hash_of(event.site) ^ (when * 0x9e3779b97f4a7c15ull) ^
+                            static_cast<std::uint64_t>(event.type));
+        }
+
+        static std::string event_payload(const EnklaveEvent &event) {
+            std::string payload{'E'};
+            detail::put_bytes(payload, static_cast<std::int64_t>(event.when.time_since_epoch().count()));
+            detail::put_bytes(payload, static_cast<std::uint8_t>(event.type));
+            detail::put_bytes(payload, event.message_id_hash);
+            detail::put_bytes(payload, detail::hash_of(event.file.native()));
+            detail::put_bytes(payload, static_cast<std::uint16_t>(event.site.size()));
+            payload += event.site;
+            detail::put_bytes(payload, static_cast<std::uint32_t>(event.file.native().size()));
+            payload += event.file.native();
+            return payload;
+        }
+
+        static std::string checkpoint_payload(std::int64_t time, const std::vector<std::string> &unread) {
+            std::string payload{'C'};
+            detail::put_bytes(payload, time);
+            for (const auto &directory: unread) {
+                detail::put_bytes(payload, static_cast<std::uint32_t>(directory.size()));
+                payload += directory;
+            }
+            return payload;
+        }
+
+        /// Decode a checkpoint record; false if it is malformed.
+        bool parse_checkpoint(std::string_view payload) {
+            std::int64_t time = 0;
+            if (!detail::get_bytes(payload, time))
+                return false;
+            std::vector<std::string> unread;
+            std::uint32_t size = 0;
+            while (detail::get_bytes(payload, size)) {
+                if (payload.size() < size)
+                    return false;
+                unread.emplace_back(payload.substr(0, size));
+                payload.remove_prefix(size);
+            }
+            if (!payload.empty())
+                return false;
+            last_checkpoint = time;
+            retry_directories = std::move(unread);
+            return true;
+        }
+
+        static void append_record(std::string &out, std::string_view payload) {
+            detail::put_bytes(out, static_cast<std::uint32_t>(payload.size()));
+            detail::put_bytes(out, detail::journal_checksum(payload));
+            out += payload;
+        }
+
+        /// Decode an event record; false if it is malformed.
+        static bool parse_event(std::string_view payload, EnklaveEvent &event) {
+            std::int64_t when = 0;
+            std::uint8_t type = 0;
+            std::uint64_t source = 0;
+            std::uint16_t site_size = 0;
+            std::uint32_t path_size = 0;
+            if (!detail::get_bytes(payload, when) || !detail::get_bytes(payload, type) ||
+                !detail::get_bytes(payload, event.message_id_hash) || !detail::get_bytes(payload, source) ||
+                !detail::get_bytes(payload, site_size) || payload.size() < site_size)
+                return false;
+            event.site.assign(payload.data(), site_size);
+            payload.remove_prefix(site_size);
+            if (!detail::get_bytes(payload, path_size) || payload.size() != path_size)
+                return false;
+            event.file = std::string{payload};
+            event.when = date::sys_seconds{std::chrono::seconds{when}};
+            event.type = static_cast<EnklaveEventType>(type);
+            return event.type != EnklaveEventType::UNDEFINED && detail::hash_of(event.file.native()) == source;
+        }
+
+        void replay() {
+            const MappedFile mapped{file};
+            const auto data = mapped.view();
+            if (data.empty()) {
+                std::string header{magic, sizeof(magic)};
+                detail::put_bytes(header, version);
+                detail::write_all(fd, header, file);
+                detail::sync(fd, file);
+                return;
+            }
+            std::uint32_t file_version = 0;
+            std::string_view rest = data;
+            if (rest.substr(0, sizeof(magic)) != std::string_view{magic, sizeof(magic)} ||
+                !(rest.remove_prefix(sizeof(magic)), detail::get_bytes(rest, file_version)) || file_version != version)
+                throw fs::filesystem_error{"Not a journal of this version", file,
+                                           std::make_error_code(std::errc::invalid_argument)};
+
+            while (rest.size() >= record_header_size) {
+                auto header = rest;
+                std::uint32_t size = 0;
+                std::uint32_t checksum = 0;
+                detail::get_bytes(header, size);
+                detail::get_bytes(header, checksum);
+                if (header.size() < size || detail::journal_checksum(header.substr(0, size)) != checksum)
+                    break; // Torn or damaged by a crash.
+                const auto payload = header.substr(0, size);
+                rest = header.substr(size);
+
+                if (!payload.empty() && payload[0] == 'E') {
+                    EnklaveEvent event;
+                    if (!parse_event(payload.substr(1), event)) {
+                        garbage = true;
+                        continue;
+                    }
+                    ++replayed_events;
+                    if (!add(event))
+                        garbage = true;
+                } else if (!payload.empty() && payload[0] == 'C') {
+                    if (parse_checkpoint(payload.substr(1)))
+                        ++checkpoints;
+                    else
+                        garbage = true;
+                } else {
+                    garbage = true;
+                }
+            }
+            committed = journaled.size();
+
+            if (!rest.empty()) {
+                // Drop the damaged tail, such that appended records are not hidden behind it.
+                garbage = true;
+                if (::ftruncate(fd, static_cast<off_t>(data.size() - rest.size())) != 0)
+                    throw fs::filesystem_error{"Could not truncate journal", file,
+                                               std::error_code{errno, std::generic_category()}};
+            }
+            if (::lseek(fd, 0, SEEK_END) < 0)
+                throw fs::filesystem_error{"Could not seek journal", file,
+                                           std::error_code{errno, std::generic_category()}};
+        }
+
+        /// Rewrite the journal with all events sorted by time and one checkpoint; replaces the file atomically.
+        void compact() {
+            std::vector<const EnklaveEvent *> sorted;
+            sorted.reserve(journaled.size());
+            for (const auto &event: journaled)
+                sorted.push_back(&event);
+            std::stable_sort(sorted.begin(), sorted.end(), [](const EnklaveEvent *a, const EnklaveEvent *b) {
+                return a->when < b->when;
+            });
+
+            std::string content{magic, sizeof(magic)};
+            detail::put_bytes(content, version);
+            for (const auto *event: sorted)
+                append_record(content, event_payload(*event));
+            append_record(content, checkpoint_payload(last_checkpoint, retry_directories));
+
+            const fs::path temporary = file.string() + ".tmp";
+            const int temporary_fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (temporary_fd < 0)
+                throw fs::filesystem_error{"Could not compact journal", temporary,
+                                           std::error_code{errno, std::generic_category()}};
+            try {
+                detail::write_all(temporary_fd, content, temporary);
+                detail::sync(temporary_fd, temporary);
+            } catch (...) {
+                ::close(temporary_fd);
+                throw;
+            }
+            fs::rename(temporary, file);
+            ::close(fd);
+            fd = temporary_fd;
+            // The rename itself is durable once the directory is synced.
+            const int directory_fd = ::open(file.parent_path().empty() ? "." : file.parent_path().c_str(),
+                                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (directory_fd >= 0) {
+                ::fsync(directory_fd);
+                ::close(directory_fd);
+            }
+            checkpoints = 1;
+            garbage = false;
+        }
+
+        fs::path file;
+        int fd = -1;
+        std::vector<EnklaveEvent> journaled;
+        std::unordered_set<std::uint64_t> keys;
+        /// Events before this index are in the file.
+        std::size_t committed = 0;
+        std::size_t replayed_events = 0;
+        std::int64_t last_checkpoint = 0;
+        /// See \ref retry.
+        std::vector<std::string> retry_directories;
+        /// Checkpoints in the file, see config::journal_compaction_checkpoints.
+        std::size_t checkpoints = 0;
+        /// Whether replay found duplicate, malformed or damaged records.
+        bool garbage = false;
+    };
+
+    /** Same as \ref parse_directory, but only files added since the last checkpoint of journal are read.
+     *
+     * A file was added if its status changed (st_ctim, which unlike the modification time can't be set back) at or
+     * after the checkpoint; directories without such changes are listed only for their subdirectories. The new events
+     * are appended to the journal together with a new checkpoint, set slack before the scan started: filesystems
+     * with coarse timestamps (e.g. whole seconds) may stamp a file created during the scan with an earlier time.
+     * Files within the slack are read again by the next run and recognized by the journal. Directories with files that
+     * could not be read are recorded with the checkpoint and listed in full by the next run (see
+     * \ref RetryDirectories), since writing such a file later does not change the status of its directory. The scan
+     * is never narrowed to ScanConfig::range, since a checkpoint covers all files; callers filter the returned events
+     * instead.
+     *
+     * @param p Path to a directory.
+     * @param pipeline_config See \ref parse_directory; ScanConfig::cache must not be set.
+     * @param journal Journal of the directory.
+     * @param stats Optional; receives the counters of each stage.
+     * @param allocator Allocates the returned vector.
+     * @param slack Margin for the timestamp granularity of filesystems.
+     * @return Vector of all events in the journal, including the new ones.
+     */
+    template<typename Events = std::vector<EnklaveEvent>>
+    Events parse_directory_journaled(const fs::path &p, const PipelineConfig &pipeline_config, EventJournal &journal,
+                                     PipelineStats *stats = nullptr,
+                                     const typename Events::allocator_type &allocator = {},
+                                     std::chrono::nanoseconds slack = config::journal_timestamp_slack) {
+        auto config = pipeline_config;
+        config.scan.range = TimeRange{};
+        config.scan.changed_since_ns = journal.checkpoint();
+        RetryDirectories retry{journal.retry()};
+        config.scan.retry = &retry;
+
+        const auto scan_started = EventJournal::now() - slack.count();
+        const auto found = parse_directory(p, config, stats);
+        for (const auto &event: found)
+            journal.add(event);
+        journal.commit(scan_started, retry.failed());
+
+        Events events{allocator};
+        events.assign(journal.events().begin(), journal.events().end());
+        return events;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_JOURNAL_HPP
@@ -1,31 +1,309 @@
+#include <algorithm>
+#include <csignal>
 #include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <vector>
+#include "daemon.hpp"
 #include "enklave.hpp"
+#include "journal.hpp"
+#include "mbox.hpp"
+#include "options.hpp"
+#include "pipeline.hpp"
+#include "query_index.hpp"
+#include "range.hpp"
+#include "rules.hpp"
+#include "tar.hpp"
 
 int main(int argc, char *argv[]) {
     using namespace enklave;
 
-    std::string path_with_mails{enklave::config::path_with_mails};
+    Options options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl << usage;
+        return 1;
+    }
 
-    if (argc > 1) // If path is passed in by first argument, override configured path.
-        path_with_mails = argv[1];
+    if (!options.query_socket.empty()) {
+        try {
+            std::cout << query_daemon(options.query_socket, options.request) << std::endl;
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    auto found_events = parse_directory(path_with_mails);
+    std::optional<Classifier> classifier;
+    if (!options.rules_file.empty()) {
+        try {
+            classifier.emplace(load_rules(options.rules_file));
+        } catch (std::invalid_argument &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        options.pipeline.classifier = &*classifier;
+    }
+
+    const auto source_extension = fs::path{options.path_with_mails}.extension();
+    if (!options.serve_socket.empty()) {
+        // The daemon scans the source again on every refresh; journal and cache stay open in between.
+        std::optional<EventJournal> journal;
+        DirectoryCache cache{cache_fingerprint_of(options.pipeline)};
+        try {
+            if (!options.journal.empty())
+                journal.emplace(options.journal);
+            if (!options.directory_cache.empty()) {
+                cache.load(options.directory_cache);
+                options.pipeline.scan.cache = &cache;
+            }
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        auto ingest = [&]() -> std::vector<EnklaveEvent> {
+            if (source_extension == ".mbox" && fs::is_regular_file(options.path_with_mails))
+                return parse_mbox(options.path_with_mails, options.pipeline.parser_threads,
+                                  options.pipeline.classifier, options.pipeline.body_scan_bytes);
+            if (source_extension == ".tar" && fs::is_regular_file(options.path_with_mails))
+                return parse_tar(options.path_with_mails, options.pipeline.parser_threads,
+                                 options.pipeline.classifier, options.pipeline.body_scan_bytes);
+            if (journal)
+                return parse_directory_journaled(options.path_with_mails, options.pipeline, *journal);
+            // The cache carries the directories of this refresh over to the next one, unless the scan failed.
+            std::vector<EnklaveEvent> events;
+            bool completed = false;
+            try {
+                events = parse_directory(options.path_with_mails, options.pipeline);
+                completed = true;
+                if (!options.directory_cache.empty())
+                    cache.save(options.directory_cache);
+            } catch (...) {
+                cache.next_run(completed);
+                throw;
+            }
+            cache.next_run();
+            return events;
+        };
+
+        // SIGINT and SIGTERM are taken by this thread only; the daemon's threads inherit the mask.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        try {
+            DaemonConfig daemon_config;
+            daemon_config.shared_results = options.shared_results;
+            QueryDaemon daemon{options.serve_socket, ingest, daemon_config};
+            std::cout << "Answering queries on " << options.serve_socket << "." << std::endl;
+            int signal = 0;
+            sigwait(&signals, &signal);
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Ingestion stages and the phases after them; reported at the end of the run.
+    PipelineStats stats;
+    PhaseStats phases;
+    auto report = [&options, &stats, &phases]() {
+        if (options.stats)
+            std::cout << "Ingestion stages:" << std::endl << stats << "Phases:" << std::endl << phases;
+    };
+
+    // Read every mail for an index, such that it answers any range; the range only applies to the results.
+    const TimeRange range = options.pipeline.scan.range;
+
+    auto answer_from_index = [&](const QueryIndex &index) {
+        std::vector<std::chrono::seconds> durations;
+        {
+            std::size_t slots = 0;
+            for (std::size_t site = 0; site < index.sites(); ++site)
+                slots += index.slot_count(site);
+            PhaseTimer timer{&phases.sum, slots};
+            for (std::size_t site = 0; site < index.sites(); ++site)
+                durations.push_back(index.duration(site, range));
+        }
+        {
+            PhaseTimer timer{&phases.output, index.sites()};
+            if (index.sites() == 0)
+                std::cerr << "Scanned directory does not contain files with at least one check-in and one check-out."
+                          << std::endl;
+            for (std::size_t site = 0; site < index.sites(); ++site) {
+                if (index.slot_count(site) == 0) {
+                    std::cerr << "Not enough events to compute the time spent at " << index.site_name(site) << "."
+                              << std::endl;
+                    continue;
+                }
+                std::cout << "Time spent at " << index.site_name(site) << ": "
+                          << date::format("%T", durations[site]) << std::endl;
+            }
+        }
+        if (!options.shared_results.empty()) {
+            try {
+                const auto now = date::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+                SharedResultsWriter{options.shared_results}.publish(shared_results_of(index, range, now));
+            } catch (fs::filesystem_error &e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        }
+        report();
+        return 0;
+    };
+
+    // The index is keyed by the stamps of the directories or the file it was built from: while none of them changed,
+    // it answers without listing a directory or reading a mail. Otherwise the source is read and the index rebuilt.
+    std::optional<SourceStamps> sources;
+    if (!options.index.empty()) {
+        try {
+            sources.emplace(mix_hash(cache_fingerprint_of(options.pipeline) ^
+                                     detail::hash_of(fs::absolute(options.path_with_mails).native())));
+            if (const auto index = QueryIndex::open_fresh(options.index, sources->settings())) {
+                std::cout << "The index is up to date; no mails were read." << std::endl;
+                return answer_from_index(*index);
+            }
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        options.pipeline.scan.range = {};
+        options.pipeline.scan.stamps = &*sources;
+    }
+    // An mbox file or tar archive is stamped before it is read, such that a change while reading it is seen.
+    auto stamp_source = [&options, &sources]() {
+        FileStamp stamp;
+        if (!sources)
+            return;
+        if (detail::stamp_of(options.path_with_mails, stamp))
+            sources->add(options.path_with_mails, stamp);
+        else
+            sources->failed();
+    };
+
+    // Events and timeslots of the run live in one arena that is released at once when main returns.
+    std::pmr::monotonic_buffer_resource arena;
+    using Events = std::pmr::vector<EnklaveEvent>;
+
+    Events found_events{&arena};
+    if (source_extension == ".mbox" && fs::is_regular_file(options.path_with_mails)) {
+        stamp_source();
+        try {
+            found_events = parse_mbox<Events>(options.path_with_mails, options.pipeline.parser_threads,
+                                             options.pipeline.classifier, options.pipeline.body_scan_bytes, &arena);
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (source_extension == ".tar" && fs::is_regular_file(options.path_with_mails)) {
+        stamp_source();
+        try {
+            found_events = parse_tar<Events>(options.path_with_mails, options.pipeline.parser_threads,
+                                            options.pipeline.classifier, options.pipeline.body_scan_bytes, &arena);
+        } catch (std::runtime_error &e) { // A malformed archive, or fs::filesystem_error.
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (!options.journal.empty()) {
+        try {
+            EventJournal journal{options.journal};
+            found_events = parse_directory_journaled<Events>(options.path_with_mails, options.pipeline, journal,
+                                                             &stats, &arena);
+            std::cout << journal.replayed() << " events were replayed from the journal." << std::endl;
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        DirectoryCache cache{cache_fingerprint_of(options.pipeline)};
+        try {
+            if (!options.directory_cache.empty()) {
+                cache.load(options.directory_cache);
+                options.pipeline.scan.cache = &cache;
+            }
+            found_events = parse_directory<Events>(options.path_with_mails, options.pipeline, &stats, &arena);
+            if (!options.directory_cache.empty()) {
+                cache.save(options.directory_cache);
+                std::cout << cache.reused() << " unchanged directories were taken from the cache." << std::endl;
+            }
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::optional<QueryIndex> index;
+    if (sources) {
+        try {
+            index = QueryIndex::build(found_events, *sources, &phases);
+            index->save(options.index);
+        } catch (fs::filesystem_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (!options.shared_results.empty()) {
+        index = QueryIndex::build(found_events, &phases);
+    }
+
+    // Keep events near the range such that sessions crossing its bounds can be paired and clipped.
+    if (range.bounded()) {
+        const auto kept = range.padded(config::range_slack);
+        found_events.erase(std::remove_if(found_events.begin(), found_events.end(), [&kept](const EnklaveEvent &e) {
+            return !kept.contains(e.when);
+        }), found_events.end());
+    }
 
     // Provide some user feedback:
-    std::cout << found_events.size() << " events were found:" << std::endl;
-    for (auto &x : found_events) {
-        std::cout << x;
+    {
+        PhaseTimer timer{&phases.output, found_events.size()};
+        std::cout << found_events.size() << " events were found:" << std::endl;
+        for (auto &x : found_events) {
+            std::cout << x;
+        }
     }
 
     if (found_events.size() < 2) {
         std::cerr << "Scanned directory does not contain files with at least one check-in and one check-out."
                   << std::endl;
+        report();
         return 0;
     }
 
-    auto timeslots = compute_timeslots(found_events);
-    auto result = compute_duration(timeslots);
+    if (index)
+        return answer_from_index(*index);
+
+    // Sessions are paired per site; a check-in at one site is never ended by a check-out at another.
+    std::vector<std::string> sites;
+    for (const auto &e: found_events) {
+        if (std::find(sites.begin(), sites.end(), e.site) == sites.end())
+            sites.push_back(e.site);
+    }
+    for (const auto &site: sites) {
+        Events site_events{&arena};
+        std::copy_if(found_events.begin(), found_events.end(), std::back_inserter(site_events),
+                     [&site](const EnklaveEvent &e) { return e.site == site; });
+        if (site_events.size() < 2) {
+            std::cerr << "Not enough events to compute the time spent at " << site << "." << std::endl;
+            continue;
+        }
+
+        auto timeslots = compute_timeslots(site_events, &phases);
+        std::chrono::seconds result{0};
+        {
+            PhaseTimer timer{&phases.sum, timeslots.size()};
+            result = compute_duration(timeslots, range);
+        }
 
-    std::cout << "Time spent at enklave: " << date::format("%T", result) << std::endl;
+        PhaseTimer timer{&phases.output, 1};
+        std::cout << "Time spent at " << site << ": " << date::format("%T", result) << std::endl;
+    }
+    report();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,75 @@
+#ifndef TIME_AT_ENKLAVE_MAPPED_FILE_HPP
+#define TIME_AT_ENKLAVE_MAPPED_FILE_HPP
+
+#include <cerrno>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "enklave.hpp"
+
+namespace enklave {
+    /** Read-only memory mapping of a whole file.
+     *
+     * The content is accessed in place as a string_view without copying it into the process. Throws
+     * fs::filesystem_error if the file can't be opened or mapped.
+     */
+    class MappedFile {
+    public:
+        explicit MappedFile(const fs::path &f) {
+            const int fd = ::open(f.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw fs::filesystem_error{"Could not open file", f, std::error_code{errno, std::generic_category()}};
+
+            struct stat st{};
+            if (::fstat(fd, &st) != 0) {
+                const int error = errno;
+                ::close(fd);
+                throw fs::filesystem_error{"Could not stat file", f, std::error_code{error, std::generic_category()}};
+            }
+
+            size = static_cast<std::size_t>(st.st_size);
+            if (size > 0) {
+                void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    const int error = errno;
+                    ::close(fd);
+                    throw fs::filesystem_error{"Could not map file", f,
+                                               std::error_code{error, std::generic_category()}};
+                }
+                data = static_cast<const char *>(mapped);
+                ::madvise(mapped, size, MADV_SEQUENTIAL); // Only a hint; failure is irrelevant.
+            }
+            ::close(fd); // The mapping keeps the file alive.
+        }
+
+        MappedFile(MappedFile &&other) noexcept
+                : data{std::exchange(other.data, nullptr)}, size{std::exchange(other.size, 0)} {}
+
+        MappedFile &operator=(MappedFile &&other) noexcept {
+            std::swap(data, other.data);
+            std::swap(size, other.size);
+            return *this;
+        }
+
+        ~MappedFile() {
+            if (data)
+                ::munmap(const_cast<char *>(data), size);
+        }
+
+        std::string_view view() const {
+            return {data, size};
+        }
+
+    private:
+        const char *data = nullptr;
+        std::size_t size = 0;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_MAPPED_FILE_HPP
@@ -0,0 +1,183 @@
+#ifndef TIME_AT_ENKLAVE_MBOX_HPP
+#define TIME_AT_ENKLAVE_MBOX_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "body.hpp"
+#include "config.hpp"
+#include "dedup.hpp"
+#include "enklave.hpp"
+#include "mapped_file.hpp"
+
+namespace enklave {
+    /** Find the next mbox separator, i.e. a line starting with "From ", at or after position from.
+     *
+     * A separator is only recognized at the very beginning of data or directly after a "\n". Lines in message bodies
+     * starting with "From " are quoted as ">From " by every mbox writer, so they are not mistaken for separators.
+     *
+     * With SSE2, 16 positions are tested at once for a "\n" followed by an "F"; only those candidates are compared in
+     * full.
+     *
+     * @param data Content of an mbox file.
+     * @param from Position to start searching.
+     * @return Position of the "F" of the next separator, or npos.
+     */
+    std::size_t find_mbox_separator(std::string_view data, std::size_t from) noexcept {
+        constexpr std::string_view separator{"From "};
+        auto is_separator_at = [&](std::size_t pos) {
+            return data.size() - pos >= separator.size() &&
+                   std::memcmp(data.data() + pos, separator.data(), separator.size()) == 0;
+        };
+
+        if (from == 0) {
+            if (is_separator_at(0))
+                return 0;
+            from = 1;
+        }
+        if (from >= data.size())
+            return std::string_view::npos;
+
+        // Candidate positions pos have data[pos - 1] == '\n' and data[pos] == 'F'.
+        std::size_t pos = from;
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i capital_f = _mm_set1_epi8('F');
+        for (; pos + 16 <= data.size(); pos += 16) {
+            const auto before = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data.data() + pos - 1));
+            const auto at = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data.data() + pos));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+                    _mm_and_si128(_mm_cmpeq_epi8(before, newline), _mm_cmpeq_epi8(at, capital_f))));
+            while (mask != 0) {
+                const auto candidate = pos + static_cast<std::size_t>(__builtin_ctz(mask));
+                if (is_separator_at(candidate))
+                    return candidate;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; pos < data.size(); ++pos) {
+            if (data[pos - 1] == '\n' && data[pos] == 'F' && is_separator_at(pos))
+                return pos;
+        }
+        return std::string_view::npos;
+    }
+
+    /** Extract the header block of the message whose separator line starts at position separator.
+     *
+     * The separator line itself is not part of the returned header. The header ends at the first empty line or at
+     * the next separator, whichever comes first.
+     *
+     * @param data Content of an mbox file.
+     * @param separator Position of a separator, see \ref find_mbox_separator.
+     * @param next_separator Position of the following separator or npos.
+     * @return View into data; a null view if the separator line has no line ending, i.e. there is no message.
+     */
+    std::string_view mbox_message_header(std::string_view data, std::size_t separator, std::size_t next_separator) {
+        auto message = data.substr(separator, next_separator == std::string_view::npos ? std::string_view::npos
+                                                                                       : next_separator - separator);
+        const auto first_line_end = message.find('\n');
+        if (first_line_end == std::string_view::npos)
+            return {};
+        message.remove_prefix(first_line_end + 1);
+
+        const auto header_end = find_header_end(message);
+        return header_end == std::string_view::npos ? message : message.substr(0, header_end);
+    }
+
+    /** Read all messages of an mbox file and return a vector with parsed data.
+     *
+     * The file is memory-mapped and never copied or split into separate files. It is divided into one byte range per
+     * thread; every thread handles the messages whose separator starts in its range. The header block of each
+     * message is classified by \ref parse_mail, so only headers are touched and message bodies are skipped unless the
+     * header is inconclusive and body_scan_bytes is set.
+     *
+     * As in \ref parse_directory, runtime_errors from parsing a message are reported and do not stop the program.
+     * Copies of a mail (same Message-Id, see \ref first_copy) are only reported once.
+     * Events refer to their message by the path of the mbox file followed by ":" and the byte offset of the message.
+     *
+     * @param f Path to an mbox file.
+     * @tparam Events std::vector of EnklaveEvent with any allocator, e.g. std::pmr::vector.
+     * @param threads Number of threads; 0 means one per hardware thread.
+     * @param classifier Runtime rules classifying mails; nullptr selects the \ref builtin_profiles.
+     * @param body_scan_bytes Bytes of the text/html part scanned if the header of a message is inconclusive, see
+     * \ref parse_mail; 0 disables the fallback.
+     * @param allocator Allocates the returned vector.
+     * @return Vector of EnklaveEvent.
+     */
+    template<typename Events = std::vector<EnklaveEvent>>
+    Events parse_mbox(const fs::path &f, unsigned threads = config::parser_threads,
+                      const Classifier *classifier = nullptr, std::size_t body_scan_bytes = 0,
+                      const typename Events::allocator_type &allocator = {}) {
+        std::cout << "Scanning for relevant messages in: " << f << ":\n";
+
+        const MappedFile mapped{f};
+        const auto data = mapped.view();
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        // Ranges much smaller than a message are pointless.
+        threads = static_cast<unsigned>(std::min<std::size_t>(threads, data.size() / 65536 + 1));
+
+        std::vector<std::vector<EnklaveEvent>> partial_results(threads);
+        ConcurrentHashSet seen;
+        auto process_range = [&](unsigned index) {
+            const auto begin = data.size() / threads * index;
+            const auto end = index + 1 == threads ? data.size() : data.size() / threads * (index + 1);
+            auto &events = partial_results[index];
+            ParseContext context{classifier};
+
+            auto separator = find_mbox_separator(data, begin);
+            while (separator != std::string_view::npos && separator < end) {
+                const auto next_separator = find_mbox_separator(data, separator + 1);
+                const auto header = mbox_message_header(data, separator, next_separator);
+                if (header.data() == nullptr) {
+                    // The separator line ends the file without a line ending; no message follows it.
+                    std::cerr << "Skipped message without header: " << f.string() << ":" << separator << std::endl;
+                    separator = next_separator;
+                    continue;
+                }
+                try {
+                    const auto body_begin = static_cast<std::size_t>(header.data() + header.size() - data.data());
+                    const auto body_end = std::min(next_separator, data.size());
+                    const auto body = data.substr(body_begin, body_end - body_begin);
+                    auto event = parse_mail(context, header, body, body_scan_bytes, [&]() {
+                        return f.string() + ":" + std::to_string(separator);
+                    });
+                    if (first_copy(seen, event))
+                        events.push_back(std::move(event));
+                } catch (std::runtime_error &e) {
+                    std::cerr << e.what() << std::endl; // e.g. message is not from enklave.
+                }
+                separator = next_separator;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(process_range, i);
+        process_range(0);
+        for (auto &t: workers)
+            t.join();
+
+        Events enklave_events{allocator};
+        std::size_t total = 0;
+        for (auto &events: partial_results)
+            total += events.size();
+        enklave_events.reserve(total);
+        for (auto &events: partial_results)
+            std::move(events.begin(), events.end(), std::back_inserter(enklave_events));
+        return enklave_events;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_MBOX_HPP
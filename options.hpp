@@ -0,0 +1,165 @@
+#ifndef TIME_AT_ENKLAVE_OPTIONS_HPP
+#define TIME_AT_ENKLAVE_OPTIONS_HPP
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "config.hpp"
+#include "pipeline.hpp"
+#include "range.hpp"
+
+namespace enklave {
+    /// Settings of one program run, usually parsed from the command line by \ref parse_options.
+    struct Options {
+        std::string path_with_mails{config::path_with_mails};
+        PipelineConfig pipeline;
+        /// Print counters of the ingestion stages at the end of the run.
+        bool stats = false;
+        /// File keeping the state of scanned directories between runs; empty if no cache is used.
+        std::string directory_cache;
+        /// File with the rules classifying mails (see \ref parse_rules); empty if the built-in rules are used.
+        std::string rules_file;
+        /// Journal of the events of past runs (see \ref EventJournal); empty if every run scans all files.
+        std::string journal;
+        /// File with the timeslots of all events (see \ref QueryIndex); empty if they are computed on every run.
+        std::string index;
+        /// Socket a \ref QueryDaemon answers on; empty if the run prints its result and exits.
+        std::string serve_socket;
+        /// Socket of a running daemon that request is sent to (see \ref query_daemon); empty if no daemon is asked.
+        std::string query_socket;
+        std::string request;
+        /// Shared memory object the results are published to (see \ref SharedResultsWriter); empty if they aren't.
+        std::string shared_results;
+    };
+
+    /// Short description of the command line, printed if the command line can't be parsed.
+    constexpr char usage[] =
+            "Usage: time_at_enklave [path] [options]\n"
+            "  path                 Folder with exported mails, an .mbox or a .tar file (default: tests/data/)\n"
+            "  --recursive          Include subdirectories\n"
+            "  --maildir            Folder is a (nested) Maildir; implies --recursive\n"
+            "  --traversal-threads N  Threads listing subdirectories in parallel\n"
+            "  --scan-backend B     Directory listing: getdents (Linux, default) or portable\n"
+            "  --readers N          Threads reading mail headers\n"
+            "  --parsers N          Threads parsing mail headers (0: one per hardware thread)\n"
+            "  --queue-capacity N   Maximum number of items waiting between two ingestion stages (1 to 1048576)\n"
+            "  --stats              Print time, CPU time and throughput of each stage and phase\n"
+            "  --cache FILE         Skip directories unchanged since the run that wrote FILE\n"
+            "  --since YYYY-MM-DD   Only count time from the beginning of this day on\n"
+            "  --until YYYY-MM-DD   Only count time up to the end of this day\n"
+            "  --rules FILE         Classify mails by the sites and patterns in FILE instead of the built-in rules\n"
+            "  --body-scan N        If a header says neither check-in nor check-out, scan N bytes of the HTML body\n"
+            "  --journal FILE       Replay the events of past runs from FILE and only read files added since\n"
+            "  --index FILE         Answer from the timeslots in FILE while the source of the mails is unchanged\n"
+            "  --serve SOCKET       Keep the events in memory and answer queries on a Unix domain socket\n"
+            "  --query SOCKET REQ   Send a request (TOTAL, RANGE, MEMBER or BUCKETS) to a daemon, print its answer\n"
+            "  --export NAME        Publish totals and latest timeslots to shared memory NAME, e.g. /enklave\n";
+
+    /** Parse the command line.
+     *
+     * The first argument that is not an option is the path to the folder with mails (or to an mbox or tar file).
+     * Throws invalid_argument if an option is unknown or its value is missing or malformed, or if options conflict.
+     *
+     * @param argc As passed to main.
+     * @param argv As passed to main.
+     * @return Options.
+     */
+    Options parse_options(int argc, const char *const argv[]) noexcept(false) {
+        Options options;
+        bool path_seen = false;
+
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg{argv[i]};
+
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw std::invalid_argument{"Missing value for option " + std::string{arg}};
+                return argv[++i];
+            };
+            auto number = [&]() -> unsigned long {
+                const auto text = value();
+                std::size_t parsed = 0;
+                unsigned long result = 0;
+                try {
+                    result = std::stoul(text, &parsed);
+                } catch (std::logic_error &) { // invalid_argument or out_of_range.
+                    parsed = 0;
+                }
+                if (parsed == 0 || parsed != text.size())
+                    throw std::invalid_argument{"Option " + std::string{arg} + " expects a number: " + text};
+                return result;
+            };
+
+            if (arg == "--recursive") {
+                options.pipeline.scan.recursive = true;
+            } else if (arg == "--maildir") {
+                options.pipeline.scan.layout = MailLayout::MAILDIR;
+            } else if (arg == "--traversal-threads") {
+                options.pipeline.scan.traversal_threads = static_cast<unsigned>(number());
+            } else if (arg == "--scan-backend") {
+                const auto backend = value();
+                if (backend == "portable")
+                    options.pipeline.scan.backend = ScanBackend::PORTABLE;
+                else if (backend == "getdents")
+                    options.pipeline.scan.backend = ScanBackend::GETDENTS;
+                else
+                    throw std::invalid_argument{"Unknown scan backend: " + backend};
+            } else if (arg == "--readers") {
+                options.pipeline.reader_threads = static_cast<unsigned>(number());
+            } else if (arg == "--parsers") {
+                options.pipeline.parser_threads = static_cast<unsigned>(number());
+            } else if (arg == "--queue-capacity") {
+                const auto capacity = number();
+                if (capacity == 0 || capacity > config::max_queue_capacity)
+                    throw std::invalid_argument{"Option --queue-capacity expects a number from 1 to " +
+                                                std::to_string(config::max_queue_capacity) + ": " +
+                                                std::to_string(capacity)};
+                options.pipeline.queue_capacity = capacity;
+            } else if (arg == "--cache") {
+                options.directory_cache = value();
+            } else if (arg == "--rules") {
+                options.rules_file = value();
+            } else if (arg == "--index") {
+                options.index = value();
+            } else if (arg == "--serve") {
+                options.serve_socket = value();
+            } else if (arg == "--query") {
+                options.query_socket = value();
+                options.request = value();
+            } else if (arg == "--export") {
+                options.shared_results = value();
+            } else if (arg == "--journal") {
+                options.journal = value();
+            } else if (arg == "--body-scan") {
+                options.pipeline.body_scan_bytes = number();
+            } else if (arg == "--since" || arg == "--until") {
+                const auto text = value();
+                const auto day = parse_day(text);
+                if (!day)
+                    throw std::invalid_argument{"Option " + std::string{arg} + " expects a day (YYYY-MM-DD): " + text};
+                if (arg == "--since")
+                    options.pipeline.scan.range.since = *day;
+                else
+                    options.pipeline.scan.range.until = *day + date::days{1};
+            } else if (arg == "--stats") {
+                options.stats = true;
+            } else if (arg.size() > 1 && arg[0] == '-') {
+                throw std::invalid_argument{"Unknown option: " + std::string{arg}};
+            } else if (!path_seen) { // If path is passed in, override configured path.
+                options.path_with_mails = arg;
+                path_seen = true;
+            } else {
+                throw std::invalid_argument{"Unexpected argument: " + std::string{arg}};
+            }
+        }
+        if (!options.journal.empty() && !options.directory_cache.empty())
+            throw std::invalid_argument{"Options --journal and --cache can't be combined"};
+        const auto &range = options.pipeline.scan.range;
+        if (range.since && range.until && *range.since >= *range.until)
+            throw std::invalid_argument{"Option --since must not be later than --until"};
+        return options;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_OPTIONS_HPP
@@ -0,0 +1,495 @@
+#ifndef TIME_AT_ENKLAVE_PIPELINE_HPP
+#define TIME_AT_ENKLAVE_PIPELINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "arena.hpp"
+#include "body.hpp"
+#include "bounded_queue.hpp"
+#include "config.hpp"
+#include "dedup.hpp"
+#include "enklave.hpp"
+#include "scan.hpp"
+
+namespace enklave {
+    /// Thread budget and queue sizes of the ingestion pipeline used by \ref parse_directory.
+    struct PipelineConfig {
+        /// Threads of the enumerate stage are ScanConfig::traversal_threads.
+        ScanConfig scan;
+        /// Threads reading header bytes from disk. Reading is I/O-bound, so this may exceed the number of cores.
+        unsigned reader_threads = config::reader_threads;
+        /// Threads classifying headers and parsing datetimes. 0 means one per hardware thread.
+        unsigned parser_threads = config::parser_threads;
+        /// Maximum number of items waiting between two stages; bounds the memory held by in-flight headers.
+        std::size_t queue_capacity = config::queue_capacity;
+        /// Rules classifying mails, see \ref Classifier; nullptr means the \ref builtin_profiles.
+        const Classifier *classifier = nullptr;
+        /// Bytes of the text/html part scanned if the header of a mail is inconclusive, see \ref classify_by_body;
+        /// 0 disables the fallback.
+        std::size_t body_scan_bytes = 0;
+    };
+
+    /** Fingerprint of the settings that decide which events the files of a directory yield: the rules classifying
+     * mails, the body scan, the layout and recursion. A \ref DirectoryCache saved under other settings holds stale
+     * events and is discarded when loaded.
+     */
+    std::uint64_t cache_fingerprint_of(const PipelineConfig &pipeline_config) {
+        std::string settings = pipeline_config.classifier ? "rules" : "builtin";
+        auto add = [&settings](std::string_view value) {
+            settings += '\0';
+            settings += value;
+        };
+        for (const auto &site: pipeline_config.classifier ? pipeline_config.classifier->sites() : default_rules()) {
+            add(site.site);
+            for (const auto *patterns: {&site.senders, &site.check_in, &site.check_out}) {
+                add(std::to_string(patterns->size()));
+                for (const auto &pattern: *patterns)
+                    add(pattern);
+            }
+        }
+        add(std::to_string(pipeline_config.body_scan_bytes));
+        add(std::to_string(static_cast<int>(pipeline_config.scan.layout)));
+        add(std::to_string(pipeline_config.scan.recursive));
+        return detail::hash_of(settings);
+    }
+
+    /** Counters of one pipeline stage, summed over all threads of the stage.
+     *
+     * Threads count locally and add their totals once when they finish, so the hot loops never write shared cache
+     * lines. Time spent waiting on the input queue means the stage is starved by its predecessor, time spent waiting
+     * on the output queue means it is throttled by its successor (backpressure).
+     */
+    struct alignas(64) StageCounters {
+        std::atomic<unsigned> threads{0};
+        std::atomic<std::uint64_t> items{0};
+        std::atomic<std::uint64_t> bytes{0};
+        std::atomic<std::uint64_t> busy_ns{0};
+        /// CPU time of the stage's threads; busy time above it is spent blocked in I/O or waiting to be scheduled.
+        std::atomic<std::uint64_t> cpu_ns{0};
+        std::atomic<std::uint64_t> input_wait_ns{0};
+        std::atomic<std::uint64_t> output_wait_ns{0};
+    };
+
+    /// Counters of all stages of one \ref parse_directory run.
+    struct PipelineStats {
+        StageCounters enumerate;
+        StageCounters read;
+        StageCounters parse;
+        /// Part of parse: converting datetimes, see ParseContext::date_parsing_time. Items are mails dated.
+        StageCounters dates;
+        StageCounters aggregate;
+        /// Wall time of the whole run; throughputs are given relative to it.
+        std::atomic<std::uint64_t> wall_ns{0};
+        /// Mails dropped because another copy of them was parsed before, see \ref first_copy.
+        std::atomic<std::uint64_t> duplicates{0};
+        /// Files not read because another hard or symbolic link to them was found before, see MailEntry::file_id.
+        std::atomic<std::uint64_t> links{0};
+        /// Mails whose body was read because their header was inconclusive, see PipelineConfig::body_scan_bytes.
+        std::atomic<std::uint64_t> body_scans{0};
+    };
+
+    namespace detail {
+        /// Thread-local counterpart of StageCounters; flushed into the shared counters when the thread finishes.
+        struct LocalCounters {
+            std::uint64_t items = 0;
+            std::uint64_t bytes = 0;
+            std::chrono::nanoseconds input_wait{0};
+            std::chrono::nanoseconds output_wait{0};
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::chrono::nanoseconds cpu_start = thread_cpu_time();
+
+            void flush_to(StageCounters &counters) const {
+                const std::chrono::nanoseconds total = std::chrono::steady_clock::now() - start;
+                const auto cpu = thread_cpu_time() - cpu_start;
+                const auto busy = total - input_wait - output_wait;
+                counters.threads.fetch_add(1, std::memory_order_relaxed);
+                counters.items.fetch_add(items, std::memory_order_relaxed);
+                counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+                counters.busy_ns.fetch_add(static_cast<std::uint64_t>(std::max(busy.count(), std::int64_t{0})),
+                                           std::memory_order_relaxed);
+                counters.cpu_ns.fetch_add(static_cast<std::uint64_t>(cpu.count()), std::memory_order_relaxed);
+                counters.input_wait_ns.fetch_add(static_cast<std::uint64_t>(input_wait.count()),
+                                                 std::memory_order_relaxed);
+                counters.output_wait_ns.fetch_add(static_cast<std::uint64_t>(output_wait.count()),
+                                                  std::memory_order_relaxed);
+            }
+        };
+
+        /** Events by file identity and links whose file was not read; used to attribute those files to the
+         * directories of all their links in the directory cache.
+         */
+        class LinkAttribution {
+        public:
+            void parsed(std::uint64_t file_id, const EnklaveEvent &event) {
+                std::lock_guard<std::mutex> lock{mutex};
+                events.emplace(file_id, event);
+            }
+
+            void skipped(MailEntry entry) {
+                std::lock_guard<std::mutex> lock{mutex};
+                links.push_back(std::move(entry));
+            }
+
+            /// The file could not be read; the directories of its links are incomplete as well.
+            void failed(std::uint64_t file_id) {
+                std::lock_guard<std::mutex> lock{mutex};
+                failed_files.insert(file_id);
+            }
+
+            /// Add the event of every skipped link's file to the cache, as if the link had been read.
+            void attribute(DirectoryCache &cache) {
+                for (const auto &link: links) {
+                    if (failed_files.count(link.file_id) != 0) {
+                        cache.failed(link.directory->path());
+                        continue;
+                    }
+                    const auto found = events.find(link.file_id);
+                    if (found == events.end())
+                        continue;
+                    EnklaveEvent event = found->second;
+                    event.file = link.path();
+                    cache.add_event(event, link.file_id);
+                }
+            }
+
+        private:
+            std::mutex mutex;
+            std::unordered_map<std::uint64_t, EnklaveEvent> events;
+            std::unordered_set<std::uint64_t> failed_files;
+            std::vector<MailEntry> links;
+        };
+
+        /// Header bytes of one file travelling from the read stage to the parse stage.
+        struct RawMail {
+            MailEntry entry;
+            /// Taken from the header pool of the run; freed by the parse stage.
+            ArenaString header;
+        };
+
+        /// Remembers the first exception thrown by any stage and aborts all queues such that no thread waits forever.
+        class ErrorSlot {
+        public:
+            template<typename... Queues>
+            void fail(Queues &... queues) {
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    if (!error)
+                        error = std::current_exception();
+                }
+                (queues.abort(), ...);
+            }
+
+            void rethrow_if_failed() {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+
+        private:
+            std::mutex mutex;
+            std::exception_ptr error;
+        };
+    }
+
+    /// Pretty-print the per-stage counters of a pipeline run to terminal.
+    std::ostream &operator<<(std::ostream &out, const PipelineStats &stats) {
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        const auto seconds = static_cast<double>(stats.wall_ns.load()) / 1e9;
+        auto print = [&out, seconds](const char *name, const StageCounters &c) {
+            auto ms = [](const std::atomic<std::uint64_t> &ns) { return static_cast<double>(ns.load()) / 1e6; };
+            auto per_second = [seconds](std::uint64_t n) { return seconds > 0 ? static_cast<double>(n) / seconds : 0; };
+            out << std::left << std::setw(10) << name << std::right
+                << " threads: " << std::setw(2) << c.threads.load()
+                << " items: " << std::setw(8) << c.items.load()
+                << " bytes: " << std::setw(10) << c.bytes.load()
+                << std::fixed << std::setprecision(1)
+                << " busy: " << std::setw(8) << ms(c.busy_ns) << " ms"
+                << " cpu: " << std::setw(8) << ms(c.cpu_ns) << " ms"
+                << " starved: " << std::setw(8) << ms(c.input_wait_ns) << " ms"
+                << " throttled: " << std::setw(8) << ms(c.output_wait_ns) << " ms"
+                << std::setprecision(0)
+                << " items/s: " << std::setw(9) << per_second(c.items.load())
+                << std::setprecision(1)
+                << " MB/s: " << std::setw(7) << per_second(c.bytes.load()) / 1e6 << std::endl;
+        };
+        print("enumerate", stats.enumerate);
+        print("read", stats.read);
+        print("parse", stats.parse);
+        print(" dates", stats.dates);
+        print("aggregate", stats.aggregate);
+        out << std::fixed << std::setprecision(1) << "wall: " << static_cast<double>(stats.wall_ns.load()) / 1e6
+            << " ms duplicates: " << stats.duplicates.load() << " links: " << stats.links.load()
+            << " body scans: " << stats.body_scans.load() << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+        return out;
+    }
+
+    /** Read all files in a directory and return a vector with parsed data.
+     *
+     * The work is split into a pipeline of stages connected by bounded queues, see \ref BoundedQueue:
+     * - enumerate: list the directory and pass on mail files, see \ref scan_worker. Subdirectories are only included
+     *   if configured in \ref ScanConfig. A file reached through several hard or symbolic links (e.g. in backup
+     *   snapshots) is only passed on for its first link.
+     * - read: read (and decompress) the header block of each file, see \ref read_header.
+     * - parse: classify the header, see \ref parse_header, and drop copies of mails already parsed, see
+     *   \ref first_copy. Only if the header is inconclusive and PipelineConfig::body_scan_bytes is set, the start of
+     *   the file is read again to classify the mail by its body, see \ref classify_by_body.
+     * - aggregate: collect the events on the calling thread.
+     *
+     * Directories found unchanged in ScanConfig::cache are not listed; their cached events are added to the result
+     * (also without copies). Directories with a file that could not be read are not cached, see
+     * DirectoryCache::failed.
+     *
+     * Each stage runs on its own threads as configured in \ref PipelineConfig. Exceptions of type runtime_error from
+     * parsing are reported and do not stop the program; all other exceptions (e.g. from filesystem) are rethrown to
+     * the caller once all threads have finished.
+     *
+     * Header buffers are taken from a pool on a monotonic arena owned by the run: a buffer freed by a parser is
+     * handed to the next reader without a call to malloc, and the arena is released at once when the run ends. The
+     * result may live in an arena of the caller, see Events.
+     *
+     * @tparam Events std::vector of EnklaveEvent with any allocator, e.g. std::pmr::vector.
+     * @param p Path do a directory.
+     * @param pipeline_config Thread budget, queue sizes and the rules classifying mails.
+     * @param stats Optional; receives the counters of each stage.
+     * @param allocator Allocates the returned vector.
+     * @return Vector of EnklaveEvent.
+     */
+    template<typename Events = std::vector<EnklaveEvent>>
+    Events parse_directory(const fs::path &p, const PipelineConfig &pipeline_config, PipelineStats *stats = nullptr,
+                           const typename Events::allocator_type &allocator = {}) {
+        std::cout << "Scanning for relevant files in: " << p << ":\n";
+
+        PipelineStats local_stats;
+        PipelineStats &counters = stats ? *stats : local_stats;
+        const auto run_start = std::chrono::steady_clock::now();
+
+        const unsigned traversers = std::max(1u, pipeline_config.scan.traversal_threads);
+        const unsigned readers = std::max(1u, pipeline_config.reader_threads);
+        const unsigned parsers = pipeline_config.parser_threads != 0 ? pipeline_config.parser_threads
+                                                                     : std::max(1u,
+                                                                                std::thread::hardware_concurrency());
+
+        std::pmr::monotonic_buffer_resource run_arena;
+        std::pmr::synchronized_pool_resource header_pool{&run_arena};
+
+        DirectoryWorkList directories{p};
+        BoundedQueue<MailEntry> paths{pipeline_config.queue_capacity, traversers};
+        BoundedQueue<detail::RawMail> headers{pipeline_config.queue_capacity, readers};
+        BoundedQueue<EnklaveEvent> events{pipeline_config.queue_capacity, parsers};
+        ConcurrentHashSet seen;
+        ConcurrentHashSet physical_files;
+        detail::LinkAttribution link_attribution;
+        DirectoryCache *const cache = pipeline_config.scan.cache;
+        detail::ErrorSlot error;
+
+        auto enumerate = [&]() {
+            detail::LocalCounters local;
+            try {
+                scan_worker(directories, pipeline_config.scan, [&](MailEntry &&entry) {
+                    if (entry.file_id != 0 && !physical_files.insert(entry.file_id)) {
+                        counters.links.fetch_add(1, std::memory_order_relaxed);
+                        if (cache)
+                            link_attribution.skipped(std::move(entry));
+                        return true;
+                    }
+                    ++local.items;
+                    return paths.push(entry, local.output_wait);
+                }, local.input_wait);
+            } catch (...) {
+                directories.abort();
+                error.fail(paths, headers, events);
+            }
+            paths.producer_done();
+            local.flush_to(counters.enumerate);
+        };
+
+        // A directory with a file that could not be read is neither cached nor skipped by the next incremental scan,
+        // such that the next run retries the file, and the stamps of the source don't vouch for its events. An empty
+        // file may still be written in place, which changes its own stamp but not the one of its directory; its stamp
+        // is recorded, taken before it is checked to be still empty.
+        auto read_failed = [&](const MailEntry &entry, bool empty) {
+            if (auto *const retry = pipeline_config.scan.retry)
+                retry->failed(entry.directory->path());
+            if (auto *const stamps = pipeline_config.scan.stamps) {
+                FileStamp stamp;
+                std::error_code ec;
+                if (empty && detail::stamp_of(entry.path(), stamp) && fs::file_size(entry.path(), ec) == 0 && !ec)
+                    stamps->add(entry.path(), stamp);
+                else
+                    stamps->failed();
+            }
+            if (!cache)
+                return;
+            cache->failed(entry.directory->path());
+            if (entry.file_id != 0)
+                link_attribution.failed(entry.file_id);
+        };
+
+        auto read = [&]() {
+            detail::LocalCounters local;
+            try {
+                MailEntry entry;
+                while (paths.pop(entry, local.input_wait)) {
+                    detail::RawMail mail{std::move(entry), {}};
+                    try {
+                        mail.header = read_header<ArenaString>(mail.entry, &header_pool);
+                    } catch (std::runtime_error &e) {
+                        std::cerr << e.what() << std::endl; // e.g. I/O error or compressed file is corrupt.
+                        read_failed(mail.entry, false);
+                        continue;
+                    }
+                    // Nothing to read yet, e.g. the file is still being written; parsing reports it.
+                    if (mail.header.empty())
+                        read_failed(mail.entry, true);
+                    ++local.items;
+                    local.bytes += mail.header.size();
+                    if (!headers.push(mail, local.output_wait))
+                        break;
+                }
+            } catch (...) {
+                error.fail(paths, headers, events);
+            }
+            headers.producer_done();
+            local.flush_to(counters.read);
+        };
+
+        auto parse = [&]() {
+            detail::LocalCounters local;
+            ParseContext context{pipeline_config.classifier};
+            try {
+                detail::RawMail mail;
+                while (headers.pop(mail, local.input_wait)) {
+                    ++local.items;
+                    local.bytes += mail.header.size();
+                    EnklaveEvent event;
+                    try {
+                        // The full path is only built for events and error messages.
+                        event = parse_header_lazy(context, mail.header, [&mail]() { return mail.entry.path(); });
+                    } catch (InconclusiveMail &e) {
+                        const auto scan = pipeline_config.body_scan_bytes;
+                        if (scan == 0) {
+                            std::cerr << e.what() << std::endl;
+                            continue;
+                        }
+                        counters.body_scans.fetch_add(1, std::memory_order_relaxed);
+                        // Read again like the header: relative to the directory it was found in, not by its path.
+                        auto &prefix = context.prefix_buffer();
+                        try {
+                            read_prefix(mail.entry, mail.header.size() + config::body_scan_slack + scan, prefix);
+                        } catch (std::runtime_error &read_error) {
+                            std::cerr << read_error.what() << std::endl;
+                            read_failed(mail.entry, false);
+                            continue;
+                        }
+                        try {
+                            const auto body = std::string_view{prefix}.substr(std::min(mail.header.size(),
+                                                                                       prefix.size()));
+                            event = classify_by_body(context, e, mail.header, body, scan);
+                        } catch (std::runtime_error &body_error) {
+                            std::cerr << body_error.what() << std::endl;
+                            continue;
+                        }
+                    } catch (std::runtime_error &e) {
+                        // e.g. file could be opened, but parsing did not meet criteria.
+                        std::cerr << e.what() << std::endl;
+                        continue;
+                    }
+                    if (cache) {
+                        // Copies are recorded as well; their directories must be complete if reused later.
+                        cache->add_event(event, mail.entry.file_id);
+                        if (mail.entry.file_id != 0)
+                            link_attribution.parsed(mail.entry.file_id, event);
+                    }
+                    if (!first_copy(seen, event)) {
+                        counters.duplicates.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    if (!events.push(event, local.output_wait))
+                        break;
+                }
+            } catch (...) {
+                error.fail(paths, headers, events);
+            }
+            events.producer_done();
+            local.flush_to(counters.parse);
+            // Converting datetimes is pure computation, so its busy time is CPU time as well.
+            const auto dating = static_cast<std::uint64_t>(context.date_parsing_time().count());
+            counters.dates.threads.fetch_add(1, std::memory_order_relaxed);
+            counters.dates.items.fetch_add(context.dated_mails(), std::memory_order_relaxed);
+            counters.dates.busy_ns.fetch_add(dating, std::memory_order_relaxed);
+            counters.dates.cpu_ns.fetch_add(dating, std::memory_order_relaxed);
+        };
+
+        std::vector<std::thread> threads;
+        Events enklave_events{allocator};
+        try {
+            for (unsigned i = 0; i < traversers; ++i)
+                threads.emplace_back(enumerate);
+            for (unsigned i = 0; i < readers; ++i)
+                threads.emplace_back(read);
+            for (unsigned i = 0; i < parsers; ++i)
+                threads.emplace_back(parse);
+
+            // Aggregate on the calling thread.
+            detail::LocalCounters local;
+            EnklaveEvent event;
+            while (events.pop(event, local.input_wait)) {
+                enklave_events.push_back(std::move(event));
+                ++local.items;
+            }
+            local.flush_to(counters.aggregate);
+        } catch (...) {
+            // Starting a stage or collecting its events failed: stop the stages that run, then pass the error on.
+            directories.abort();
+            error.fail(paths, headers, events);
+            for (auto &t: threads)
+                t.join();
+            throw;
+        }
+
+        for (auto &t: threads)
+            t.join();
+        error.rethrow_if_failed();
+
+        if (cache) {
+            link_attribution.attribute(*cache);
+            for (auto &[event, file_id]: cache->take_reused_events()) {
+                // A file is cached in the directory of every link to it, and may have been read during this run too.
+                if (file_id != 0 && !physical_files.insert(file_id))
+                    counters.links.fetch_add(1, std::memory_order_relaxed);
+                else if (first_copy(seen, event))
+                    enklave_events.push_back(std::move(event));
+                else
+                    counters.duplicates.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        const std::chrono::nanoseconds run_time = std::chrono::steady_clock::now() - run_start;
+        counters.wall_ns.fetch_add(static_cast<std::uint64_t>(run_time.count()), std::memory_order_relaxed);
+        return enklave_events;
+    }
+
+    /** Read all files in a directory with the default \ref PipelineConfig.
+     *
+     * @param p Path do a directory.
+     * @return Vector of EnklaveEvent.
+     */
+    std::vector<EnklaveEvent> parse_directory(const fs::path &p) {
+        return parse_directory(p, PipelineConfig{});
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_PIPELINE_HPP
@@ -0,0 +1,164 @@
+#ifndef TIME_AT_ENKLAVE_PROFILE_HPP
+#define TIME_AT_ENKLAVE_PROFILE_HPP
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace enklave {
+    /** Declarations of the built-in site profiles, evaluated at compile time.
+     *
+     * A profile lists rules like
+     *
+     *     header("Subject").contains("Check in") >> check_in
+     *     header("X-Pm-Date") >> timestamp
+     *
+     * and is declared as an inline constexpr variable. \ref parse_header_with turns it into a matcher: the start of
+     * every field is compared against the field names of the profile (see \ref FieldNames), the field is dispatched
+     * to its rules by an index known at compile time, and every value is compared against its literal inline. No
+     * pattern is compiled at runtime; rules files given with --rules use the \ref Classifier instead.
+     */
+    namespace dsl {
+        /// What a matching rule says about a mail.
+        enum class Action {
+            /// The mail is from the site of the profile; only allowed on the first field.
+            SENDER,
+            CHECK_IN,
+            CHECK_OUT,
+            /// The line holds the time of the event.
+            TIMESTAMP
+        };
+
+        inline constexpr Action sender = Action::SENDER;
+        inline constexpr Action check_in = Action::CHECK_IN;
+        inline constexpr Action check_out = Action::CHECK_OUT;
+        inline constexpr Action timestamp = Action::TIMESTAMP;
+
+        /// One rule; an empty header means the first field of the header block, an empty needle matches any value.
+        struct Rule {
+            std::string_view header;
+            std::string_view needle;
+            Action action;
+        };
+
+        struct Test {
+            std::string_view header;
+            std::string_view needle;
+        };
+
+        struct Header {
+            std::string_view name;
+
+            /** Matches if the value of the field contains needle (case-sensitive).
+             *
+             * The value of a named field is decoded and its whitespace normalized first (see
+             * \ref decode_header_text), so needles are plain text with single spaces. The first field is matched raw.
+             */
+            constexpr Test contains(std::string_view needle) const {
+                return {name, needle};
+            }
+        };
+
+        /// Field of the header block, given by its name without the colon.
+        constexpr Header header(std::string_view name) {
+            return {name};
+        }
+
+        /// First field of the header block (with its continuation lines, if folded), whatever its name.
+        constexpr Header first_line() {
+            return {{}};
+        }
+
+        constexpr Rule operator>>(Test test, Action action) {
+            return {test.header, test.needle, action};
+        }
+
+        constexpr Rule operator>>(Header field, Action action) {
+            return {field.name, {}, action};
+        }
+
+        /// Name of a site with its rules.
+        template<std::size_t N>
+        struct Profile {
+            std::string_view site;
+            std::array<Rule, N> rules;
+        };
+
+        template<typename... Rules>
+        constexpr Profile<sizeof...(Rules)> profile(std::string_view site, Rules... rules) {
+            return {site, {rules...}};
+        }
+
+        /// Distinct field names of the rules of a profile, in order of first appearance.
+        template<std::size_t N>
+        struct FieldList {
+            std::array<std::string_view, N> names{};
+            std::size_t size = 0;
+
+            /// Index of a name; size if it is not in the list.
+            constexpr std::size_t index_of(std::string_view name) const {
+                for (std::size_t i = 0; i < size; ++i) {
+                    if (names[i] == name)
+                        return i;
+                }
+                return size;
+            }
+        };
+
+        template<std::size_t N>
+        constexpr FieldList<N> fields_of(const Profile<N> &profile) {
+            FieldList<N> list;
+            for (const auto &rule: profile.rules) {
+                if (!rule.header.empty() && list.index_of(rule.header) == list.size)
+                    list.names[list.size++] = rule.header;
+            }
+            return list;
+        }
+
+        /// A profile needs a sender, check-in, check-out and timestamp rule; senders only match the first field.
+        template<std::size_t N>
+        constexpr bool is_valid(const Profile<N> &profile) {
+            bool has[4] = {false, false, false, false};
+            for (std::size_t i = 0; i < N; ++i) {
+                const auto &rule = profile.rules[i];
+                has[static_cast<int>(rule.action)] = true;
+                if ((rule.action == Action::SENDER) != rule.header.empty())
+                    return false;
+                if (rule.action == Action::SENDER && rule.needle.empty())
+                    return false;
+            }
+            return has[0] && has[1] && has[2] && has[3];
+        }
+
+        /// List of profiles, passed to \ref parse_header_with.
+        template<const auto &... P>
+        struct Profiles {
+        };
+
+        /// Call f with std::integral_constant<std::size_t, I> for every index I of the rules of a profile.
+        template<const auto &P, typename F, std::size_t... I>
+        constexpr void for_each_rule(F &&f, std::index_sequence<I...>) {
+            (f(std::integral_constant<std::size_t, I>{}), ...);
+        }
+
+        template<const auto &P, typename F>
+        constexpr void for_each_rule(F &&f) {
+            for_each_rule<P>(f, std::make_index_sequence<P.rules.size()>{});
+        }
+    }
+
+    /// Mails of Enklave: a mail from enklave.de whose Subject says whether it is a check-in or check-out.
+    inline constexpr auto enklave_profile = dsl::profile(
+            "enklave",
+            dsl::first_line().contains("header.from=enklave.de") >> dsl::sender,
+            dsl::header("Subject").contains("Check in") >> dsl::check_in,
+            dsl::header("Subject").contains("Check out") >> dsl::check_out,
+            dsl::header("X-Pm-Date") >> dsl::timestamp);
+
+    /// Profiles used if no rules file is given; a mail belongs to the first profile whose sender matches.
+    using builtin_profiles = dsl::Profiles<enklave_profile>;
+}
+
+#endif //TIME_AT_ENKLAVE_PROFILE_HPP
@@ -0,0 +1,431 @@
+#ifndef TIME_AT_ENKLAVE_QUERY_INDEX_HPP
+#define TIME_AT_ENKLAVE_QUERY_INDEX_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "dedup.hpp"
+#include "enklave.hpp"
+#include "mapped_file.hpp"
+#include "range.hpp"
+#include "scan.hpp"
+#include "shared_results.hpp"
+
+namespace enklave {
+    /** Order-independent fingerprint of a set of events; an index built from other events is out of date.
+     *
+     * Only what the timeslots depend on is included: time, type, Message-Id and site of every event.
+     */
+    template<typename Events>
+    std::uint64_t fingerprint_of(const Events &events) {
+        std::uint64_t fingerprint = mix_hash(events.size());
+        for (const EnklaveEvent &event: events) {
+            const auto when = static_cast<std::uint64_t>(event.when.time_since_epoch().count());
+            fingerprint += mix_hash(event.message_id_hash ^ (when * 0x9e3779b97f4a7c15ull) ^
+                                    detail::hash_of(event.site) ^ static_cast<std::uint64_t>(event.type));
+        }
+        return fingerprint;
+    }
+
+    /** Timeslots of every site in a flat, position-independent layout that is queried in place, e.g. memory-mapped.
+     *
+     * Per site, the begins and ends of its slots are stored as sorted arrays of seconds since the epoch, together with
+     * the prefix sums of the slot durations. The time spent within a range therefore costs two binary searches and
+     * the clipping of the two slots at the bounds, however many slots there are. The layout, in native byte order:
+     *
+     * - header: magic, version, number of sites, fingerprint of the events (see \ref fingerprint_of), number of
+     *   slots, settings of the source, offset and number of source stamps
+     * - per site: index of its first slot, number of slots, offset and size of its name
+     * - begins and ends of all slots, grouped by site
+     * - prefix sums: per site, one more than it has slots, starting with 0
+     * - names of the sites
+     * - per directory or file the events were read from: its stamp, the size of its path and the path
+     *
+     * An index is either built from events (see \ref build) or opened from a file written by \ref save. With the
+     * stamps of its source, an index is known to be up to date before the source is read, see \ref open_fresh.
+     */
+    class QueryIndex {
+    public:
+        QueryIndex(const QueryIndex &) = delete;
+
+        QueryIndex &operator=(const QueryIndex &) = delete;
+
+        QueryIndex(QueryIndex &&other) noexcept : mapped{std::move(other.mapped)}, owned{std::move(other.owned)},
+                                                  bytes{mapped ? mapped->view() : std::string_view{owned}} {}
+
+        QueryIndex &operator=(QueryIndex &&other) noexcept {
+            mapped = std::move(other.mapped);
+            owned = std::move(other.owned);
+            bytes = mapped ? mapped->view() : std::string_view{owned};
+            return *this;
+        }
+
+        /** Pair the events of every site (see \ref compute_timeslots) and lay out the result.
+         *
+         * Sites are ordered by the first appearance of an event of theirs. A site with less than two events has no
+         * slots.
+         *
+         * @param phases Optional; receives the times of \ref compute_timeslots.
+         */
+        template<typename Events>
+        static QueryIndex build(const Events &events, PhaseStats *phases = nullptr) {
+            std::vector<std::string> names;
+            for (const EnklaveEvent &event: events) {
+                if (std::find(names.begin(), names.end(), event.site) == names.end())
+                    names.push_back(event.site);
+            }
+
+            std::vector<std::vector<std::pair<std::int64_t, std::int64_t>>> slots(names.size());
+            for (std::size_t site = 0; site < names.size(); ++site) {
+                std::vector<EnklaveEvent> site_events;
+                for (const EnklaveEvent &event: events) {
+                    if (event.site == names[site])
+                        site_events.push_back(event);
+                }
+                if (site_events.size() < 2)
+                    continue;
+                for (const auto &[in, out]: compute_timeslots(site_events, phases))
+                    slots[site].emplace_back(in.when.time_since_epoch().count(), out.when.time_since_epoch().count());
+            }
+
+            std::size_t slot_count = 0;
+            std::size_t names_size = 0;
+            for (std::size_t site = 0; site < names.size(); ++site) {
+                slot_count += slots[site].size();
+                names_size += names[site].size();
+            }
+            const Layout layout{names.size(), slot_count};
+
+            std::string bytes(layout.names + names_size, '\0');
+            Header header{};
+            std::memcpy(header.magic, magic, sizeof(magic));
+            header.version = version;
+            header.site_count = static_cast<std::uint32_t>(names.size());
+            header.fingerprint = fingerprint_of(events);
+            header.slot_count = slot_count;
+            header.sources = bytes.size();
+            std::memcpy(bytes.data(), &header, sizeof(header));
+
+            std::size_t first_slot = 0;
+            std::size_t name_offset = layout.names;
+            for (std::size_t site = 0; site < names.size(); ++site) {
+                const SiteEntry entry{first_slot, slots[site].size(), name_offset, names[site].size()};
+                std::memcpy(bytes.data() + layout.sites + site * sizeof(SiteEntry), &entry, sizeof(entry));
+                std::memcpy(bytes.data() + name_offset, names[site].data(), names[site].size());
+
+                std::int64_t sum = 0;
+                put(bytes, layout.prefix + (first_slot + site) * sizeof(std::int64_t), sum);
+                for (std::size_t i = 0; i < slots[site].size(); ++i) {
+                    const auto [begin, end] = slots[site][i];
+                    sum += end - begin;
+                    put(bytes, layout.begins + (first_slot + i) * sizeof(std::int64_t), begin);
+                    put(bytes, layout.ends + (first_slot + i) * sizeof(std::int64_t), end);
+                    put(bytes, layout.prefix + (first_slot + site + i + 1) * sizeof(std::int64_t), sum);
+                }
+                first_slot += slots[site].size();
+                name_offset += names[site].size();
+            }
+            return QueryIndex{std::move(bytes)};
+        }
+
+        /** Same as above, and record the stamps of the source the events were read from, see \ref open_fresh.
+         *
+         * Incomplete stamps are not recorded; such an index is never fresh.
+         */
+        template<typename Events>
+        static QueryIndex build(const Events &events, const SourceStamps &sources, PhaseStats *phases = nullptr) {
+            auto index = build(events, phases);
+            auto header = index.header();
+            header.settings = sources.settings();
+            if (sources.complete()) {
+                for (const auto &[path, stamp]: sources.paths()) {
+                    const SourceEntry entry{stamp.mtime_ns, stamp.ctime_ns, path.size()};
+                    index.owned.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+                    index.owned += path;
+                    ++header.source_count;
+                }
+            }
+            std::memcpy(index.owned.data(), &header, sizeof(header));
+            index.bytes = index.owned;
+            return index;
+        }
+
+        /** Map an index file read-only if it was built from events with the given fingerprint.
+         *
+         * @param f Path to a file written by \ref save.
+         * @param fingerprint See \ref fingerprint_of.
+         * @return The index, or an empty optional if the file is missing, malformed or out of date.
+         */
+        static std::optional<QueryIndex> open(const fs::path &f, std::uint64_t fingerprint) {
+            std::error_code ec;
+            if (!fs::is_regular_file(f, ec))
+                return std::nullopt;
+            QueryIndex index{MappedFile{f}};
+            if (!index.valid() || index.fingerprint() != fingerprint)
+                return std::nullopt;
+            return index;
+        }
+
+        /** Map an index file read-only if the source it was built from did not change since.
+         *
+         * Every directory or file recorded by \ref SourceStamps is stamped again; nothing is listed and no mail is
+         * read, so the answer costs one stat per directory of the source.
+         *
+         * @param f Path to a file written by \ref save.
+         * @param settings See SourceStamps::settings.
+         * @return The index, or an empty optional if the file is missing, malformed, was built with other settings or
+         * without complete stamps, or any recorded stamp changed.
+         */
+        static std::optional<QueryIndex> open_fresh(const fs::path &f, std::uint64_t settings) {
+            std::error_code ec;
+            if (!fs::is_regular_file(f, ec))
+                return std::nullopt;
+            QueryIndex index{MappedFile{f}};
+            if (!index.valid() || index.header().settings != settings || !index.sources_unchanged())
+                return std::nullopt;
+            return index;
+        }
+
+        /// Write the index to a file; it is replaced atomically. Throws fs::filesystem_error.
+        void save(const fs::path &f) const {
+            const fs::path temporary = f.string() + ".tmp";
+            {
+                std::ofstream ofs{temporary, std::ios::binary | std::ios::trunc};
+                ofs.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+                if (!ofs)
+                    throw fs::filesystem_error{"Could not write query index", temporary,
+                                               std::make_error_code(std::errc::io_error)};
+            }
+            fs::rename(temporary, f);
+        }
+
+        std::uint64_t fingerprint() const {
+            return header().fingerprint;
+        }
+
+        std::size_t sites() const {
+            return header().site_count;
+        }
+
+        std::string_view site_name(std::size_t site) const {
+            const auto entry = site_entry(site);
+            return bytes.substr(entry.name_offset, entry.name_size);
+        }
+
+        /// Index of a site by its name; npos if the index has no slots or events of it.
+        std::size_t find_site(std::string_view name) const {
+            for (std::size_t site = 0; site < sites(); ++site) {
+                if (site_name(site) == name)
+                    return site;
+            }
+            return npos;
+        }
+
+        /// Number of timeslots of a site.
+        std::size_t slot_count(std::size_t site) const {
+            return site_entry(site).slot_count;
+        }
+
+        /// Begin and end of slot i of a site.
+        time_span slot(std::size_t site, std::size_t i) const {
+            const auto entry = site_entry(site);
+            return {seconds_at(layout().begins, entry.first_slot + i), seconds_at(layout().ends, entry.first_slot + i)};
+        }
+
+        /// Time spent at a site within a range; same as \ref compute_duration on its timeslots.
+        std::chrono::seconds duration(std::size_t site, const TimeRange &range = {}) const {
+            const auto entry = site_entry(site);
+            const auto *begins = array(layout().begins) + entry.first_slot;
+            const auto *ends = array(layout().ends) + entry.first_slot;
+            const auto *prefix = array(layout().prefix) + entry.first_slot + site;
+            const auto count = static_cast<std::ptrdiff_t>(entry.slot_count);
+
+            // Slots are disjoint and sorted, so their ends are sorted as well.
+            std::ptrdiff_t first = 0;
+            std::ptrdiff_t last = count;
+            if (range.since)
+                first = std::upper_bound(ends, ends + count, range.since->time_since_epoch().count()) - ends;
+            if (range.until)
+                last = std::lower_bound(begins, begins + count, range.until->time_since_epoch().count()) - begins;
+            if (first >= last)
+                return std::chrono::seconds{0};
+
+            auto total = prefix[last] - prefix[first];
+            if (range.since)
+                total -= std::max<std::int64_t>(0, range.since->time_since_epoch().count() - begins[first]);
+            if (range.until)
+                total -= std::max<std::int64_t>(0, ends[last - 1] - range.until->time_since_epoch().count());
+            return std::chrono::seconds{std::max<std::int64_t>(0, total)};
+        }
+
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    private:
+        static constexpr char magic[8] = {'E', 'N', 'K', 'I', 'D', 'X', '\0', '\0'};
+        static constexpr std::uint32_t version = 2;
+
+        struct Header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t site_count;
+            std::uint64_t fingerprint;
+            std::uint64_t slot_count;
+            std::uint64_t settings;
+            std::uint64_t sources;
+            std::uint64_t source_count;
+        };
+
+        struct SiteEntry {
+            std::uint64_t first_slot;
+            std::uint64_t slot_count;
+            std::uint64_t name_offset;
+            std::uint64_t name_size;
+        };
+
+        /// Stamp of a directory or file of the source; followed by its path, without alignment.
+        struct SourceEntry {
+            std::int64_t mtime_ns;
+            std::int64_t ctime_ns;
+            std::uint64_t path_size;
+        };
+
+        /// Offsets of the sections; every array starts at a multiple of 8 bytes.
+        struct Layout {
+            Layout(std::size_t site_count, std::size_t slot_count)
+                    : sites{sizeof(Header)}, begins{sites + site_count * sizeof(SiteEntry)},
+                      ends{begins + slot_count * sizeof(std::int64_t)},
+                      prefix{ends + slot_count * sizeof(std::int64_t)},
+                      names{prefix + (slot_count + site_count) * sizeof(std::int64_t)} {}
+
+            std::size_t sites;
+            std::size_t begins;
+            std::size_t ends;
+            std::size_t prefix;
+            std::size_t names;
+        };
+
+        explicit QueryIndex(std::string owned) : owned{std::move(owned)}, bytes{this->owned} {}
+
+        explicit QueryIndex(MappedFile file) : mapped{std::move(file)}, bytes{mapped->view()} {}
+
+        static void put(std::string &out, std::size_t offset, std::int64_t value) {
+            std::memcpy(out.data() + offset, &value, sizeof(value));
+        }
+
+        bool valid() const {
+            if (bytes.size() < sizeof(Header))
+                return false;
+            const auto h = header();
+            if (std::memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version)
+                return false;
+            // Sizes are checked before they are multiplied, such that a damaged header can't overflow the layout.
+            if (h.site_count > bytes.size() / sizeof(SiteEntry) || h.slot_count > bytes.size() / sizeof(std::int64_t))
+                return false;
+            const Layout l = layout();
+            if (bytes.size() < l.names || h.sources < l.names || h.sources > bytes.size())
+                return false;
+            std::uint64_t slots = 0;
+            for (std::size_t site = 0; site < h.site_count; ++site) {
+                const auto entry = site_entry(site);
+                if (entry.first_slot != slots || entry.slot_count > h.slot_count - slots ||
+                    entry.name_offset < l.names || entry.name_offset > bytes.size() ||
+                    entry.name_size > bytes.size() - entry.name_offset)
+                    return false;
+                slots += entry.slot_count;
+            }
+            return slots == h.slot_count;
+        }
+
+        /// Whether the index has stamps of its source and all of them are unchanged.
+        bool sources_unchanged() const {
+            const auto h = header();
+            if (h.source_count == 0)
+                return false;
+            auto offset = static_cast<std::size_t>(h.sources);
+            for (std::uint64_t i = 0; i < h.source_count; ++i) {
+                SourceEntry entry{};
+                if (bytes.size() - offset < sizeof(entry))
+                    return false;
+                std::memcpy(&entry, bytes.data() + offset, sizeof(entry));
+                offset += sizeof(entry);
+                if (entry.path_size > bytes.size() - offset)
+                    return false;
+                const fs::path source{std::string{bytes.substr(offset, entry.path_size)}};
+                offset += entry.path_size;
+                FileStamp stamp;
+                if (!detail::stamp_of(source, stamp) || stamp.mtime_ns != entry.mtime_ns ||
+                    stamp.ctime_ns != entry.ctime_ns)
+                    return false;
+            }
+            return true;
+        }
+
+        Header header() const {
+            Header h{};
+            std::memcpy(&h, bytes.data(), sizeof(h));
+            return h;
+        }
+
+        Layout layout() const {
+            const auto h = header();
+            return Layout{h.site_count, h.slot_count};
+        }
+
+        SiteEntry site_entry(std::size_t site) const {
+            SiteEntry entry{};
+            std::memcpy(&entry, bytes.data() + layout().sites + site * sizeof(SiteEntry), sizeof(entry));
+            return entry;
+        }
+
+        /// Array of seconds at an offset; mappings and std::string buffers are aligned for it.
+        const std::int64_t *array(std::size_t offset) const {
+            return reinterpret_cast<const std::int64_t *>(bytes.data() + offset);
+        }
+
+        date::sys_seconds seconds_at(std::size_t offset, std::size_t i) const {
+            return date::sys_seconds{std::chrono::seconds{array(offset)[i]}};
+        }
+
+        std::optional<MappedFile> mapped;
+        std::string owned;
+        std::string_view bytes;
+    };
+
+    /** Totals and latest timeslots of an index, as exported by \ref SharedResultsWriter.
+     *
+     * @param index Timeslots of all sites.
+     * @param range Range the totals are computed within; the latest slots are not clipped.
+     * @param published_at Time the results are published at.
+     * @return Results with a generation of 0; the writer's count is taken when they are read.
+     */
+    SharedResults shared_results_of(const QueryIndex &index, const TimeRange &range, date::sys_seconds published_at) {
+        SharedResults results;
+        results.published_at = published_at.time_since_epoch().count();
+        const auto max_recent = detail::SharedSegment::max_recent;
+        for (std::size_t site = 0; site < index.sites(); ++site) {
+            const auto slots = index.slot_count(site);
+            results.sites.push_back({std::string{index.site_name(site)}, index.duration(site, range).count(), slots});
+            for (auto i = slots - std::min(slots, max_recent); i < slots; ++i) {
+                const auto slot = index.slot(site, i);
+                results.recent.push_back({site, slot.first.time_since_epoch().count(),
+                                          slot.second.time_since_epoch().count()});
+            }
+        }
+        std::sort(results.recent.begin(), results.recent.end(), [](const SharedSlot &a, const SharedSlot &b) {
+            return a.begin < b.begin;
+        });
+        results.recent.erase(results.recent.begin(),
+                             results.recent.end() - std::min(results.recent.size(), max_recent));
+        return results;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_QUERY_INDEX_HPP
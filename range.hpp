@@ -0,0 +1,189 @@
+#ifndef TIME_AT_ENKLAVE_RANGE_HPP
+#define TIME_AT_ENKLAVE_RANGE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "enklave.hpp"
+
+namespace enklave {
+    /// Interval [begin, end) of points in time that something may contain.
+    using time_span = std::pair<date::sys_seconds, date::sys_seconds>;
+
+    /** Range of points in time a run is restricted to; each bound is optional.
+     *
+     * since is inclusive and until is exclusive. An unbounded range contains every point in time.
+     */
+    struct TimeRange {
+        std::optional<date::sys_seconds> since;
+        std::optional<date::sys_seconds> until;
+
+        bool bounded() const {
+            return since || until;
+        }
+
+        bool contains(date::sys_seconds when) const {
+            return (!since || when >= *since) && (!until || when < *until);
+        }
+
+        /// Whether the interval [begin, end) has at least one point in time in common with this range.
+        bool overlaps(const time_span &span) const {
+            return (!since || span.second > *since) && (!until || span.first < *until);
+        }
+
+        /// Range widened by slack on both bounded sides.
+        TimeRange padded(std::chrono::seconds slack) const {
+            TimeRange result = *this;
+            if (result.since)
+                *result.since -= slack;
+            if (result.until)
+                *result.until += slack;
+            return result;
+        }
+    };
+
+    namespace detail {
+        /// Value of exactly count decimal digits at the front of text, or -1.
+        int leading_number(std::string_view text, std::size_t count) {
+            if (text.size() < count)
+                return -1;
+            int result = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                if (text[i] < '0' || text[i] > '9')
+                    return -1;
+                result = result * 10 + (text[i] - '0');
+            }
+            // The number must not continue, e.g. "20190" is no year.
+            if (text.size() > count && text[count] >= '0' && text[count] <= '9')
+                return -1;
+            return result;
+        }
+
+        bool is_date_separator(char c) {
+            return c == '-' || c == '_' || c == '.';
+        }
+    }
+
+    /** Parse a day given as "YYYY-MM-DD", e.g. from the command line.
+     *
+     * @param text Day.
+     * @return Beginning of the day, or an empty optional if text is not a valid day.
+     */
+    std::optional<date::sys_seconds> parse_day(std::string_view text) {
+        if (text.size() != 10 || text[4] != '-' || text[7] != '-')
+            return std::nullopt;
+        const auto year = detail::leading_number(text, 4);
+        const auto month = detail::leading_number(text.substr(5), 2);
+        const auto day = detail::leading_number(text.substr(8), 2);
+        if (year < 0 || month < 0 || day < 0)
+            return std::nullopt;
+        const date::year_month_day ymd{date::year{year}, date::month(static_cast<unsigned>(month)),
+                                       date::day(static_cast<unsigned>(day))};
+        if (!ymd.ok())
+            return std::nullopt;
+        return date::sys_days{ymd};
+    }
+
+    /** Points in time a folder can hold mails of, derived from its name.
+     *
+     * Names that are a year ("2019"), a month ("2019-09", "2019_09", "2019.09") or a day ("2019-09-13") restrict the
+     * span, as do month ("09") and day ("13") folders nested in such a folder. Other names inherit the span of their
+     * parent.
+     *
+     * @param name Name of the folder.
+     * @param parent Span of the parent folder, if known.
+     * @return Span or an empty optional if unknown.
+     */
+    std::optional<time_span> span_of_folder(std::string_view name, const std::optional<time_span> &parent) {
+        using namespace date;
+        // The date must make up the whole name, e.g. "2015-2020", "2019_backup" or "2020 projects" are no shards.
+        const auto year = detail::leading_number(name, 4);
+        if (year >= 1970 && year < 2100) {
+            const date::year y{year};
+            if (name.size() == 4)
+                return time_span{sys_days{y / jan / 1}, sys_days{(y + years{1}) / jan / 1}};
+            const auto month = name.size() >= 7 && detail::is_date_separator(name[4])
+                               ? detail::leading_number(name.substr(5), 2) : -1;
+            if (month >= 1 && month <= 12) {
+                const auto ym = y / date::month(static_cast<unsigned>(month));
+                if (name.size() == 7)
+                    return time_span{sys_days{ym / 1}, sys_days{(ym + months{1}) / 1}};
+                const auto day = name.size() == 10 && detail::is_date_separator(name[7])
+                                 ? detail::leading_number(name.substr(8), 2) : -1;
+                if (day >= 1 && (ym / date::day(static_cast<unsigned>(day))).ok()) {
+                    const sys_days d{ym / date::day(static_cast<unsigned>(day))};
+                    return time_span{d, d + days{1}};
+                }
+            }
+            return parent;
+        }
+
+        if (parent && name.size() == 2) {
+            const auto number = detail::leading_number(name, 2);
+            const year_month_day begin{floor<days>(parent->first)};
+            const auto length = floor<days>(parent->second) - floor<days>(parent->first);
+            const bool parent_is_year = begin.month() == jan && begin.day() == day{1} && length >= days{365}
+                                        && length <= days{366};
+            const bool parent_is_month = begin.day() == day{1} && length >= days{28} && length <= days{31};
+            if (parent_is_year && number >= 1 && number <= 12) {
+                const auto ym = begin.year() / date::month(static_cast<unsigned>(number));
+                return time_span{sys_days{ym / 1}, sys_days{(ym + months{1}) / 1}};
+            }
+            if (parent_is_month && number >= 1) {
+                const auto d = begin.year() / begin.month() / date::day(static_cast<unsigned>(number));
+                if (d.ok())
+                    return time_span{sys_days{d}, sys_days{d} + days{1}};
+            }
+        }
+        return parent;
+    }
+
+    /** Delivery time encoded in the name of a Maildir file, e.g. "1568202242.M1P1.host:2,S".
+     *
+     * @param name Name of a file in a "cur/" or "new/" folder.
+     * @return Point in time or an empty optional.
+     */
+    std::optional<date::sys_seconds> time_of_maildir_name(std::string_view name) {
+        const auto dot = name.find('.');
+        if (dot < 9 || dot > 10) // Also excludes npos.
+            return std::nullopt;
+        std::int64_t seconds = 0;
+        for (std::size_t i = 0; i < dot; ++i) {
+            if (name[i] < '0' || name[i] > '9')
+                return std::nullopt;
+            seconds = seconds * 10 + (name[i] - '0');
+        }
+        return date::sys_seconds{std::chrono::seconds{seconds}};
+    }
+
+    /** Compute the time spent at Enklave within a range.
+     *
+     * Timeslots crossing a bound of the range are clipped to it; timeslots outside are ignored.
+     *
+     * @param slots Vector with \ref timeslot
+     * @param range Range to restrict the result to.
+     * @return std::chrono::seconds
+     */
+    template<typename Allocator>
+    std::chrono::seconds compute_duration(const std::vector<timeslot, Allocator> &slots, const TimeRange &range) {
+        std::chrono::seconds result{0};
+        for (const auto &slot: slots) {
+            auto begin = slot.first.when;
+            auto end = slot.second.when;
+            if (range.since)
+                begin = std::max(begin, *range.since);
+            if (range.until)
+                end = std::min(end, *range.until);
+            if (end > begin)
+                result += end - begin;
+        }
+        return result;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_RANGE_HPP
@@ -0,0 +1,291 @@
+#ifndef TIME_AT_ENKLAVE_RULES_HPP
+#define TIME_AT_ENKLAVE_RULES_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "encoded_words.hpp"
+#include "profile.hpp"
+
+namespace enklave {
+    /** Patterns identifying the mails of one site (e.g. a coworking space).
+     *
+     * A mail is from the site if its first header line contains one of the sender patterns. It is a check-in (or
+     * check-out) if a line starting with "Subject" contains one of the check-in (or check-out) patterns. Patterns
+     * are literal and case-sensitive. Subjects are decoded and their whitespace normalized before matching (see
+     * \ref decode_header_text), and so are check-in and check-out patterns when they are parsed.
+     */
+    struct SiteRules {
+        /// Name of the site; letters, digits, "-" and "_".
+        std::string site;
+        std::vector<std::string> senders;
+        std::vector<std::string> check_in;
+        std::vector<std::string> check_out;
+    };
+
+    /// Rules of a compiled profile, e.g. as a starting point for a rules file. Timestamp rules are dropped.
+    template<std::size_t N>
+    SiteRules rules_of(const dsl::Profile<N> &profile) {
+        SiteRules site{std::string{profile.site}, {}, {}, {}};
+        for (const auto &rule: profile.rules) {
+            if (rule.action == dsl::Action::SENDER)
+                site.senders.emplace_back(rule.needle);
+            else if (rule.action == dsl::Action::CHECK_IN)
+                site.check_in.emplace_back(rule.needle);
+            else if (rule.action == dsl::Action::CHECK_OUT)
+                site.check_out.emplace_back(rule.needle);
+        }
+        return site;
+    }
+
+    /// Rules of a list of compiled profiles.
+    template<const auto &... P>
+    std::vector<SiteRules> rules_of(dsl::Profiles<P...>) {
+        return {rules_of(P)...};
+    }
+
+    /// Rules of the \ref builtin_profiles, which are used if no rules file is given.
+    std::vector<SiteRules> default_rules() {
+        return rules_of(builtin_profiles{});
+    }
+
+    /** Parse rules, one section per site:
+     *
+     *     # Comment
+     *     [enklave]
+     *     sender = header.from=enklave.de
+     *     check_in = Check in
+     *     check_out = Check out
+     *
+     * Keys may be repeated to give several patterns; the value is everything after the first "=", without
+     * surrounding blanks. Throws invalid_argument with the line number if the input is malformed or a site lacks a
+     * sender, check-in or check-out pattern.
+     *
+     * @param input Rules text.
+     * @param name Name of the input used in error messages.
+     * @return Rules of all sites, in order of appearance.
+     */
+    std::vector<SiteRules> parse_rules(std::istream &input, const std::string &name) noexcept(false) {
+        std::vector<SiteRules> sites;
+        std::string line;
+        unsigned number = 0;
+        auto fail = [&](const std::string &message) {
+            throw std::invalid_argument{name + ":" + std::to_string(number) + ": " + message};
+        };
+        auto trim = [](std::string_view text) {
+            const auto begin = text.find_first_not_of(" \t\r");
+            if (begin == std::string_view::npos)
+                return std::string_view{};
+            return text.substr(begin, text.find_last_not_of(" \t\r") + 1 - begin);
+        };
+
+        while (getline(input, line)) {
+            ++number;
+            const auto text = trim(line);
+            if (text.empty() || text[0] == '#')
+                continue;
+
+            if (text.front() == '[') {
+                if (text.back() != ']' || text.size() < 3)
+                    fail("Malformed section header: " + line);
+                const auto site = text.substr(1, text.size() - 2);
+                if (site.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_")
+                    != std::string_view::npos)
+                    fail("Site names may only contain letters, digits, '-' and '_': " + std::string{site});
+                sites.push_back(SiteRules{std::string{site}, {}, {}, {}});
+                continue;
+            }
+
+            const auto equals = text.find('=');
+            if (equals == std::string_view::npos)
+                fail("Expected key = value: " + line);
+            if (sites.empty())
+                fail("Rule outside of a [site] section: " + line);
+            const auto key = trim(text.substr(0, equals));
+            const std::string value{trim(text.substr(equals + 1))};
+            if (value.empty())
+                fail("Empty pattern: " + line);
+
+            if (key == "sender")
+                sites.back().senders.push_back(value);
+            else if (key == "check_in")
+                sites.back().check_in.push_back(normalize_header_text(value));
+            else if (key == "check_out")
+                sites.back().check_out.push_back(normalize_header_text(value));
+            else
+                fail("Unknown key: " + std::string{key});
+        }
+
+        for (const auto &site: sites) {
+            if (site.senders.empty() || site.check_in.empty() || site.check_out.empty())
+                throw std::invalid_argument{name + ": site " + site.site + " needs sender, check_in and check_out"};
+        }
+        if (sites.empty())
+            throw std::invalid_argument{name + ": no site defined"};
+        return sites;
+    }
+
+    /// Read rules from a file, see \ref parse_rules. Throws invalid_argument if the file can't be read.
+    std::vector<SiteRules> load_rules(const std::string &f) noexcept(false) {
+        std::ifstream ifs{f};
+        if (!ifs)
+            throw std::invalid_argument{"Could not open rules file: " + f};
+        return parse_rules(ifs, f);
+    }
+
+    /** Aho-Corasick automaton finding all occurrences of many literal patterns in one pass over a text.
+     *
+     * The automaton is compiled into a complete transition table (one row of 256 states per state), so matching
+     * costs one table lookup per byte of text, however many patterns there are.
+     */
+    class AhoCorasick {
+    public:
+        using State = std::uint32_t;
+
+        explicit AhoCorasick(const std::vector<std::string> &patterns) {
+            constexpr State missing = ~State{0};
+            std::vector<std::vector<std::uint32_t>> state_outputs(1);
+            transitions.assign(alphabet, missing);
+
+            // Trie of all patterns.
+            for (std::uint32_t id = 0; id < patterns.size(); ++id) {
+                State state = 0;
+                for (unsigned char c: patterns[id]) {
+                    auto &next = transitions[state * alphabet + c];
+                    if (next == missing) {
+                        next = static_cast<State>(state_outputs.size());
+                        state_outputs.emplace_back();
+                        transitions.resize(transitions.size() + alphabet, missing);
+                    }
+                    state = transitions[state * alphabet + c];
+                }
+                state_outputs[state].push_back(id);
+            }
+
+            // Breadth-first, turn failure links into transitions and inherit the outputs of the failure state.
+            std::vector<State> failure(state_outputs.size(), 0);
+            std::queue<State> pending;
+            for (unsigned c = 0; c < alphabet; ++c) {
+                auto &next = transitions[c];
+                if (next == missing) {
+                    next = 0;
+                } else {
+                    failure[next] = 0;
+                    pending.push(next);
+                }
+            }
+            while (!pending.empty()) {
+                const auto state = pending.front();
+                pending.pop();
+                const auto &inherited = state_outputs[failure[state]];
+                state_outputs[state].insert(state_outputs[state].end(), inherited.begin(), inherited.end());
+                for (unsigned c = 0; c < alphabet; ++c) {
+                    auto &next = transitions[state * alphabet + c];
+                    const auto fallback = transitions[failure[state] * alphabet + c];
+                    if (next == missing) {
+                        next = fallback;
+                    } else {
+                        failure[next] = fallback;
+                        pending.push(next);
+                    }
+                }
+            }
+
+            // Flatten the outputs such that matching touches no nested vectors.
+            output_begin.reserve(state_outputs.size() + 1);
+            for (const auto &ids: state_outputs) {
+                output_begin.push_back(static_cast<std::uint32_t>(outputs.size()));
+                outputs.insert(outputs.end(), ids.begin(), ids.end());
+            }
+            output_begin.push_back(static_cast<std::uint32_t>(outputs.size()));
+        }
+
+        static constexpr State start = 0;
+
+        State next(State state, unsigned char c) const {
+            return transitions[state * alphabet + c];
+        }
+
+        bool has_output(State state) const {
+            return output_begin[state] != output_begin[state + 1];
+        }
+
+        /// Ids (indices into the patterns) of all patterns ending when state is entered.
+        std::pair<const std::uint32_t *, const std::uint32_t *> output(State state) const {
+            return {outputs.data() + output_begin[state], outputs.data() + output_begin[state + 1]};
+        }
+
+    private:
+        static constexpr std::size_t alphabet = 256;
+
+        std::vector<State> transitions;
+        std::vector<std::uint32_t> output_begin;
+        std::vector<std::uint32_t> outputs;
+    };
+
+    /// What a matched pattern says about a mail.
+    enum class RuleKind : std::uint8_t {
+        SENDER,
+        CHECK_IN,
+        CHECK_OUT
+    };
+
+    /** Rules of all sites compiled into one \ref AhoCorasick automaton; shared read-only by all parsing threads.
+     *
+     * See \ref parse_header_lazy for how it is applied to the header of a mail.
+     */
+    class Classifier {
+    public:
+        /// Pattern of the automaton with its meaning.
+        struct Rule {
+            std::uint16_t site;
+            RuleKind kind;
+        };
+
+        explicit Classifier(std::vector<SiteRules> sites) : site_rules{std::move(sites)},
+                                                            automaton{compile(site_rules, rules)} {}
+
+        const std::vector<SiteRules> &sites() const {
+            return site_rules;
+        }
+
+        const AhoCorasick &patterns() const {
+            return automaton;
+        }
+
+        /// Meaning of a pattern id reported by \ref patterns.
+        const Rule &rule(std::uint32_t id) const {
+            return rules[id];
+        }
+
+    private:
+        static AhoCorasick compile(const std::vector<SiteRules> &sites, std::vector<Rule> &rules) {
+            std::vector<std::string> patterns;
+            for (std::size_t site = 0; site < sites.size(); ++site) {
+                auto add = [&](const std::vector<std::string> &list, RuleKind kind) {
+                    for (const auto &pattern: list) {
+                        patterns.push_back(pattern);
+                        rules.push_back(Rule{static_cast<std::uint16_t>(site), kind});
+                    }
+                };
+                add(sites[site].senders, RuleKind::SENDER);
+                add(sites[site].check_in, RuleKind::CHECK_IN);
+                add(sites[site].check_out, RuleKind::CHECK_OUT);
+            }
+            return AhoCorasick{patterns};
+        }
+
+        std::vector<SiteRules> site_rules;
+        std::vector<Rule> rules;
+        AhoCorasick automaton;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_RULES_HPP
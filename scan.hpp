@@ -0,0 +1,821 @@
+#ifndef TIME_AT_ENKLAVE_SCAN_HPP
+#define TIME_AT_ENKLAVE_SCAN_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "compression.hpp"
+#include "config.hpp"
+#include "dedup.hpp"
+#include "dircache.hpp"
+#include "enklave.hpp"
+#include "range.hpp"
+
+namespace enklave {
+    /// How mails are stored below the scanned directory.
+    enum class MailLayout {
+        /// Mails are files with extension ".eml".
+        FLAT,
+        /** Maildir: every file in a "cur/" or "new/" folder is a mail, whatever its name. "tmp/" folders hold
+         * deliveries in progress and are skipped. Files with extension ".eml" are considered everywhere else.
+         * Implies recursive scanning, since Maildirs are nested (e.g. sharded by year).
+         */
+        MAILDIR
+    };
+
+    /// How directories are listed.
+    enum class ScanBackend {
+        /// fs::directory_iterator; builds a full path for every entry. Outside Linux, files and directories are
+        /// judged by fs::last_write_time, see detail::stamp_of.
+        PORTABLE,
+        /** Linux only: raw getdents64 batches filtered on name and d_type without stat calls. Directories and files
+         * are opened relative to the file descriptor of their parent directory, so full paths are only built for
+         * reported files.
+         */
+        GETDENTS
+    };
+
+    /** Stamps of the directories and files a set of events was read from, such that a later run can tell without
+     * listing or reading anything whether the same source would still yield the same events; see
+     * \ref QueryIndex::open_fresh.
+     *
+     * Adding, removing or renaming a mail changes the stamp of its directory (see \ref DirectoryCache for the
+     * assumptions this makes). A scan records every directory it lists or takes from a cache; a directory or mail
+     * that could not be read makes the stamps incomplete, and incomplete stamps never vouch for a source.
+     *
+     * Filled by many threads at once during a run.
+     */
+    class SourceStamps {
+    public:
+        /// @param settings Fingerprint of the source and of the settings that decide which events it yields.
+        explicit SourceStamps(std::uint64_t settings = 0) : source_settings{settings} {}
+
+        /// Record the stamp of a directory or file of the source.
+        void add(const fs::path &p, const FileStamp &stamp) {
+            std::lock_guard<std::mutex> lock{mutex};
+            stamps.emplace_back(p.native(), stamp);
+        }
+
+        /// Something of the source could not be read; the events may be incomplete.
+        void failed() {
+            std::lock_guard<std::mutex> lock{mutex};
+            incomplete = true;
+        }
+
+        std::uint64_t settings() const {
+            return source_settings;
+        }
+
+        bool complete() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            return !incomplete;
+        }
+
+        /// Recorded paths with their stamps; read once the run is done.
+        const std::vector<std::pair<std::string, FileStamp>> &paths() const {
+            return stamps;
+        }
+
+    private:
+        std::uint64_t source_settings;
+        mutable std::mutex mutex;
+        std::vector<std::pair<std::string, FileStamp>> stamps;
+        bool incomplete = false;
+    };
+
+    /** Directories an incremental scan (see ScanConfig::changed_since_ns) lists in full because a file in them could
+     * not be read by the previous run. Such a file may still be written in place, which changes its own status but
+     * not the one of its directory, so it would never be examined again otherwise.
+     *
+     * Filled by many threads at once during a run.
+     */
+    class RetryDirectories {
+    public:
+        /// @param previous Directories with files that could not be read by the previous run.
+        explicit RetryDirectories(const std::vector<std::string> &previous = {})
+                : previous_failures{previous.begin(), previous.end()} {}
+
+        /// Whether the files of a directory are examined regardless of ScanConfig::changed_since_ns.
+        bool retried(const fs::path &directory) const {
+            return previous_failures.count(directory.native()) != 0;
+        }
+
+        /// A file in the directory could not be read; the next run must examine it again.
+        void failed(const fs::path &directory) {
+            std::lock_guard<std::mutex> lock{mutex};
+            failures.insert(directory.native());
+        }
+
+        /// Directories with files that could not be read during this run, sorted; read once the run is done.
+        std::vector<std::string> failed() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            std::vector<std::string> sorted{failures.begin(), failures.end()};
+            std::sort(sorted.begin(), sorted.end());
+            return sorted;
+        }
+
+    private:
+        /// Read-only during a run.
+        std::unordered_set<std::string> previous_failures;
+        mutable std::mutex mutex;
+        std::unordered_set<std::string> failures;
+    };
+
+    /// Which files below a directory are scanned, see \ref scan_worker.
+    struct ScanConfig {
+        /// Descend into subdirectories. Symbolic links to directories are not followed to avoid cycles.
+        bool recursive = false;
+        MailLayout layout = MailLayout::FLAT;
+        /// Threads listing directories in parallel; only useful when scanning recursively.
+        unsigned traversal_threads = config::traversal_threads;
+#ifdef __linux__
+        ScanBackend backend = ScanBackend::GETDENTS;
+#else
+        ScanBackend backend = ScanBackend::PORTABLE;
+#endif
+        /// Optional; directories that did not change since they were cached are not listed again.
+        DirectoryCache *cache = nullptr;
+        /** Only files that may hold events within this range (widened by config::range_slack) are reported.
+         *
+         * Mails are written after the event they announce, so a file or directory last modified before the range
+         * can't hold events within it. Folders named by date (see \ref span_of_folder) outside the range are not
+         * listed at all, and Maildir files are judged by the delivery time in their name.
+         */
+        TimeRange range;
+        /** Only files whose status changed at or after this time (nanoseconds since the epoch, see st_ctim) are
+         * reported; 0 reports all files. Set from the checkpoint of an \ref EventJournal.
+         *
+         * Adding a file changes the status of its directory, so the files of older directories are not examined.
+         */
+        std::int64_t changed_since_ns = 0;
+        /** Optional; the files of the directories it retries are examined regardless of changed_since_ns, and it
+         * receives every directory with a file that could not be read.
+         */
+        RetryDirectories *retry = nullptr;
+        /** Optional; receives the stamp of every directory of the scan. Directories or files left out by range make
+         * the stamps incomplete, so scans that record them should leave the range unbounded.
+         */
+        SourceStamps *stamps = nullptr;
+    };
+
+    /// Directory found by a scan; kept open while files found in it wait to be read.
+    class DirectoryHandle {
+    public:
+        /// @param fd Open file descriptor of the directory, owned by the handle; -1 if only the path is known.
+        DirectoryHandle(fs::path path, int fd) : directory_path{std::move(path)}, directory_fd{fd} {}
+
+        DirectoryHandle(const DirectoryHandle &) = delete;
+
+        DirectoryHandle &operator=(const DirectoryHandle &) = delete;
+
+        ~DirectoryHandle() {
+#ifdef __linux__
+            if (directory_fd >= 0)
+                ::close(directory_fd);
+#endif
+        }
+
+        const fs::path &path() const {
+            return directory_path;
+        }
+
+        int fd() const {
+            return directory_fd;
+        }
+
+    private:
+        fs::path directory_path;
+        int directory_fd;
+    };
+
+    /** Identity of a physical file, shared by all hard links to it.
+     *
+     * @param device Device holding the file, st_dev.
+     * @param inode Inode of the file, st_ino or d_ino.
+     * @return Non-zero hash.
+     */
+    std::uint64_t file_id_of(std::uint64_t device, std::uint64_t inode) {
+        const auto id = mix_hash((device * 0x9e3779b97f4a7c15ull) ^ inode);
+        return id != 0 ? id : 1;
+    }
+
+    /// Mail file found by a scan, known by its directory and name. The full path is only built on request.
+    struct MailEntry {
+        std::shared_ptr<const DirectoryHandle> directory;
+        std::string name;
+        /// See \ref file_id_of; for symbolic links the identity of their target. 0 if unknown.
+        std::uint64_t file_id = 0;
+
+        fs::path path() const {
+            return directory->path() / name;
+        }
+    };
+
+    /** Directories waiting to be listed, shared by all threads of one scan.
+     *
+     * Threads take a directory, list it and add its subdirectories; the scan is finished once no directory is waiting
+     * and no thread is listing one.
+     */
+    class DirectoryWorkList {
+    public:
+        struct Item {
+            fs::path directory;
+            /// Open parent directory; the getdents backend opens directory relative to it. Empty for the root.
+            std::shared_ptr<const DirectoryHandle> parent;
+            unsigned depth = 0;
+            /// Directory is a "cur/" or "new/" folder of a Maildir.
+            bool maildir_leaf = false;
+            /// Points in time the directory holds mails of, if known from its name or the names of its parents.
+            std::optional<time_span> span;
+        };
+
+        explicit DirectoryWorkList(const fs::path &root) {
+            Item item;
+            item.directory = root;
+            // Without trailing separators, the parent path of every file found is the path of its directory.
+            while (!item.directory.has_filename() && item.directory.has_relative_path())
+                item.directory = item.directory.parent_path();
+            items.push_back(std::move(item));
+        }
+
+        /** Wait for a directory to list. Returns false if the scan is finished or aborted.
+         *
+         * @param item Receives the directory.
+         * @param waited Time spent waiting for other threads to find a directory is added to this.
+         */
+        bool pop(Item &item, std::chrono::nanoseconds &waited) {
+            std::unique_lock<std::mutex> lock{mutex};
+            if (!aborted && items.empty() && active != 0) {
+                const auto start = std::chrono::steady_clock::now();
+                changed.wait(lock, [this]() { return aborted || !items.empty() || active == 0; });
+                waited += std::chrono::steady_clock::now() - start;
+            }
+            if (aborted || items.empty())
+                return false;
+            item = std::move(items.back()); // Depth-first keeps the list short.
+            items.pop_back();
+            ++active;
+            return true;
+        }
+
+        void push(Item item) {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                items.push_back(std::move(item));
+            }
+            changed.notify_one();
+        }
+
+        /// Must be called after each successful \ref pop once the directory is listed.
+        void done() {
+            bool finished;
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                --active;
+                finished = active == 0 && items.empty();
+            }
+            if (finished)
+                changed.notify_all();
+        }
+
+        void abort() {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                aborted = true;
+            }
+            changed.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<Item> items;
+        unsigned active = 0;
+        bool aborted = false;
+    };
+
+    /** Decide whether a file found while scanning is a mail.
+     *
+     * Outside of Maildir folders, mails have the extension ".eml", optionally followed by a compression extension
+     * (".eml.gz", ".eml.zst"), see \ref compression_of.
+     *
+     * @param name File name without directory.
+     * @param maildir_leaf File is located in a "cur/" or "new/" folder of a Maildir.
+     * @return bool.
+     */
+    bool is_mail_name(std::string_view name, bool maildir_leaf) {
+        if (maildir_leaf)
+            return !name.empty() && name[0] != '.';
+
+        switch (compression_of(name)) {
+            case Compression::GZIP:
+                name.remove_suffix(3);
+                break;
+            case Compression::ZSTD:
+                name.remove_suffix(4);
+                break;
+            case Compression::NONE:
+                break;
+        }
+        constexpr std::string_view extension{".eml"};
+        return name.size() > extension.size() && name.substr(name.size() - extension.size()) == extension;
+    }
+
+    namespace detail {
+        /** Open a mail found by a scan and call fill with a read_input reading it, see \ref read_header_into.
+         *
+         * If the directory is open, the file is opened relative to it and no path is built; a file that can't be
+         * opened or read then throws a runtime_error, such that the caller can retry it later. Otherwise, the file is
+         * opened by its path, and a file that can't be opened reads as empty like in \ref read_header.
+         */
+        template<typename Fill>
+        void read_entry(const MailEntry &entry, Fill &&fill) noexcept(false) {
+            auto in_directory = [&entry](const std::string &what) {
+                return std::runtime_error{what + " in " + entry.directory->path().string()};
+            };
+#ifdef __linux__
+            if (entry.directory->fd() >= 0) {
+                auto fail = [&](const char *what, int error) {
+                    return in_directory(what + entry.name + ": " + std::strerror(error));
+                };
+                const int fd = ::openat(entry.directory->fd(), entry.name.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    throw fail("Could not open ", errno);
+                // Errors end the input like the end of the file; they are only reported once the decompressor is done.
+                int read_error = 0;
+                try {
+                    fill([fd, &read_error](char *buffer, std::size_t size) -> std::size_t {
+                        for (;;) {
+                            const auto read = ::read(fd, buffer, size);
+                            if (read >= 0)
+                                return static_cast<std::size_t>(read);
+                            if (errno != EINTR) {
+                                read_error = errno;
+                                return 0;
+                            }
+                        }
+                    });
+                } catch (std::runtime_error &e) {
+                    ::close(fd);
+                    throw in_directory(e.what());
+                } catch (...) {
+                    ::close(fd);
+                    throw;
+                }
+                ::close(fd);
+                if (read_error != 0)
+                    throw fail("Could not read ", read_error);
+                return;
+            }
+#endif
+            std::ifstream ifs{entry.path(), std::ios::binary};
+            try {
+                fill([&ifs](char *buffer, std::size_t size) {
+                    ifs.read(buffer, static_cast<std::streamsize>(size));
+                    return static_cast<std::size_t>(ifs.gcount());
+                });
+            } catch (std::runtime_error &e) {
+                throw in_directory(e.what());
+            }
+        }
+    }
+
+    /** Read the header block of a mail found by a scan, see \ref read_header_into; the file is opened as described
+     * for detail::read_entry.
+     *
+     * @param entry Mail file.
+     * @param allocator Allocates the returned string.
+     * @return String with the raw bytes of the header block, line endings included.
+     */
+    template<typename String = std::string>
+    String read_header(const MailEntry &entry, const typename String::allocator_type &allocator = {}) noexcept(false) {
+        String header{allocator};
+        detail::read_entry(entry, [&](auto &&read_input) {
+            read_header_into(header, read_input, compression_of(std::string_view{entry.name}), entry.name);
+        });
+        return header;
+    }
+
+    /** Read the first bytes of a mail found by a scan, see \ref read_prefix_into; the file is opened like by
+     * \ref read_header.
+     *
+     * @param entry Mail file.
+     * @param limit Maximum number of bytes.
+     * @param prefix Receives the bytes; its capacity is reused.
+     */
+    void read_prefix(const MailEntry &entry, std::size_t limit, std::string &prefix) noexcept(false) {
+        detail::read_entry(entry, [&](auto &&read_input) {
+            read_prefix_into(prefix, read_input, compression_of(std::string_view{entry.name}), entry.name, limit);
+        });
+    }
+
+    namespace detail {
+        /// Report an error listing a directory; errors on the root directory abort the scan.
+        void directory_failed(DirectoryWorkList &work_list, const DirectoryWorkList::Item &item, std::error_code ec) {
+            if (item.depth == 0) {
+                work_list.done();
+                work_list.abort();
+                throw fs::filesystem_error{"Could not scan directory", item.directory, ec};
+            }
+            std::cerr << "Skipped directory " << item.directory << ": " << ec.message() << std::endl;
+        }
+
+        /// Subdirectory found while listing item; returns false if it must not be scanned.
+        bool subdirectory_item(const DirectoryWorkList::Item &item, std::string_view name, bool maildir,
+                               DirectoryWorkList::Item &subdirectory) {
+            if (name == "." || name == "..")
+                return false;
+            if (maildir && name == "tmp")
+                return false; // Deliveries in progress.
+            subdirectory.directory = item.directory / name;
+            subdirectory.depth = item.depth + 1;
+            subdirectory.maildir_leaf = maildir && (name == "cur" || name == "new");
+            subdirectory.span = span_of_folder(name, item.span);
+            return true;
+        }
+
+        /// Whether a directory must be listed at all; false if its name puts it outside of range.
+        bool directory_in_range(const TimeRange &range, const DirectoryWorkList::Item &item) {
+            return !item.span || range.overlaps(*item.span);
+        }
+
+#ifdef __linux__
+        /// Stamp of a file or directory from the result of stat.
+        FileStamp stamp_of(const struct stat &st) {
+            return {static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+                    static_cast<std::int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec};
+        }
+#endif
+
+        /** Stamp of a file or directory by its path, as taken by the portable backend.
+         *
+         * Only Linux builds call stat; elsewhere the stamp is built from fs::last_write_time, and the modification
+         * time stands in for the status change time.
+         *
+         * @return False if the file can't be examined.
+         */
+        bool stamp_of(const fs::path &p, FileStamp &stamp) {
+#ifdef __linux__
+            struct stat st{};
+            if (::stat(p.c_str(), &st) != 0)
+                return false;
+            stamp = stamp_of(st);
+#else
+            std::error_code ec;
+            const auto written = fs::last_write_time(p, ec);
+            if (ec)
+                return false;
+            // C++17 has no conversion between the clock of the filesystem and system_clock; both advance alike.
+            const auto since_epoch = written - fs::file_time_type::clock::now() +
+                                     std::chrono::system_clock::now().time_since_epoch();
+            stamp.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch).count();
+            stamp.ctime_ns = stamp.mtime_ns;
+#endif
+            return true;
+        }
+
+        /// Whether the files directly in a directory may hold events within range, judged by its modification time.
+        bool files_in_range(const TimeRange &range, const FileStamp &stamp) {
+            return !range.since ||
+                   date::floor<std::chrono::seconds>(date::sys_time<std::chrono::nanoseconds>{
+                           std::chrono::nanoseconds{stamp.mtime_ns}}) >= *range.since;
+        }
+
+        /// Whether the status of a file or directory changed at or after changed_since_ns, see ScanConfig.
+        bool changed_since(std::int64_t changed_since_ns, const FileStamp &stamp) {
+            return changed_since_ns == 0 || stamp.ctime_ns >= changed_since_ns;
+        }
+
+        /// ScanConfig::changed_since_ns for the files directly in a directory; 0 if ScanConfig::retry retries it.
+        std::int64_t changed_since_of(const ScanConfig &scan_config, const fs::path &directory) {
+            return scan_config.retry && scan_config.retry->retried(directory) ? 0 : scan_config.changed_since_ns;
+        }
+
+        /// Whether a mail file is new to an \ref EventJournal, see ScanConfig::changed_since_ns.
+        template<typename StampFile>
+        bool file_changed_since(std::int64_t changed_since_ns, StampFile &&stamp_file) {
+            if (changed_since_ns == 0)
+                return true;
+            FileStamp stamp;
+            return !stamp_file(stamp) || changed_since(changed_since_ns, stamp);
+        }
+
+        /** Whether a mail file may hold an event within range.
+         *
+         * Maildir files are judged by the delivery time in their name, all others by their modification time.
+         *
+         * @param stamp_file Called as stamp_file(stamp) to fill a FileStamp; returns false if the file can't be
+         * examined.
+         */
+        template<typename StampFile>
+        bool file_in_range(const TimeRange &range, std::string_view name, bool maildir_leaf, StampFile &&stamp_file) {
+            if (!range.bounded())
+                return true;
+            if (maildir_leaf) {
+                if (const auto delivered = time_of_maildir_name(name))
+                    return range.contains(*delivered);
+            }
+            if (!range.since)
+                return true;
+            FileStamp stamp;
+            return !stamp_file(stamp) || files_in_range(range, stamp);
+        }
+
+        /** Record a directory in ScanConfig::stamps, if any.
+         *
+         * @param listed Whether the directory was listed completely or taken from the cache.
+         */
+        void stamp_directory(const ScanConfig &scan_config, const fs::path &directory, bool listed,
+                             const FileStamp &stamp) {
+            if (!scan_config.stamps)
+                return;
+            if (listed && !scan_config.range.bounded())
+                scan_config.stamps->add(directory, stamp);
+            else
+                scan_config.stamps->failed();
+        }
+
+        /** Skip listing a directory if the cache has an unchanged record of it; its stored subdirectories are still
+         * scanned.
+         *
+         * @return true if the directory was taken from the cache.
+         */
+        bool reuse_cached(DirectoryWorkList &work_list, const ScanConfig &scan_config,
+                          const DirectoryWorkList::Item &item, const FileStamp &stamp,
+                          const std::shared_ptr<const DirectoryHandle> &handle) {
+            if (!scan_config.cache)
+                return false;
+            const auto *record = scan_config.cache->reuse(item.directory, stamp);
+            if (!record)
+                return false;
+
+            const bool maildir = scan_config.layout == MailLayout::MAILDIR;
+            if (scan_config.recursive || maildir) {
+                for (const auto &name: record->subdirectories) {
+                    DirectoryWorkList::Item subdirectory;
+                    if (subdirectory_item(item, name, maildir, subdirectory)) {
+                        subdirectory.parent = handle;
+                        work_list.push(std::move(subdirectory));
+                    }
+                }
+            }
+            return true;
+        }
+
+        template<typename OnFile>
+        void scan_portable(DirectoryWorkList &work_list, const ScanConfig &scan_config, OnFile &&on_file,
+                           std::chrono::nanoseconds &waited) {
+            const bool maildir = scan_config.layout == MailLayout::MAILDIR;
+            const bool recursive = scan_config.recursive || maildir;
+            const auto range = scan_config.range.padded(config::range_slack);
+
+            DirectoryWorkList::Item item;
+            while (work_list.pop(item, waited)) {
+                if (!directory_in_range(range, item)) {
+                    work_list.done();
+                    continue;
+                }
+                const auto handle = std::make_shared<const DirectoryHandle>(item.directory, -1);
+                FileStamp stamp;
+                const bool has_stamp = stamp_of(item.directory, stamp);
+                if (has_stamp && reuse_cached(work_list, scan_config, item, stamp, handle)) {
+                    stamp_directory(scan_config, item.directory, true, stamp);
+                    work_list.done();
+                    continue;
+                }
+                const auto changed_since_ns = changed_since_of(scan_config, item.directory);
+                const bool list_files = !has_stamp || (files_in_range(range, stamp) &&
+                                                       changed_since(changed_since_ns, stamp));
+                // A directory with files left out must not be cached; a later run with another range needs them.
+                bool pruned = !list_files;
+
+                std::error_code ec;
+                fs::directory_iterator it{item.directory, ec};
+                if (ec)
+                    directory_failed(work_list, item, ec);
+
+                std::vector<std::string> subdirectories;
+                const bool opened = !ec;
+                for (; !ec && it != fs::directory_iterator{}; it.increment(ec)) {
+                    const fs::directory_entry &entry = *it;
+                    const auto name = entry.path().filename().native();
+                    std::error_code type_ec;
+                    if (!entry.is_symlink(type_ec) && entry.is_directory(type_ec)) {
+                        if (scan_config.cache)
+                            subdirectories.push_back(name);
+                        DirectoryWorkList::Item subdirectory;
+                        if (recursive && subdirectory_item(item, name, maildir, subdirectory))
+                            work_list.push(std::move(subdirectory));
+                    } else if (!list_files) {
+                        continue;
+                    } else if (is_mail_name(name, item.maildir_leaf)) {
+                        auto stamp_file = [&entry](FileStamp &file_stamp) {
+                            return stamp_of(entry.path(), file_stamp);
+                        };
+                        if (!file_in_range(range, name, item.maildir_leaf, stamp_file) ||
+                            !file_changed_since(changed_since_ns, stamp_file)) {
+                            pruned = true;
+                            continue;
+                        }
+                        MailEntry mail{handle, name, 0};
+#ifdef __linux__
+                        struct stat file_st{};
+                        if (::stat(entry.path().c_str(), &file_st) == 0)
+                            mail.file_id = file_id_of(file_st.st_dev, file_st.st_ino);
+#endif
+                        if (!on_file(std::move(mail))) {
+                            work_list.done();
+                            work_list.abort();
+                            return;
+                        }
+                    }
+                }
+                stamp_directory(scan_config, item.directory, opened && !ec && has_stamp, stamp);
+                if (opened && ec)
+                    std::cerr << "Stopped scanning directory " << item.directory << ": " << ec.message() << std::endl;
+                else if (opened && has_stamp && !pruned && scan_config.cache)
+                    scan_config.cache->listed(item.directory, stamp, std::move(subdirectories));
+                work_list.done();
+            }
+        }
+
+#ifdef __linux__
+        /// Size of the buffer filled by one getdents64 call; large batches mean few system calls on huge directories.
+        constexpr std::size_t getdents_buffer_size = 1 << 20;
+
+        template<typename OnFile>
+        void scan_getdents(DirectoryWorkList &work_list, const ScanConfig &scan_config, OnFile &&on_file,
+                           std::chrono::nanoseconds &waited) {
+            const bool maildir = scan_config.layout == MailLayout::MAILDIR;
+            const bool recursive = scan_config.recursive || maildir;
+            const auto range = scan_config.range.padded(config::range_slack);
+            std::unique_ptr<char[]> buffer{new char[getdents_buffer_size]};
+
+            // Layout of struct linux_dirent64 as returned by the kernel.
+            constexpr std::size_t inode_offset = 0;
+            constexpr std::size_t reclen_offset = 16;
+            constexpr std::size_t type_offset = 18;
+            constexpr std::size_t name_offset = 19;
+
+            DirectoryWorkList::Item item;
+            while (work_list.pop(item, waited)) {
+                if (!directory_in_range(range, item)) {
+                    work_list.done();
+                    continue;
+                }
+                const int fd = item.parent
+                               ? ::openat(item.parent->fd(), item.directory.filename().c_str(),
+                                          O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                               : ::open(item.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0) {
+                    directory_failed(work_list, item, std::error_code{errno, std::generic_category()});
+                    stamp_directory(scan_config, item.directory, false, {});
+                    work_list.done();
+                    continue;
+                }
+                const auto handle = std::make_shared<const DirectoryHandle>(item.directory, fd);
+                struct stat st{};
+                const bool has_stat = ::fstat(fd, &st) == 0;
+                const auto stamp = stamp_of(st);
+                if (has_stat && reuse_cached(work_list, scan_config, item, stamp, handle)) {
+                    stamp_directory(scan_config, item.directory, true, stamp);
+                    work_list.done();
+                    continue;
+                }
+                const auto changed_since_ns = changed_since_of(scan_config, item.directory);
+                const bool list_files = !has_stat || (files_in_range(range, stamp) &&
+                                                      changed_since(changed_since_ns, stamp));
+                bool pruned = !list_files;
+
+                std::vector<std::string> subdirectories;
+                bool complete = true;
+                for (;;) {
+                    const auto read = ::syscall(SYS_getdents64, fd, buffer.get(), getdents_buffer_size);
+                    if (read < 0) {
+                        std::cerr << "Stopped scanning directory " << item.directory << ": "
+                                  << std::strerror(errno) << std::endl;
+                        complete = false;
+                        break;
+                    }
+                    if (read == 0)
+                        break;
+
+                    for (long pos = 0; pos < read;) {
+                        const char *record = buffer.get() + pos;
+                        unsigned short record_length;
+                        std::memcpy(&record_length, record + reclen_offset, sizeof(record_length));
+                        pos += record_length;
+
+                        const std::string_view name{record + name_offset};
+                        auto type = static_cast<unsigned char>(record[type_offset]);
+                        if (type == DT_UNKNOWN) { // Not every filesystem fills in d_type.
+                            struct stat entry_st{};
+                            if (::fstatat(fd, record + name_offset, &entry_st, AT_SYMLINK_NOFOLLOW) != 0)
+                                continue;
+                            type = S_ISDIR(entry_st.st_mode) ? DT_DIR : S_ISLNK(entry_st.st_mode) ? DT_LNK : DT_REG;
+                        }
+
+                        if (name == "." || name == "..")
+                            continue;
+                        if (type == DT_DIR) {
+                            if (scan_config.cache)
+                                subdirectories.emplace_back(name);
+                            DirectoryWorkList::Item subdirectory;
+                            if (recursive && subdirectory_item(item, name, maildir, subdirectory)) {
+                                subdirectory.parent = handle;
+                                work_list.push(std::move(subdirectory));
+                            }
+                        } else if (!list_files) {
+                            continue;
+                        } else if (is_mail_name(name, item.maildir_leaf)) {
+                            auto stamp_file = [fd, record](FileStamp &file_stamp) {
+                                struct stat file_st{};
+                                if (::fstatat(fd, record + name_offset, &file_st, 0) != 0)
+                                    return false;
+                                file_stamp = stamp_of(file_st);
+                                return true;
+                            };
+                            if (!file_in_range(range, name, item.maildir_leaf, stamp_file) ||
+                                !file_changed_since(changed_since_ns, stamp_file)) {
+                                pruned = true;
+                                continue;
+                            }
+                            MailEntry mail{handle, std::string{name}, 0};
+                            if (type == DT_LNK) { // Links to the same file share the identity of their target.
+                                struct stat target{};
+                                if (::fstatat(fd, record + name_offset, &target, 0) == 0)
+                                    mail.file_id = file_id_of(target.st_dev, target.st_ino);
+                            } else if (has_stat) {
+                                std::uint64_t inode;
+                                std::memcpy(&inode, record + inode_offset, sizeof(inode));
+                                mail.file_id = file_id_of(st.st_dev, inode);
+                            }
+                            if (!on_file(std::move(mail))) {
+                                work_list.done();
+                                work_list.abort();
+                                return;
+                            }
+                        }
+                    }
+                }
+                stamp_directory(scan_config, item.directory, complete && has_stat, stamp);
+                if (complete && has_stat && !pruned && scan_config.cache)
+                    scan_config.cache->listed(item.directory, stamp, std::move(subdirectories));
+                work_list.done();
+            }
+        }
+#endif
+    }
+
+    /** List directories taken from work_list and report every mail file to on_file.
+     *
+     * Run this function on several threads sharing one work_list to traverse subdirectories in parallel. Entries are
+     * classified by the file type cached while listing the directory, so no additional stat call is needed per entry.
+     * See \ref ScanBackend for how directories are listed. Reported files carry their MailEntry::file_id, taken from
+     * the inode numbers returned with the listing (symbolic links need a stat call). The portable backend needs a stat
+     * call per file and only knows the identity of files on Linux.
+     *
+     * Errors listing the root directory are thrown (the scan is aborted); errors listing a subdirectory are reported
+     * and the subdirectory is skipped.
+     *
+     * @param work_list Shared directories waiting to be listed.
+     * @param scan_config Which files and subdirectories are considered.
+     * @param on_file Called with the \ref MailEntry of every mail file; returns false to stop the scan.
+     * @param waited Time spent waiting for other threads to find a directory is added to this.
+     */
+    template<typename OnFile>
+    void scan_worker(DirectoryWorkList &work_list, const ScanConfig &scan_config, OnFile &&on_file,
+                     std::chrono::nanoseconds &waited) {
+#ifdef __linux__
+        if (scan_config.backend == ScanBackend::GETDENTS) {
+            detail::scan_getdents(work_list, scan_config, on_file, waited);
+            return;
+        }
+#endif
+        detail::scan_portable(work_list, scan_config, on_file, waited);
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_SCAN_HPP
@@ -0,0 +1,276 @@
+#ifndef TIME_AT_ENKLAVE_SHARED_RESULTS_HPP
+#define TIME_AT_ENKLAVE_SHARED_RESULTS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Only depends on the standard library and POSIX, such that other tools can include this file to read the results
+ * exported by time_at_enklave (see SharedResultsReader). */
+namespace enklave {
+    /// Total of one site as exported to shared memory.
+    struct SharedSite {
+        std::string name;
+        std::int64_t total_seconds = 0;
+        std::uint64_t slot_count = 0;
+    };
+
+    /// Timeslot as exported to shared memory; seconds since the epoch, UTC.
+    struct SharedSlot {
+        std::uint64_t site = 0;
+        std::int64_t begin = 0;
+        std::int64_t end = 0;
+    };
+
+    /// Results exported to shared memory, see \ref SharedResultsWriter.
+    struct SharedResults {
+        /// Number of the publish that wrote the results; counts up from 1.
+        std::uint64_t generation = 0;
+        /// Seconds since the epoch when the results were published.
+        std::int64_t published_at = 0;
+        std::vector<SharedSite> sites;
+        /// The latest timeslots of all sites, ordered by their begin; SharedSlot::site indexes sites.
+        std::vector<SharedSlot> recent;
+    };
+
+    namespace detail {
+        /** Layout of the shared memory segment; identical in writer and readers.
+         *
+         * Every field is a lock-free atomic, which is address-free and therefore works across processes. The fields
+         * after sequence are guarded by it as a seqlock: it is odd while the writer changes them.
+         */
+        struct SharedSegment {
+            static constexpr std::uint64_t magic_value = 0x31534552'4b4e45ull; // "ENKRES1" in little endian.
+            static constexpr std::size_t max_sites = 16;
+            static constexpr std::size_t name_words = 4;
+            static constexpr std::size_t max_recent = 64;
+
+            std::atomic<std::uint64_t> magic;
+            std::atomic<std::uint64_t> sequence;
+            std::atomic<std::int64_t> published_at;
+            std::atomic<std::uint64_t> site_count;
+            std::atomic<std::uint64_t> recent_count;
+
+            struct Site {
+                /// Up to 31 bytes of the name, padded with NUL.
+                std::atomic<std::uint64_t> name[name_words];
+                std::atomic<std::int64_t> total_seconds;
+                std::atomic<std::uint64_t> slot_count;
+            } sites[max_sites];
+
+            struct Slot {
+                std::atomic<std::uint64_t> site;
+                std::atomic<std::int64_t> begin;
+                std::atomic<std::int64_t> end;
+            } recent[max_recent];
+        };
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free && std::atomic<std::int64_t>::is_always_lock_free,
+                      "Shared memory needs lock-free 64-bit atomics");
+
+        /// Open and map a POSIX shared memory object holding a SharedSegment; throws filesystem_error.
+        void *map_shared_segment(const std::string &name, bool writable) {
+            const int fd = writable ? ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)
+                                    : ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            auto fail = [&name](const char *what, int error) {
+                return std::filesystem::filesystem_error{what, name, std::error_code{error, std::generic_category()}};
+            };
+            if (fd < 0)
+                throw fail("Could not open shared memory", errno);
+
+            struct stat st{};
+            if (::fstat(fd, &st) != 0 ||
+                (writable && static_cast<std::size_t>(st.st_size) < sizeof(SharedSegment) &&
+                 ::ftruncate(fd, sizeof(SharedSegment)) != 0)) {
+                const int error = errno;
+                ::close(fd);
+                throw fail("Could not size shared memory", error);
+            }
+            if (!writable && static_cast<std::size_t>(st.st_size) < sizeof(SharedSegment)) {
+                ::close(fd);
+                throw fail("Shared memory is too small", EINVAL);
+            }
+            void *mapped = ::mmap(nullptr, sizeof(SharedSegment), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                  MAP_SHARED, fd, 0);
+            const int error = errno;
+            ::close(fd); // The mapping keeps the object alive.
+            if (mapped == MAP_FAILED)
+                throw fail("Could not map shared memory", error);
+            return mapped;
+        }
+    }
+
+    /** Publishes results into a POSIX shared memory object (see shm_open) for co-located readers.
+     *
+     * There must be only one writer per object at a time. The object outlives the writer, such that readers still
+     * find the last results after time_at_enklave exits; \ref remove deletes it. Sites beyond the first 16 and names
+     * beyond 31 bytes are cut off.
+     */
+    class SharedResultsWriter {
+    public:
+        /** Create or open the object; name is as for shm_open, e.g. "/enklave". Throws filesystem_error.
+         *
+         * A new object is zero-filled, i.e. unpublished; an existing one keeps counting its generations. If a writer
+         * died while publishing, the sequence is left odd and the results torn: they are emptied and the sequence is
+         * rounded up to even, such that readers see no sites until the next publish instead of waiting for it.
+         */
+        explicit SharedResultsWriter(const std::string &name)
+                : segment{static_cast<detail::SharedSegment *>(detail::map_shared_segment(name, true))} {
+            constexpr auto relaxed = std::memory_order_relaxed;
+            const auto sequence = segment->sequence.load(relaxed);
+            if (sequence % 2 != 0) {
+                segment->published_at.store(0, relaxed);
+                segment->site_count.store(0, relaxed);
+                segment->recent_count.store(0, relaxed);
+                segment->sequence.store(sequence + 1, std::memory_order_release);
+            }
+            segment->magic.store(detail::SharedSegment::magic_value, std::memory_order_release);
+        }
+
+        SharedResultsWriter(const SharedResultsWriter &) = delete;
+
+        SharedResultsWriter &operator=(const SharedResultsWriter &) = delete;
+
+        ~SharedResultsWriter() {
+            ::munmap(segment, sizeof(detail::SharedSegment));
+        }
+
+        /// Replace the published results; readers see either the previous or these results, never a mix.
+        void publish(const SharedResults &results) {
+            using detail::SharedSegment;
+            constexpr auto relaxed = std::memory_order_relaxed;
+            const auto sequence = segment->sequence.load(relaxed);
+            segment->sequence.store(sequence + 1, relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            segment->published_at.store(results.published_at, relaxed);
+            const auto sites = std::min(results.sites.size(), SharedSegment::max_sites);
+            segment->site_count.store(sites, relaxed);
+            for (std::size_t i = 0; i < sites; ++i) {
+                auto &site = segment->sites[i];
+                char name[sizeof(site.name)] = {};
+                const auto &site_name = results.sites[i].name;
+                std::memcpy(name, site_name.data(), std::min(site_name.size(), sizeof(name) - 1));
+                for (std::size_t w = 0; w < SharedSegment::name_words; ++w) {
+                    std::uint64_t word = 0;
+                    std::memcpy(&word, name + w * sizeof(word), sizeof(word));
+                    site.name[w].store(word, relaxed);
+                }
+                site.total_seconds.store(results.sites[i].total_seconds, relaxed);
+                site.slot_count.store(results.sites[i].slot_count, relaxed);
+            }
+            // The latest slots are kept if there are more than fit.
+            const auto recent = std::min(results.recent.size(), SharedSegment::max_recent);
+            const auto first = results.recent.size() - recent;
+            segment->recent_count.store(recent, relaxed);
+            for (std::size_t i = 0; i < recent; ++i) {
+                segment->recent[i].site.store(results.recent[first + i].site, relaxed);
+                segment->recent[i].begin.store(results.recent[first + i].begin, relaxed);
+                segment->recent[i].end.store(results.recent[first + i].end, relaxed);
+            }
+
+            segment->sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        /// Delete a shared memory object; readers that mapped it keep their mapping.
+        static void remove(const std::string &name) {
+            ::shm_unlink(name.c_str());
+        }
+
+    private:
+        detail::SharedSegment *segment;
+    };
+
+    /** Reads the results published by a \ref SharedResultsWriter, possibly in another process.
+     *
+     * A read copies the segment without any system call and without blocking the writer: it retries while the
+     * writer is publishing or if the writer published meanwhile (seqlock). Retries are bounded, such that a writer
+     * that died while publishing can't keep readers spinning.
+     */
+    class SharedResultsReader {
+    public:
+        /// Map the object read-only; throws filesystem_error if it doesn't exist (yet).
+        explicit SharedResultsReader(const std::string &name)
+                : segment{static_cast<const detail::SharedSegment *>(detail::map_shared_segment(name, false))} {}
+
+        SharedResultsReader(const SharedResultsReader &) = delete;
+
+        SharedResultsReader &operator=(const SharedResultsReader &) = delete;
+
+        ~SharedResultsReader() {
+            ::munmap(const_cast<detail::SharedSegment *>(segment), sizeof(detail::SharedSegment));
+        }
+
+        /** Copy the current results.
+         *
+         * @param results Receives the results; the capacity of its vectors is reused.
+         * @return False if nothing was published yet, or no consistent copy was taken within max_attempts tries;
+         * results are unspecified then.
+         */
+        bool read(SharedResults &results) const {
+            using detail::SharedSegment;
+            constexpr auto relaxed = std::memory_order_relaxed;
+            if (segment->magic.load(std::memory_order_acquire) != SharedSegment::magic_value)
+                return false;
+            for (std::size_t attempt = 0; attempt < max_attempts; ++attempt) {
+                const auto sequence = segment->sequence.load(std::memory_order_acquire);
+                if (sequence == 0)
+                    return false;
+                if (sequence % 2 != 0) {
+                    std::this_thread::yield(); // The writer is publishing.
+                    continue;
+                }
+
+                results.generation = sequence / 2;
+                results.published_at = segment->published_at.load(relaxed);
+                // Counts are clamped, as a torn copy is only discarded after the sequence is checked again.
+                const auto sites = std::min<std::uint64_t>(segment->site_count.load(relaxed), SharedSegment::max_sites);
+                results.sites.resize(sites);
+                for (std::size_t i = 0; i < sites; ++i) {
+                    const auto &site = segment->sites[i];
+                    char name[sizeof(site.name)];
+                    for (std::size_t w = 0; w < SharedSegment::name_words; ++w) {
+                        const auto word = site.name[w].load(relaxed);
+                        std::memcpy(name + w * sizeof(word), &word, sizeof(word));
+                    }
+                    results.sites[i].name.assign(name, strnlen(name, sizeof(name)));
+                    results.sites[i].total_seconds = site.total_seconds.load(relaxed);
+                    results.sites[i].slot_count = site.slot_count.load(relaxed);
+                }
+                const auto recent = std::min<std::uint64_t>(segment->recent_count.load(relaxed),
+                                                            SharedSegment::max_recent);
+                results.recent.resize(recent);
+                for (std::size_t i = 0; i < recent; ++i) {
+                    results.recent[i].site = segment->recent[i].site.load(relaxed);
+                    results.recent[i].begin = segment->recent[i].begin.load(relaxed);
+                    results.recent[i].end = segment->recent[i].end.load(relaxed);
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (segment->sequence.load(relaxed) == sequence)
+                    return true;
+            }
+            return false;
+        }
+
+        /// Tries of a read; a publish takes microseconds, so only a writer that stopped midway exhausts them.
+        static constexpr std::size_t max_attempts = 1 << 16;
+
+    private:
+        const detail::SharedSegment *segment;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_SHARED_RESULTS_HPP
@@ -0,0 +1,171 @@
+#ifndef TIME_AT_ENKLAVE_SNAPSHOT_HPP
+#define TIME_AT_ENKLAVE_SNAPSHOT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "config.hpp"
+
+namespace enklave {
+    /** Publishes immutable snapshots of a T to concurrent readers without locking them (epoch-based reclamation).
+     *
+     * A writer replaces the current snapshot with \ref publish; the snapshot it replaces is retired, not deleted.
+     * Every reader thread registers a \ref Reader and pins the current snapshot for the duration of a query. A pin
+     * announces the epoch the reader entered in the reader's own cache line and then loads the current snapshot; it
+     * never waits, and readers never write a shared cache line, so queries scale with the cores. A retired snapshot
+     * is deleted once no reader is pinned in the epoch it was retired in or an earlier one; this is checked on every
+     * publish and by \ref reclaim.
+     *
+     * Writers are serialized by a mutex readers never touch. At most config::snapshot_readers readers may be
+     * registered at once.
+     */
+    template<typename T>
+    class SnapshotPublisher {
+        /// Epoch a reader is pinned in; 0 if it is not pinned. Each slot has a cache line of its own.
+        struct alignas(64) Slot {
+            std::atomic<bool> claimed{false};
+            std::atomic<std::uint64_t> epoch{0};
+        };
+
+    public:
+        /// Snapshot pinned by a \ref Reader; valid until the pin is destroyed. Empty if nothing was published yet.
+        class Pin {
+        public:
+            Pin(const Pin &) = delete;
+
+            Pin &operator=(const Pin &) = delete;
+
+            ~Pin() {
+                slot.epoch.store(0, std::memory_order_release);
+            }
+
+            const T *get() const {
+                return snapshot;
+            }
+
+            const T &operator*() const {
+                return *snapshot;
+            }
+
+            const T *operator->() const {
+                return snapshot;
+            }
+
+            explicit operator bool() const {
+                return snapshot != nullptr;
+            }
+
+        private:
+            friend class SnapshotPublisher;
+
+            Pin(Slot &slot, const T *snapshot) : slot{slot}, snapshot{snapshot} {}
+
+            Slot &slot;
+            const T *snapshot;
+        };
+
+        /// Registration of one reader thread; a reader holds at most one \ref Pin at a time.
+        class Reader {
+        public:
+            /// Throws runtime_error if config::snapshot_readers readers are registered already.
+            explicit Reader(SnapshotPublisher &publisher) : publisher{publisher} {
+                for (auto &candidate: publisher.slots) {
+                    bool expected = false;
+                    if (candidate.claimed.compare_exchange_strong(expected, true)) {
+                        slot = &candidate;
+                        return;
+                    }
+                }
+                throw std::runtime_error{"Too many snapshot readers"};
+            }
+
+            Reader(const Reader &) = delete;
+
+            Reader &operator=(const Reader &) = delete;
+
+            ~Reader() {
+                slot->claimed.store(false, std::memory_order_release);
+            }
+
+            /// Pin the current snapshot; it is not deleted while the pin lives.
+            Pin pin() {
+                // Sequentially consistent, such that a writer that doesn't see this epoch yet has published before
+                // the snapshot is loaded below.
+                slot->epoch.store(publisher.epoch.load());
+                return Pin{*slot, publisher.current.load()};
+            }
+
+        private:
+            SnapshotPublisher &publisher;
+            Slot *slot = nullptr;
+        };
+
+        SnapshotPublisher() = default;
+
+        SnapshotPublisher(const SnapshotPublisher &) = delete;
+
+        SnapshotPublisher &operator=(const SnapshotPublisher &) = delete;
+
+        /// No reader may be registered any more.
+        ~SnapshotPublisher() {
+            delete current.load();
+            for (auto &retired_snapshot: retired)
+                delete retired_snapshot.second;
+        }
+
+        /// Make snapshot the current one and reclaim the retired snapshots no reader can see any more.
+        void publish(std::unique_ptr<const T> snapshot) {
+            std::lock_guard lock{writer};
+            const T *previous = current.exchange(snapshot.release());
+            if (previous)
+                retired.emplace_back(epoch.fetch_add(1), previous);
+            reclaim_retired();
+        }
+
+        /// Delete the retired snapshots no reader can see any more, e.g. after a burst of publishes.
+        void reclaim() {
+            std::lock_guard lock{writer};
+            reclaim_retired();
+        }
+
+        /// Number of snapshots retired but not deleted yet.
+        std::size_t retired_count() const {
+            std::lock_guard lock{writer};
+            return retired.size();
+        }
+
+    private:
+        void reclaim_retired() {
+            // Readers pinned in epoch e may hold every snapshot retired in epoch e or later.
+            auto oldest = epoch.load();
+            for (const auto &slot: slots) {
+                const auto pinned = slot.epoch.load();
+                if (pinned != 0)
+                    oldest = std::min(oldest, pinned);
+            }
+            const auto reclaimable = std::stable_partition(retired.begin(), retired.end(), [oldest](const auto &r) {
+                return r.first >= oldest;
+            });
+            for (auto r = reclaimable; r != retired.end(); ++r)
+                delete r->second;
+            retired.erase(reclaimable, retired.end());
+        }
+
+        std::atomic<const T *> current{nullptr};
+        /// Starts at 1, such that 0 marks an unpinned slot.
+        std::atomic<std::uint64_t> epoch{1};
+        Slot slots[config::snapshot_readers];
+
+        mutable std::mutex writer;
+        /// Snapshots replaced by publish, with the epoch they were retired in.
+        std::vector<std::pair<std::uint64_t, const T *>> retired;
+    };
+}
+
+#endif //TIME_AT_ENKLAVE_SNAPSHOT_HPP
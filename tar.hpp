@@ -0,0 +1,200 @@
+#ifndef TIME_AT_ENKLAVE_TAR_HPP
+#define TIME_AT_ENKLAVE_TAR_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "body.hpp"
+#include "config.hpp"
+#include "dedup.hpp"
+#include "enklave.hpp"
+#include "mapped_file.hpp"
+
+namespace enklave {
+    /// Regular file stored in a tar archive; its content is a view into the mapped archive.
+    struct TarMember {
+        std::string name;
+        std::string_view content;
+    };
+
+    namespace detail {
+        constexpr std::size_t tar_block_size = 512;
+
+        /// Read a numeric header field: octal digits, or base-256 if the first byte has its high bit set (GNU).
+        std::uint64_t tar_number(std::string_view field) {
+            std::uint64_t result = 0;
+            if (!field.empty() && (static_cast<unsigned char>(field[0]) & 0x80u)) {
+                for (std::size_t i = 1; i < field.size(); ++i)
+                    result = (result << 8) | static_cast<unsigned char>(field[i]);
+                return result;
+            }
+            for (char c: field) {
+                if (c >= '0' && c <= '7')
+                    result = (result << 3) | static_cast<unsigned>(c - '0');
+                else if (c != ' ' && c != '\0')
+                    throw std::runtime_error{"Malformed number in tar header"};
+                else if (result != 0)
+                    break; // Terminator after the digits.
+            }
+            return result;
+        }
+
+        /// Null-terminated string of a fixed size header field.
+        std::string_view tar_string(std::string_view field) {
+            return field.substr(0, std::min(field.find('\0'), field.size()));
+        }
+
+        /// Value of the "path" record of a pax extended header, or an empty string.
+        std::string pax_path(std::string_view records) {
+            // Each record is "<length> <key>=<value>\n"; length includes the whole record.
+            while (!records.empty()) {
+                const auto space = records.find(' ');
+                if (space == std::string_view::npos)
+                    break;
+                const std::string length_field{records.substr(0, space)};
+                const auto length = static_cast<std::size_t>(std::strtoull(length_field.c_str(), nullptr, 10));
+                if (length <= space || length > records.size())
+                    break;
+                const auto record = records.substr(space + 1, length - space - 2); // Without trailing "\n".
+                if (record.substr(0, 5) == "path=")
+                    return std::string{record.substr(5)};
+                records.remove_prefix(length);
+            }
+            return {};
+        }
+    }
+
+    /** Walk the headers of a tar archive and list its regular files.
+     *
+     * Only the 512 byte headers are touched; member contents are skipped by their size, so building the index is
+     * cheap even for large archives. ustar, GNU long names and pax path records are supported. Throws runtime_error if
+     * the archive is malformed.
+     *
+     * @param archive Content of a tar archive, e.g. from \ref MappedFile.
+     * @return Index of all regular files with views into archive.
+     */
+    std::vector<TarMember> index_tar(std::string_view archive) noexcept(false) {
+        using detail::tar_block_size;
+        std::vector<TarMember> members;
+        std::string long_name; // From a preceding GNU 'L' or pax 'x' entry.
+
+        std::size_t pos = 0;
+        while (pos + tar_block_size <= archive.size()) {
+            const auto header = archive.substr(pos, tar_block_size);
+            if (header.find_first_not_of('\0') == std::string_view::npos)
+                break; // End of archive.
+
+            const auto size = detail::tar_number(header.substr(124, 12));
+            const char type = header[156];
+            const auto content_begin = pos + tar_block_size;
+            if (size > archive.size() - content_begin)
+                throw std::runtime_error{"Truncated tar archive"};
+            const auto content = archive.substr(content_begin, size);
+
+            if (type == 'L') {
+                long_name = detail::tar_string(content);
+            } else if (type == 'x') {
+                long_name = detail::pax_path(content);
+            } else {
+                if (type == '0' || type == '\0') {
+                    std::string name = std::move(long_name);
+                    if (name.empty()) {
+                        name = detail::tar_string(header.substr(0, 100));
+                        if (header.substr(257, 5) == "ustar") {
+                            const auto prefix = detail::tar_string(header.substr(345, 155));
+                            if (!prefix.empty())
+                                name = std::string{prefix} + "/" + name;
+                        }
+                    }
+                    members.push_back(TarMember{std::move(name), content});
+                }
+                long_name.clear();
+            }
+            pos = content_begin + (size + tar_block_size - 1) / tar_block_size * tar_block_size;
+        }
+        return members;
+    }
+
+    /** Read all mails in a tar archive and return a vector with parsed data.
+     *
+     * The archive is memory-mapped and read front to back; nothing is extracted to disk. After indexing the members
+     * (see \ref index_tar), members with extension ".eml" are split among the threads and the header block of each is
+     * classified by \ref parse_mail directly on the mapped bytes.
+     *
+     * As in \ref parse_directory, runtime_errors from parsing a member are reported and do not stop the program.
+     * Copies of a mail (same Message-Id, see \ref first_copy) are only reported once.
+     * Events refer to their member by the path of the archive followed by ":" and the member name.
+     *
+     * @param f Path to a tar archive.
+     * @tparam Events std::vector of EnklaveEvent with any allocator, e.g. std::pmr::vector.
+     * @param threads Number of threads; 0 means one per hardware thread.
+     * @param classifier Runtime rules classifying mails; nullptr selects the \ref builtin_profiles.
+     * @param body_scan_bytes Bytes of the text/html part scanned if the header of a member is inconclusive, see
+     * \ref parse_mail; 0 disables the fallback.
+     * @param allocator Allocates the returned vector.
+     * @return Vector of EnklaveEvent.
+     */
+    template<typename Events = std::vector<EnklaveEvent>>
+    Events parse_tar(const fs::path &f, unsigned threads = config::parser_threads,
+                     const Classifier *classifier = nullptr, std::size_t body_scan_bytes = 0,
+                     const typename Events::allocator_type &allocator = {}) {
+        std::cout << "Scanning for relevant members in: " << f << ":\n";
+
+        const MappedFile mapped{f};
+        auto members = index_tar(mapped.view());
+        members.erase(std::remove_if(members.begin(), members.end(), [](const TarMember &member) {
+            return fs::path{member.name}.extension() != ".eml";
+        }), members.end());
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(std::min<std::size_t>(threads, members.size() / 64 + 1));
+
+        // Members are assigned round-robin such that all threads move through the archive at the same pace, which
+        // keeps the combined access pattern close to one sequential read.
+        std::vector<std::vector<EnklaveEvent>> partial_results(threads);
+        ConcurrentHashSet seen;
+        auto process = [&](unsigned index) {
+            ParseContext context{classifier};
+            for (std::size_t i = index; i < members.size(); i += threads) {
+                const auto &member = members[i];
+                const auto header_end = find_header_end(member.content);
+                const auto header = member.content.substr(0, header_end);
+                const auto body = member.content.substr(header.size());
+                try {
+                    auto event = parse_mail(context, header, body, body_scan_bytes, [&]() {
+                        return f.string() + ":" + member.name;
+                    });
+                    if (first_copy(seen, event))
+                        partial_results[index].push_back(std::move(event));
+                } catch (std::runtime_error &e) {
+                    std::cerr << e.what() << std::endl; // e.g. member is not a mail from enklave.
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(process, i);
+        process(0);
+        for (auto &t: workers)
+            t.join();
+
+        Events enklave_events{allocator};
+        std::size_t total = 0;
+        for (auto &events: partial_results)
+            total += events.size();
+        enklave_events.reserve(total);
+        for (auto &events: partial_results)
+            std::move(events.begin(), events.end(), std::back_inserter(enklave_events));
+        return enklave_events;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_TAR_HPP
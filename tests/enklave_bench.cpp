@@ -0,0 +1,231 @@
+#include "benchmark/benchmark.h"
+#include "../enklave.hpp"
+#include "../config.hpp"
+#include "../pipeline.hpp"
+#include "../range.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace enklave;
+
+/* Micro-benchmarks of the hot paths: datetime parsing, header parsing, the ingestion pipeline and the computation of
+ * timeslots. Run from the build directory like the tests, such that config::path_with_mails is found.
+ *
+ * Corpora for parse_directory are generated once below $ENKLAVE_BENCH_DIR (default: the temporary directory) and
+ * reused by later runs. The corpus of 1M files takes about 2 GB and is only generated if $ENKLAVE_BENCH_MAX_FILES is
+ * at least 1000000; the default maximum is 100000.
+ */
+
+namespace {
+    const fs::path test_data{enklave::config::path_with_mails};
+
+    /// Header blocks of the test mails, held in memory.
+    const std::vector<std::pair<fs::path, std::string>> &test_headers() {
+        static const auto headers = [] {
+            std::vector<std::pair<fs::path, std::string>> result;
+            for (const auto &name: {"testfile_check_in_01.eml", "testfile_check_in_02.eml", "testfile_check_out_01.eml",
+                                    "testfile_check_out_02.eml", "testfile_enklave_other.eml"})
+                result.emplace_back(test_data / name, read_header(test_data / name));
+            return result;
+        }();
+        return headers;
+    }
+
+    /// Replace the value of the first field name (e.g. "X-Pm-Date:") in a header block.
+    void replace_field(std::string &header, std::string_view name, const std::string &value) {
+        const auto begin = header.find("\n" + std::string{name});
+        if (begin == std::string::npos)
+            return;
+        const auto value_begin = begin + 1 + name.size();
+        const auto end = header.find('\n', value_begin);
+        header.replace(value_begin, end - value_begin, " " + value);
+    }
+
+    /** Directory with files alternating between check-in and check-out, one day apart each, sharded into
+     * subdirectories of 1000 files like an archive with a folder per month.
+     *
+     * Only the header blocks are written; every file has a Message-Id of its own, such that none is dropped as a
+     * copy. The directory is reused if a previous run completed it.
+     */
+    fs::path generated_corpus(std::size_t files) {
+        const char *root = std::getenv("ENKLAVE_BENCH_DIR");
+        const auto dir = (root ? fs::path{root} : fs::temp_directory_path()) /
+                         ("enklave_bench_" + std::to_string(files));
+        const auto complete = dir / ".complete";
+        if (fs::exists(complete))
+            return dir;
+
+        fs::remove_all(dir);
+        const auto check_in = read_header(test_data / "testfile_check_in_01.eml");
+        const auto check_out = read_header(test_data / "testfile_check_out_01.eml");
+        const date::sys_seconds start = date::sys_days{date::year{2019} / 1 / 1} + std::chrono::hours{8};
+        for (std::size_t i = 0; i < files; ++i) {
+            if (i % 1000 == 0)
+                fs::create_directories(dir / std::to_string(i / 1000));
+            auto header = i % 2 == 0 ? check_in : check_out;
+            const auto when = start + date::days{i / 2} + std::chrono::hours{i % 2 == 0 ? 0 : 9};
+            replace_field(header, "X-Pm-Date:", date::format("%a, %d %b %Y %T +0000", when));
+            const auto id = "<" + std::to_string(i) + "@bench.enklave.de>";
+            replace_field(header, "Message-Id:", id);
+            replace_field(header, "X-Pm-External-Id:", id);
+            std::ofstream{dir / std::to_string(i / 1000) / (std::to_string(i) + ".eml"), std::ios::binary} << header;
+        }
+        std::ofstream{complete};
+        return dir;
+    }
+
+    /** Events alternating between check-in and check-out; a fraction of them repeats the type of its predecessor,
+     * i.e. is impossible and filtered by compute_timeslots. Shuffled, such that the sort has work to do.
+     */
+    std::vector<EnklaveEvent> synthetic_events(std::size_t count, double impossible_fraction) {
+        std::mt19937_64 random{42};
+        std::bernoulli_distribution impossible{impossible_fraction};
+        std::vector<EnklaveEvent> events(count);
+        const date::sys_seconds start = date::sys_days{date::year{2019} / 1 / 1};
+        auto type = EnklaveEventType::CHECK_OUT;
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!impossible(random))
+                type = type == EnklaveEventType::CHECK_IN ? EnklaveEventType::CHECK_OUT : EnklaveEventType::CHECK_IN;
+            events[i].type = type;
+            events[i].when = start + std::chrono::hours{4 * i};
+            events[i].site = "enklave";
+            events[i].message_id_hash = random();
+        }
+        std::shuffle(events.begin(), events.end(), random);
+        return events;
+    }
+}
+
+static void BM_parse_datetime(benchmark::State &state) {
+    const std::string line{"X-Pm-Date: Fri, 13 Sep 2019 13:44:02 +0200"};
+    for (auto _: state)
+        benchmark::DoNotOptimize(parse_datetime(line));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_parse_datetime);
+
+static void BM_parse_rfc5322_date(benchmark::State &state) {
+    const std::string_view value{"Fri, 13 Sep 2019 13:44:02 +0200 (CEST)"};
+    for (auto _: state)
+        benchmark::DoNotOptimize(parse_rfc5322_date(value));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_parse_rfc5322_date);
+
+/// parse_file without I/O: the header blocks are parsed from memory, with the context of a pipeline thread.
+static void BM_parse_file_in_memory(benchmark::State &state) {
+    const auto &headers = test_headers();
+    ParseContext context;
+    std::size_t bytes = 0;
+    for (auto _: state) {
+        for (const auto &[path, header]: headers) {
+            try {
+                benchmark::DoNotOptimize(parse_header_lazy(context, header, [&path]() { return path; }));
+            } catch (std::runtime_error &) { // The inconclusive mail is part of the mix.
+            }
+            bytes += header.size();
+        }
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * headers.size()));
+    state.SetBytesProcessed(static_cast<std::int64_t>(bytes));
+}
+BENCHMARK(BM_parse_file_in_memory);
+
+/// parse_file including reading the header from disk (page cache).
+static void BM_parse_file(benchmark::State &state) {
+    const auto f = test_data / "testfile_check_in_01.eml";
+    ParseContext context;
+    for (auto _: state)
+        benchmark::DoNotOptimize(parse_file(context, f));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_parse_file);
+
+static void BM_parse_directory(benchmark::State &state) {
+    const auto files = static_cast<std::size_t>(state.range(0));
+    const char *max = std::getenv("ENKLAVE_BENCH_MAX_FILES");
+    if (files > (max ? std::stoull(max) : 100000)) {
+        state.SkipWithError("Corpus larger than ENKLAVE_BENCH_MAX_FILES");
+        return;
+    }
+    const auto dir = generated_corpus(files);
+    PipelineConfig pipeline_config;
+    pipeline_config.scan.recursive = true;
+    std::uint64_t bytes = 0;
+    for (auto _: state) {
+        PipelineStats stats;
+        const auto events = parse_directory(dir, pipeline_config, &stats);
+        if (events.size() != files)
+            state.SkipWithError("Not every generated file became an event");
+        bytes += stats.read.bytes;
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * files));
+    state.SetBytesProcessed(static_cast<std::int64_t>(bytes));
+}
+BENCHMARK(BM_parse_directory)->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/// compute_timeslots on 10000 events; the argument is the per mille of impossible events.
+static void BM_compute_timeslots(benchmark::State &state) {
+    const auto events = synthetic_events(10000, static_cast<double>(state.range(0)) / 1000);
+    for (auto _: state) {
+        state.PauseTiming();
+        auto copy = events;
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(compute_timeslots(copy));
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * events.size()));
+}
+BENCHMARK(BM_compute_timeslots)->Arg(0)->Arg(10)->Arg(100)->Arg(500)->Unit(benchmark::kMicrosecond);
+
+/// compute_duration over timeslots, without and with a range clipping them.
+static void BM_compute_duration(benchmark::State &state) {
+    auto events = synthetic_events(static_cast<std::size_t>(state.range(0)), 0);
+    const auto timeslots = compute_timeslots(events);
+    TimeRange range;
+    if (state.range(1) != 0) {
+        range.since = timeslots[timeslots.size() / 4].first.when + std::chrono::hours{1};
+        range.until = timeslots[timeslots.size() * 3 / 4].second.when - std::chrono::hours{1};
+    }
+    for (auto _: state)
+        benchmark::DoNotOptimize(compute_duration(timeslots, range));
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * timeslots.size()));
+}
+BENCHMARK(BM_compute_duration)->Args({1000, 0})->Args({1000, 1})->Args({100000, 0})->Args({100000, 1});
+
+int main(int argc, char **argv) {
+    // Results are printed as JSON, such that runs can be compared; --benchmark_format=console prints a table instead.
+    // --benchmark_out=FILE additionally writes them to a file.
+    const bool console = std::any_of(argv + 1, argv + argc, [](const char *arg) {
+        return std::string_view{arg} == "--benchmark_format=console";
+    });
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    // Progress and impossible events are reported on std::cout and std::cerr; they would garble the results.
+    std::ostream out{std::cout.rdbuf()};
+    std::ostream err{std::cerr.rdbuf()};
+    std::ostringstream discarded;
+    std::cout.rdbuf(discarded.rdbuf());
+    std::cerr.rdbuf(discarded.rdbuf());
+
+    benchmark::JSONReporter json;
+    benchmark::ConsoleReporter table;
+    benchmark::BenchmarkReporter &reporter = console ? static_cast<benchmark::BenchmarkReporter &>(table) : json;
+    reporter.SetOutputStream(&out);
+    reporter.SetErrorStream(&err);
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+
+    // The standard streams are flushed after main returns, when discarded is gone.
+    std::cout.rdbuf(out.rdbuf());
+    std::cerr.rdbuf(err.rdbuf());
+    return 0;
+}
@@ -1,6 +1,29 @@
 #include "gtest/gtest.h"
 #include "../enklave.hpp"
+#include "../body.hpp"
+#include "../encoded_words.hpp"
+#include "../header_scan.hpp"
+#include "../journal.hpp"
+#include "../arena.hpp"
 #include "../config.hpp"
+#include "../daemon.hpp"
+#include "../dedup.hpp"
+#include "../mbox.hpp"
+#include "../options.hpp"
+#include "../pipeline.hpp"
+#include "../query_index.hpp"
+#include "../range.hpp"
+#include "../rules.hpp"
+#include "../shared_results.hpp"
+#include "../snapshot.hpp"
+#include "../tar.hpp"
+
+#include <algorithm>
+#include <memory_resource>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <thread>
 
 using namespace enklave;
 // Filesystem needs some care on different compilers.
@@ -12,6 +35,53 @@ namespace fs = std::experimental::filesystem::v1;
 namespace fs = std::filesystem;
 #endif
 
+/// Directory below the system's temporary directory that is removed with all its content at the end of a test.
+struct TemporaryDirectory {
+    fs::path path;
+
+    explicit TemporaryDirectory(const std::string &name) : path{fs::temp_directory_path() / ("enklave_" + name)} {
+        fs::remove_all(path);
+        fs::create_directories(path);
+    }
+
+    ~TemporaryDirectory() {
+        std::error_code ec;
+        fs::remove_all(path, ec);
+    }
+
+    /// Copy a file from the test data to path / target, creating parent directories as needed.
+    void copy_test_file(const std::string &test_file, const fs::path &target) const {
+        fs::create_directories((path / target).parent_path());
+        fs::copy_file(fs::path{enklave::config::path_with_mails} / test_file, path / target);
+    }
+};
+
+/// Content of a file from the test data.
+std::string read_test_file(const std::string &name) {
+    std::ifstream ifs{fs::path{enklave::config::path_with_mails} / name, std::ios::binary};
+    return std::string{std::istreambuf_iterator<char>{ifs}, {}};
+}
+
+/// Content of a file from the test data without its Message-Id and X-Pm-External-Id fields.
+std::string read_test_file_without_ids(const std::string &name) {
+    std::istringstream mail{read_test_file(name)};
+    std::string result;
+    for (std::string line; std::getline(mail, line);)
+        if (line.rfind("Message-Id:", 0) != 0 && line.rfind("X-Pm-External-Id:", 0) != 0)
+            result += line + '\n';
+    return result;
+}
+
+/// Mail with its Message-Id and X-Pm-External-Id replaced by one derived from number.
+std::string with_message_id(std::string mail, int number) {
+    for (const std::string field: {"Message-Id: <", "X-Pm-External-Id: <"}) {
+        const auto begin = mail.find(field);
+        if (begin != std::string::npos)
+            mail.insert(begin + field.size(), std::to_string(number) + ".");
+    }
+    return mail;
+}
+
 TEST(parseDatetime, WithSuccess) {
     // Convert a string containing a point in time to date::sys_seconds.
     auto point_in_time = parse_datetime("X-Pm-Date: Fri, 13 Sep 2019 13:44:02 +0200").value();
@@ -37,6 +107,386 @@ TEST(parseFile, IsCheckinAndNotCheckout) {
 }
 
 
+TEST(parseHeader, StopsAtEndOfHeader) {
+    const std::string header = "Authentication-Results: x; header.from=enklave.de\r\n"
+                               "Subject: Confirmation:   Check out\r\n"
+                               "X-Pm-Date: Wed, 11 Sep 2019 19:20:26 +0200\r\n";
+    auto result = parse_header(header, "in-memory");
+    EXPECT_EQ(result.type, EnklaveEventType::CHECK_OUT);
+    EXPECT_EQ("2019-09-11 17:20:26", date::format("%F %T", result.when)); // In UTC.
+
+    auto file_header = read_header(std::string{enklave::config::path_with_mails} + "/testfile_check_in_01.eml");
+    EXPECT_EQ(file_header.substr(file_header.size() - 4), "\r\n\r\n");
+    EXPECT_EQ(file_header.find("<br>"), std::string::npos); // Body is not read.
+}
+
+TEST(parseFile, ReusesContext) {
+    const fs::path data{enklave::config::path_with_mails};
+    ParseContext context;
+    const auto first = context.read_header(data / "testfile_check_in_01.eml");
+    EXPECT_EQ(first, read_header(data / "testfile_check_in_01.eml"));
+    const auto *buffer = first.data();
+    EXPECT_EQ(context.read_header(data / "testfile_check_out_01.eml").data(), buffer); // No new buffer.
+
+    for (auto name: {"testfile_check_in_01.eml", "testfile_check_out_02.eml", "testfile_check_in_02.eml"}) {
+        const auto expected = parse_file(data / name);
+        const auto result = parse_file(context, data / name);
+        EXPECT_EQ(result.when, expected.when);
+        EXPECT_EQ(result.type, expected.type);
+        EXPECT_EQ(result.file, expected.file);
+    }
+    EXPECT_THROW(parse_file(context, data / "testfile_enklave_other.eml"), std::runtime_error);
+    EXPECT_TRUE(context.read_header("someFolderThatSHOULDnotExist/never/ever").empty());
+}
+
+TEST(ahoCorasick, FindsAllOccurrences) {
+    const std::vector<std::string> patterns{"he", "she", "his", "hers", "s"};
+    const AhoCorasick automaton{patterns};
+    const std::string text = "ushers and his shells";
+
+    // Every (end position, pattern) found by the automaton, compared against a naive search.
+    std::vector<std::pair<std::size_t, std::uint32_t>> found, expected;
+    auto state = AhoCorasick::start;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        state = automaton.next(state, static_cast<unsigned char>(text[i]));
+        const auto [begin, end] = automaton.output(state);
+        for (auto id = begin; id != end; ++id)
+            found.emplace_back(i + 1, *id);
+    }
+    for (std::uint32_t id = 0; id < patterns.size(); ++id) {
+        for (auto pos = text.find(patterns[id]); pos != std::string::npos; pos = text.find(patterns[id], pos + 1))
+            expected.emplace_back(pos + patterns[id].size(), id);
+    }
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    EXPECT_EQ(found, expected);
+}
+
+TEST(parseRules, SitesAndErrors) {
+    std::istringstream text{"# Two sites\n"
+                            "[enklave]\n"
+                            "sender = header.from=enklave.de\n"
+                            "check_in = Check_in\n"
+                            "check_out = Check out\n"
+                            "\n"
+                            "[other-space]\n"
+                            "sender=header.from=other.example\n"
+                            "sender = header.from=mail.other.example\n"
+                            "check_in = Welcome\n"
+                            "check_out = Goodbye\n"};
+    const auto sites = parse_rules(text, "test");
+    ASSERT_EQ(sites.size(), 2u);
+    EXPECT_EQ(sites[0].site, "enklave");
+    EXPECT_EQ(sites[0].senders, std::vector<std::string>{"header.from=enklave.de"});
+    EXPECT_EQ(sites[0].check_out, std::vector<std::string>{"Check out"});
+    EXPECT_EQ(sites[1].site, "other-space");
+    EXPECT_EQ(sites[1].senders.size(), 2u);
+
+    for (const std::string bad: {"sender = x\n", "[a b]\n", "[a]\nsender = x\n", "[a]\nfoo = x\n",
+                                 "[a]\nsender =\n", "[a]\nsender\n", ""}) {
+        std::istringstream input{bad};
+        EXPECT_THROW(parse_rules(input, "bad"), std::invalid_argument) << bad;
+    }
+    EXPECT_THROW(load_rules("someFolderThatSHOULDnotExist/rules"), std::invalid_argument);
+}
+
+TEST(parseHeader, ClassifiesByRules) {
+    const Classifier classifier{{default_rules().front(),
+                                 SiteRules{"other", {"header.from=other.example"}, {"Welcome"}, {"Goodbye"}}}};
+    ParseContext context{&classifier};
+    auto path = []() { return fs::path{"in-memory"}; };
+
+    const std::string other = "Authentication-Results: x; header.from=other.example\r\n"
+                              "Subject: Welcome back\r\n"
+                              "X-Pm-Date: Wed, 11 Sep 2019 09:00:00 +0200\r\n";
+    auto event = parse_header_lazy(context, other, path);
+    EXPECT_EQ(event.site, "other");
+    EXPECT_EQ(event.type, EnklaveEventType::CHECK_IN);
+
+    // Mails of Enklave are classified as before, also with several sites.
+    const fs::path data{enklave::config::path_with_mails};
+    event = parse_file(context, data / "testfile_check_out_01.eml");
+    EXPECT_EQ(event.site, "enklave");
+    EXPECT_EQ(event.type, EnklaveEventType::CHECK_OUT);
+    EXPECT_THROW(parse_file(context, data / "testfile_enklave_other.eml"), std::runtime_error);
+
+    // Patterns only count for their own site and only on Subject lines.
+    const std::string mixed = "Authentication-Results: x; header.from=other.example\r\n"
+                              "Subject: Check_in\r\n"
+                              "Comment: Welcome\r\n"
+                              "X-Pm-Date: Wed, 11 Sep 2019 09:00:00 +0200\r\n";
+    EXPECT_THROW(parse_header_lazy(context, mixed, path), std::runtime_error);
+
+    // The built-in rules don't know the other site.
+    EXPECT_THROW(parse_header(other, "in-memory"), std::runtime_error);
+}
+
+/// Profile of a second site, declared like the built-in ones.
+constexpr auto other_profile = enklave::dsl::profile(
+        "other",
+        enklave::dsl::first_line().contains("header.from=other.example") >> enklave::dsl::sender,
+        enklave::dsl::header("Subject").contains("Welcome") >> enklave::dsl::check_in,
+        enklave::dsl::header("Subject").contains("Goodbye") >> enklave::dsl::check_out,
+        enklave::dsl::header("X-Pm-Date") >> enklave::dsl::timestamp);
+
+static_assert(enklave::dsl::is_valid(enklave_profile));
+static_assert(!enklave::dsl::is_valid(enklave::dsl::profile(
+        "incomplete", enklave::dsl::first_line().contains("x") >> enklave::dsl::sender)));
+
+TEST(parseHeader, CompiledProfilesMatchRuntimeRules) {
+    const Classifier classifier{default_rules()};
+    ParseContext runtime{&classifier};
+    ParseContext compiled;
+
+    for (const auto &entry: fs::directory_iterator{enklave::config::path_with_mails}) {
+        const auto header = read_header(entry.path());
+        auto path = [&entry]() { return entry.path(); };
+        std::optional<EnklaveEvent> expected;
+        try {
+            expected = parse_header_lazy(runtime, header, path);
+        } catch (std::runtime_error &) {
+        }
+        if (!expected) {
+            EXPECT_THROW(parse_header_lazy(compiled, header, path), std::runtime_error) << entry.path();
+            continue;
+        }
+        const auto event = parse_header_lazy(compiled, header, path);
+        EXPECT_EQ(event.when, expected->when) << entry.path();
+        EXPECT_EQ(event.type, expected->type) << entry.path();
+        EXPECT_EQ(event.site, expected->site) << entry.path();
+        EXPECT_EQ(event.message_id_hash, expected->message_id_hash) << entry.path();
+    }
+
+    // Subject fields are found by their name in any case, and folded ones are unfolded before matching.
+    const std::string sender = "Authentication-Results: x; header.from=enklave.de\r\n";
+    const std::string date = "X-Pm-Date: Wed, 11 Sep 2019 18:00:00 +0200\r\n";
+    const std::pair<std::string, EnklaveEventType> subjects[] = {
+            {"subject: Check in\r\n", EnklaveEventType::CHECK_IN},
+            {"SUBJECT: Check out\r\n", EnklaveEventType::CHECK_OUT},
+            {"Subject: Confirmation:\r\n Check\r\n\tin\r\n", EnklaveEventType::CHECK_IN},
+            {"Subject: =?utf-8?q?Check?=\r\n =?utf-8?q?_out?=\r\n", EnklaveEventType::CHECK_OUT},
+            {"Subjectfoo: Check in\r\nSubject: Hello\r\n", EnklaveEventType::UNDEFINED},
+    };
+    for (const auto &[subject, type]: subjects) {
+        for (const auto &header: {sender + subject + date, sender + date + subject}) {
+            auto path = []() { return fs::path{"in-memory"}; };
+            if (type == EnklaveEventType::UNDEFINED) {
+                EXPECT_THROW(parse_header_lazy(runtime, header, path), InconclusiveMail) << header;
+                EXPECT_THROW(parse_header_lazy(compiled, header, path), InconclusiveMail) << header;
+                continue;
+            }
+            EXPECT_EQ(parse_header_lazy(runtime, header, path).type, type) << header;
+            EXPECT_EQ(parse_header_lazy(compiled, header, path).type, type) << header;
+        }
+    }
+
+    // A mail belongs to the first profile whose sender matches.
+    const std::string other = "Authentication-Results: x; header.from=other.example\r\n"
+                              "Subject: Goodbye\r\n"
+                              "X-Pm-Date: Wed, 11 Sep 2019 18:00:00 +0200\r\n";
+    auto event = parse_header_with(enklave::dsl::Profiles<enklave_profile, other_profile>{}, compiled, other,
+                                   []() { return fs::path{"in-memory"}; });
+    EXPECT_EQ(event.site, "other");
+    EXPECT_EQ(event.type, EnklaveEventType::CHECK_OUT);
+    EXPECT_THROW(parse_header(other, "in-memory"), std::runtime_error);
+}
+
+TEST(findFieldStarts, KernelsAgree) {
+    // Random header-like bytes with many line endings and folded lines, at every length up to a few vectors.
+    std::mt19937 random{42};
+    const std::string alphabet = "ab: \t\r\n\n";
+    for (std::size_t size = 0; size < 200; ++size) {
+        std::string data;
+        for (std::size_t i = 0; i < size; ++i)
+            data += alphabet[random() % alphabet.size()];
+
+        std::vector<std::uint32_t> expected, starts;
+        enklave::detail::field_starts_scalar(data, 1, expected);
+        find_field_starts(data, starts);
+        if (!data.empty())
+            expected.insert(expected.begin(), 0);
+        EXPECT_EQ(starts, expected) << size;
+#ifdef ENKLAVE_X86_DISPATCH
+        starts.clear();
+        enklave::detail::field_starts_sse2(data, 1, starts);
+        EXPECT_EQ(starts, std::vector<std::uint32_t>(expected.begin() + !data.empty(), expected.end())) << size;
+        if (__builtin_cpu_supports("avx2")) {
+            starts.clear();
+            enklave::detail::field_starts_avx2(data, 1, starts);
+            EXPECT_EQ(starts, std::vector<std::uint32_t>(expected.begin() + !data.empty(), expected.end())) << size;
+        }
+#endif
+    }
+
+    std::vector<std::uint32_t> starts;
+    find_field_starts("A: 1\r\nB: 2\r\n\tcontinued\r\nC: 3\r\n", starts);
+    EXPECT_EQ(starts, (std::vector<std::uint32_t>{0, 6, 24}));
+}
+
+TEST(fieldNames, MatchesNamesWithColon) {
+    const FieldNames names{"Subject", "X-Pm-External-Id", "To"};
+    EXPECT_EQ(names.match("Subject: x", 0), 0u);
+    EXPECT_EQ(names.match("SUBJECT:", 0), 0u); // Field names are case-insensitive.
+    EXPECT_EQ(names.match("Subjects: x", 0), FieldNames::npos);
+    EXPECT_EQ(names.match("x-pm-external-id: <1>", 0), 1u); // Longer than one vector.
+    EXPECT_EQ(names.match("X-Pm-External-Ix: <1>", 0), FieldNames::npos);
+    EXPECT_EQ(names.match("...To:", 3), 2u); // Near the end of data.
+    EXPECT_EQ(names.match("To", 0), FieldNames::npos);
+    EXPECT_EQ(names.match("T\ro:", 0), FieldNames::npos);
+    EXPECT_EQ(names.length(1), std::string_view{"X-Pm-External-Id:"}.size());
+}
+
+TEST(parseHeader, FoldedFields) {
+    const std::string header = "Authentication-Results: mail.example;\r\n"
+                               "\tdkim=pass header.from=enklave.de\r\n"
+                               "Subject: Confirmation:\r\n"
+                               " Check out\r\n"
+                               "Message-Id:\r\n"
+                               " <folded@example>\r\n"
+                               "X-Pm-Date: Wed, 11 Sep 2019 19:20:26 +0200\r\n";
+    const auto event = parse_header(header, "in-memory");
+    EXPECT_EQ(event.type, EnklaveEventType::CHECK_OUT);
+    EXPECT_EQ("2019-09-11 17:20:26", date::format("%F %T", event.when));
+    EXPECT_EQ(event.message_id_hash, enklave::detail::hash_of("<folded@example>"));
+}
+
+TEST(decodeHeaderText, EncodedWords) {
+    std::string text;
+    EXPECT_EQ(decode_header_text(" =?utf-8?q?Confirmation:_=C2=A0Check_in?=\r\n", text), "Confirmation: Check in");
+    EXPECT_EQ(decode_header_text(" Confirmation:   Check out", text), "Confirmation: Check out");
+    // "Confirmation: Check out" in base64, with a no-break space, split into two words on a folded line.
+    EXPECT_EQ(decode_header_text("=?UTF-8?B?Q29uZmlybWF0aW9uOsKg?=\r\n =?UTF-8?B?Q2hlY2sgb3V0?=", text),
+              "Confirmation: Check out");
+    EXPECT_EQ(decode_header_text("=?iso-8859-1?Q?Check=A0in?=", text), "Check in");
+    EXPECT_EQ(decode_header_text("=?utf-8?b?w6Q=?= =?utf-8?b?w7Y?=", text), "\xC3\xA4\xC3\xB6"); // Padding optional.
+    EXPECT_EQ(decode_header_text("a =?utf-8?q?b?= c", text), "a b c"); // Blanks next to text are kept.
+    EXPECT_EQ(decode_header_text("=?utf-8?x?Check_in?= =?broken", text), "=?utf-8?x?Check_in?= =?broken");
+    EXPECT_EQ(decode_header_text("caf\xC3\xA9 \xC2", text), "caf\xC3\xA9 \xC2");
+
+    // The buffer is reused.
+    const auto *buffer = text.data();
+    decode_header_text("=?utf-8?q?short?=", text);
+    EXPECT_EQ(text.data(), buffer);
+}
+
+TEST(parseHeader, EncodedSubjects) {
+    const Classifier classifier{default_rules()};
+    ParseContext runtime{&classifier};
+    ParseContext compiled;
+    auto path = []() { return fs::path{"in-memory"}; };
+    const std::string base64 = "Authentication-Results: x; header.from=enklave.de\r\n"
+                               "Subject: =?utf-8?B?Q29uZmlybWF0aW9uOiDCoENoZWNrIG91dA==?=\r\n"
+                               "X-Pm-Date: Wed, 11 Sep 2019 19:20:26 +0200\r\n";
+    EXPECT_EQ(parse_header_lazy(compiled, base64, path).type, EnklaveEventType::CHECK_OUT);
+    EXPECT_EQ(parse_header_lazy(runtime, base64, path).type, EnklaveEventType::CHECK_OUT);
+
+    const std::string quoted = "Authentication-Results: x; header.from=enklave.de\r\n"
+                               "Subject: =?UTF-8?Q?Confirmation:_Check=20in?=\r\n"
+                               "X-Pm-Date: Wed, 11 Sep 2019 15:44:02 +0200\r\n";
+    EXPECT_EQ(parse_header_lazy(compiled, quoted, path).type, EnklaveEventType::CHECK_IN);
+    EXPECT_EQ(parse_header_lazy(runtime, quoted, path).type, EnklaveEventType::CHECK_IN);
+}
+
+TEST(parseRfc5322Date, FormsAndZones) {
+    using namespace date;
+    const sys_seconds noon_utc = sys_days{2019_y / sep / 13} + std::chrono::hours{12};
+    EXPECT_EQ(parse_rfc5322_date("Fri, 13 Sep 2019 14:00:00 +0200"), noon_utc);
+    EXPECT_EQ(parse_rfc5322_date(" 13 Sep 2019 05:00:00 -0700 (PDT)\r\n"), noon_utc);
+    EXPECT_EQ(parse_rfc5322_date("Fri, 13 Sep 2019 05:00 PDT"), noon_utc);
+    EXPECT_EQ(parse_rfc5322_date("Fri,\r\n\t13 sep 19 12:00:00 GMT"), noon_utc);
+    EXPECT_EQ(parse_rfc5322_date("13 Sep 2019 12:00:00 +0000 (UTC)"), noon_utc);
+    EXPECT_EQ(parse_rfc5322_date("Sat, 14 Sep 2019 00:30:00 +1230"), noon_utc);
+    EXPECT_EQ(parse_received_date("from a.example by b.example; Fri, 13 Sep 2019 12:00:00 +0000"), noon_utc);
+
+    EXPECT_EQ(parse_rfc5322_date("31 Feb 2019 12:00:00 +0000"), std::nullopt);
+    EXPECT_EQ(parse_rfc5322_date("13 Sep 2019 24:00:00 +0000"), std::nullopt);
+    EXPECT_EQ(parse_rfc5322_date("13 Foo 2019 12:00:00 +0000"), std::nullopt);
+    EXPECT_EQ(parse_rfc5322_date("13 Sep 2019 12:00:00 +02"), std::nullopt);
+    EXPECT_EQ(parse_received_date("from a.example by b.example"), std::nullopt);
+}
+
+TEST(parseHeader, TimestampFallbacks) {
+    const Classifier classifier{default_rules()};
+    ParseContext runtime{&classifier};
+    ParseContext compiled;
+    auto path = []() { return fs::path{"in-memory"}; };
+    const std::string received = "Authentication-Results: x; header.from=enklave.de\r\n"
+                                 "Received: from relay.example by mx.example;\r\n"
+                                 "\tWed, 11 Sep 2019 19:20:40 +0000\r\n"
+                                 "Subject: Confirmation: Check out\r\n"
+                                 "Received: from enklave.de by relay.example; Wed, 11 Sep 2019 12:20:30 -0700 (PDT)\r\n"
+                                 "Date: Wed, 11 Sep 2019 19:20:26 +0000\r\n";
+    const std::string date = "Authentication-Results: x; header.from=enklave.de\r\n"
+                             "Subject: Confirmation: Check out\r\n"
+                             "X-Pm-Date: not a date\r\n"
+                             "Date: Wed, 11 Sep 2019 19:20:26 +0000 (UTC)\r\n";
+    const std::string none = "Authentication-Results: x; header.from=enklave.de\r\n"
+                             "Subject: Confirmation: Check out\r\n";
+    for (auto *context: {&compiled, &runtime}) {
+        EXPECT_EQ("2019-09-11 19:20:30", date::format("%F %T", parse_header_lazy(*context, received, path).when));
+        EXPECT_EQ("2019-09-11 19:20:26", date::format("%F %T", parse_header_lazy(*context, date, path).when));
+        EXPECT_THROW(parse_header_lazy(*context, none, path), std::runtime_error);
+    }
+}
+
+TEST(decodeQuotedPrintable, SoftBreaksAndEscapes) {
+    std::string text;
+    decode_quoted_printable("=C2=\r\n=A0Check in<br>Ch=\neck out =3D =ZZ=", [&text](char c) { text += c; });
+    EXPECT_EQ(text, "\xC2\xA0" "Check in<br>Check out = =ZZ=");
+}
+
+TEST(parseMail, BodyFallback) {
+    const auto mail = read_test_file("testfile_check_in_01.eml");
+    const auto header_end = find_header_end(mail);
+    auto header = mail.substr(0, header_end);
+    header.replace(header.find("=?utf-8?q?Confirmation:_=C2=A0Check_in?="), 40, "Your submission");
+    const auto body = mail.substr(header_end);
+    auto path = []() { return fs::path{"in-memory"}; };
+
+    const auto part = find_html_part(header, body);
+    ASSERT_TRUE(part.has_value());
+    EXPECT_TRUE(part->quoted_printable);
+    EXPECT_EQ(part->content.substr(0, 3), "Hi ");
+
+    const Classifier classifier{default_rules()};
+    ParseContext runtime{&classifier};
+    ParseContext compiled;
+    EXPECT_THROW(parse_mail(compiled, header, body, 0, path), InconclusiveMail);
+    EXPECT_THROW(parse_mail(runtime, header, body, 0, path), InconclusiveMail);
+    // "Check in" follows about 70 bytes into the part.
+    EXPECT_THROW(parse_mail(compiled, header, body, 40, path), std::runtime_error);
+    for (auto *context: {&compiled, &runtime}) {
+        const auto event = parse_mail(*context, header, body, 512, path);
+        EXPECT_EQ(event.type, EnklaveEventType::CHECK_IN);
+        EXPECT_EQ(event.site, "enklave");
+        EXPECT_EQ(date::format("%T", event.when), "11:44:02");
+    }
+}
+
+TEST(parseDirectory, BodyFallback) {
+    TemporaryDirectory tmp{"body"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "in.eml");
+    tmp.copy_test_file("testfile_enklave_other.eml", "other.eml"); // Generic Subject, body says "Check out".
+
+    PipelineConfig config;
+    PipelineStats stats;
+    EXPECT_EQ(parse_directory(tmp.path, config, &stats).size(), 1u);
+    EXPECT_EQ(stats.body_scans, 0u);
+
+    // The body is read again like the header: relative to the open directory, or by path.
+    config.body_scan_bytes = 1024;
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        config.scan.backend = backend;
+        PipelineStats scanned;
+        const auto results = parse_directory(tmp.path, config, &scanned);
+        ASSERT_EQ(results.size(), 2u);
+        EXPECT_EQ(scanned.body_scans, 1u);
+        EXPECT_EQ(std::count_if(results.begin(), results.end(), [](const EnklaveEvent &e) {
+            return e.type == EnklaveEventType::CHECK_OUT && e.file.filename() == "other.eml";
+        }), 1);
+    }
+}
+
 TEST(parseFile, FileNotFound) {
     EXPECT_THROW(parse_file("someFolderThatSHOULDnotExist/never/ever"), std::runtime_error);
 }
@@ -63,6 +513,798 @@ TEST(parseDirectory, FolderNotFound) {
     EXPECT_THROW(parse_directory("someFolderThatSHOULDnotExist/never/ever"), fs::filesystem_error);
 }
 
+TEST(parseDirectory, SameResultForEveryThreadBudget) {
+    PipelineConfig narrow; // Tiny queues force the stages to wait on each other.
+    narrow.reader_threads = 1;
+    narrow.parser_threads = 1;
+    narrow.queue_capacity = 2;
+    PipelineStats stats;
+    auto results = parse_directory(enklave::config::path_with_mails, narrow, &stats);
+    auto expected = parse_directory(enklave::config::path_with_mails);
+    EXPECT_EQ(results.size(), expected.size());
+    EXPECT_EQ(stats.enumerate.items, stats.read.items);
+    EXPECT_EQ(stats.read.items, stats.parse.items);
+    EXPECT_EQ(stats.aggregate.items, results.size());
+    EXPECT_EQ(stats.parse.threads, 1u);
+}
+
+TEST(phaseStats, TimesEveryPhase) {
+    PipelineStats stats;
+    auto events = parse_directory(enklave::config::path_with_mails, PipelineConfig{}, &stats);
+    EXPECT_GT(stats.wall_ns, 0u);
+    EXPECT_GT(stats.parse.cpu_ns, 0u);
+    EXPECT_EQ(stats.dates.threads, stats.parse.threads);
+    // Every event was dated; mails dated but found inconclusive afterwards are not events.
+    EXPECT_GE(stats.dates.items, events.size());
+    EXPECT_LE(stats.dates.busy_ns, stats.parse.busy_ns);
+
+    PhaseStats phases;
+    const auto sorted = events.size();
+    const auto timeslots = compute_timeslots(events, &phases);
+    EXPECT_EQ(phases.sort.calls, 1u);
+    EXPECT_EQ(phases.sort.items, sorted);
+    EXPECT_EQ(phases.filter.items, sorted - events.size());
+    EXPECT_EQ(phases.pair.items, timeslots.size());
+    EXPECT_EQ(phases.sum.calls, 0u);
+
+    std::ostringstream report;
+    report << stats << phases;
+    EXPECT_NE(report.str().find(" dates "), std::string::npos);
+    EXPECT_NE(report.str().find("filter "), std::string::npos);
+    report.str("");
+    report << 2.5; // The stream's formatting is left as it was.
+    EXPECT_EQ(report.str(), "2.5");
+}
+
+TEST(parseDirectory, RecursiveAndMaildir) {
+    TemporaryDirectory tmp{"maildir"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "2019/cur/1568202242.M1P1.host:2,S");
+    tmp.copy_test_file("testfile_check_out_01.eml", "2019/new/1568222426.M2P1.host");
+    tmp.copy_test_file("testfile_check_in_02.eml", "2019/tmp/1568288642.M3P1.host"); // Delivery in progress.
+    tmp.copy_test_file("testfile_check_out_02.eml", "2020/archive/old.eml");
+    tmp.copy_test_file("testfile_check_in_02.eml", "top.eml");
+
+    EXPECT_EQ(parse_directory(tmp.path).size(), 1u); // Only top-level .eml files.
+
+    PipelineConfig recursive;
+    recursive.scan.recursive = true;
+    recursive.scan.traversal_threads = 3;
+    EXPECT_EQ(parse_directory(tmp.path, recursive).size(), 2u); // Extensionless Maildir files are ignored.
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        PipelineConfig maildir;
+        maildir.scan.layout = MailLayout::MAILDIR;
+        maildir.scan.backend = backend;
+        auto results = parse_directory(tmp.path, maildir);
+        EXPECT_EQ(results.size(), 4u);
+        for (auto &e: results) {
+            EXPECT_EQ(e.file.string().find("/tmp/1568288642"), std::string::npos);
+            EXPECT_TRUE(fs::exists(e.file)) << e.file; // Full paths are built for reported files.
+        }
+    }
+}
+
+TEST(parseDirectory, BackendsAgree) {
+    PipelineConfig portable;
+    portable.scan.backend = ScanBackend::PORTABLE;
+    PipelineConfig getdents;
+    getdents.scan.backend = ScanBackend::GETDENTS;
+    auto expected = parse_directory(enklave::config::path_with_mails, portable);
+    auto results = parse_directory(enklave::config::path_with_mails, getdents);
+    EXPECT_EQ(results.size(), expected.size());
+    EXPECT_THROW(parse_directory("someFolderThatSHOULDnotExist/never/ever", getdents), fs::filesystem_error);
+}
+
+TEST(directoryCache, SkipsUnchangedShards) {
+    TemporaryDirectory tmp{"dircache"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019-09/out.eml");
+    tmp.copy_test_file("testfile_check_in_02.eml", "archive/2019-10/in.eml");
+    const auto cache_file = tmp.path / "cache";
+    const auto archive = tmp.path / "archive";
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        fs::remove(cache_file);
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.backend = backend;
+        {
+            DirectoryCache cold;
+            cold.load(cache_file);
+            config.scan.cache = &cold;
+            EXPECT_EQ(parse_directory(archive, config).size(), 3u);
+            EXPECT_EQ(cold.reused(), 0u);
+            cold.save(cache_file);
+        }
+        {
+            DirectoryCache warm;
+            warm.load(cache_file);
+            config.scan.cache = &warm;
+            auto results = parse_directory(archive, config);
+            EXPECT_EQ(results.size(), 3u);
+            EXPECT_EQ(warm.reused(), 3u); // Root and both shards.
+            for (auto &e: results)
+                EXPECT_TRUE(fs::exists(e.file)) << e.file;
+            warm.save(cache_file);
+        }
+        tmp.copy_test_file("testfile_check_out_02.eml", "archive/2019-10/out.eml");
+        {
+            DirectoryCache changed;
+            changed.load(cache_file);
+            config.scan.cache = &changed;
+            EXPECT_EQ(parse_directory(archive, config).size(), 4u);
+            EXPECT_EQ(changed.reused(), 2u); // Only the changed shard is listed again.
+        }
+        fs::remove(archive / "2019-10/out.eml");
+    }
+
+    // Corrupt entries are dropped.
+    std::string content;
+    {
+        std::ifstream ifs{cache_file};
+        content.assign(std::istreambuf_iterator<char>{ifs}, {});
+    }
+    content.replace(content.find("E "), 3, "E 1");
+    std::ofstream{cache_file} << content;
+    DirectoryCache corrupt;
+    corrupt.load(cache_file);
+    PipelineConfig config;
+    config.scan.recursive = true;
+    config.scan.cache = &corrupt;
+    EXPECT_EQ(parse_directory(archive, config).size(), 3u);
+    EXPECT_EQ(corrupt.reused(), 2u);
+}
+
+TEST(directoryCache, StaleWhenSettingsOrTimesChange) {
+    TemporaryDirectory tmp{"dircache_settings"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    const auto cache_file = tmp.path / "cache";
+    const auto archive = tmp.path / "archive";
+
+    PipelineConfig config;
+    config.scan.recursive = true;
+    {
+        DirectoryCache cold{cache_fingerprint_of(config)};
+        config.scan.cache = &cold;
+        parse_directory(archive, config);
+        cold.save(cache_file);
+    }
+    auto reused_with = [&](PipelineConfig changed) {
+        DirectoryCache warm{cache_fingerprint_of(changed)};
+        warm.load(cache_file);
+        changed.scan.cache = &warm;
+        parse_directory(archive, changed);
+        return warm.reused();
+    };
+    EXPECT_EQ(reused_with(config), 2u);
+
+    PipelineConfig body_scan = config;
+    body_scan.body_scan_bytes = 4096;
+    EXPECT_EQ(reused_with(body_scan), 0u);
+    PipelineConfig maildir = config;
+    maildir.scan.layout = MailLayout::MAILDIR;
+    EXPECT_EQ(reused_with(maildir), 0u);
+    auto rules = default_rules();
+    const Classifier defaults{rules};
+    rules[0].check_in.emplace_back("Eingecheckt");
+    const Classifier extended{rules};
+    PipelineConfig runtime_rules = config;
+    runtime_rules.classifier = &defaults;
+    EXPECT_EQ(reused_with(runtime_rules), 0u);
+    PipelineConfig other_rules = config;
+    other_rules.classifier = &extended;
+    EXPECT_NE(cache_fingerprint_of(other_rules), cache_fingerprint_of(runtime_rules));
+
+    // A file added with the modification time of its directory restored is still seen.
+    const auto shard = archive / "2019-09";
+    const auto written = fs::last_write_time(shard);
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019-09/out.eml");
+    fs::last_write_time(shard, written);
+    EXPECT_EQ(reused_with(config), 1u);
+}
+
+TEST(directoryCache, RetriesUnreadableFiles) {
+    TemporaryDirectory tmp{"dircache_retry"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019-10/out.eml");
+    std::ofstream{tmp.path / "archive/2019-09/broken.eml.gz", std::ios::binary} << "not gzip";
+    std::ofstream{tmp.path / "archive/2019-10/writing.eml"}; // Still being written.
+    const auto cache_file = tmp.path / "cache";
+    const auto archive = tmp.path / "archive";
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        fs::remove(cache_file);
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.backend = backend;
+        {
+            DirectoryCache cold;
+            config.scan.cache = &cold;
+            EXPECT_EQ(parse_directory(archive, config).size(), 2u);
+            cold.save(cache_file);
+        }
+        DirectoryCache warm;
+        warm.load(cache_file);
+        config.scan.cache = &warm;
+        EXPECT_EQ(parse_directory(archive, config).size(), 2u);
+        EXPECT_EQ(warm.reused(), 1u); // Only the root; both shards are listed again to retry their files.
+    }
+}
+
+TEST(eventJournal, ReadsOnlyNewFiles) {
+    TemporaryDirectory tmp{"journal"};
+    const auto journal_file = tmp.path / "events.journal";
+    const auto archive = tmp.path / "archive";
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    tmp.copy_test_file("testfile_enklave_other.eml", "archive/2019-09/other.eml"); // Fails to parse.
+
+    PipelineConfig config;
+    config.scan.recursive = true;
+    // Without slack, files must be older than the scan by at least one tick of the clock stamping them.
+    const std::chrono::nanoseconds no_slack{0};
+    auto journaled_scan = [&](EventJournal &journal, PipelineStats &stats) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        return parse_directory_journaled(archive, config, journal, &stats, {}, no_slack);
+    };
+    {
+        EventJournal journal{journal_file};
+        PipelineStats stats;
+        EXPECT_EQ(journaled_scan(journal, stats).size(), 1u);
+        EXPECT_EQ(stats.read.items, 2u);
+        EXPECT_NE(journal.checkpoint(), 0);
+    }
+
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019-09/out.eml");
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-10/copy.eml"); // Known mail in a new file.
+    for (int run = 0; run < 2; ++run) {
+        EventJournal journal{journal_file};
+        EXPECT_EQ(journal.replayed(), run == 0 ? 1u : 2u);
+        PipelineStats stats;
+        auto events = journaled_scan(journal, stats);
+        EXPECT_EQ(stats.read.items, run == 0 ? 2u : 0u); // Only files added since the checkpoint are read.
+        ASSERT_EQ(events.size(), 2u);
+        auto timeslots = compute_timeslots(events);
+        EXPECT_EQ("04:36:24", date::format("%T", compute_duration(timeslots)));
+    }
+}
+
+TEST(eventJournal, RetriesUnreadFiles) {
+    TemporaryDirectory tmp{"journal_retry"};
+    const auto journal_file = tmp.path / "events.journal";
+    const auto archive = tmp.path / "archive";
+    const auto late = archive / "2019-09/out.eml";
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    std::ofstream{late}; // Created, but not yet written.
+
+    PipelineConfig config;
+    config.scan.recursive = true;
+    const std::chrono::nanoseconds no_slack{0};
+    auto journaled_scan = [&](PipelineStats &stats) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        EventJournal journal{journal_file};
+        return parse_directory_journaled(archive, config, journal, &stats, {}, no_slack);
+    };
+    {
+        PipelineStats stats;
+        EXPECT_EQ(journaled_scan(stats).size(), 1u);
+        EXPECT_EQ(EventJournal{journal_file}.retry(), std::vector<std::string>{late.parent_path().native()});
+    }
+
+    // Writing the file in place leaves the status of its directory unchanged.
+    std::ofstream{late, std::ios::binary} << read_test_file("testfile_check_out_01.eml");
+    for (int run = 0; run < 2; ++run) {
+        PipelineStats stats;
+        auto events = journaled_scan(stats);
+        EXPECT_EQ(stats.read.items, run == 0 ? 2u : 0u);
+        ASSERT_EQ(events.size(), 2u);
+        auto timeslots = compute_timeslots(events);
+        EXPECT_EQ("04:36:24", date::format("%T", compute_duration(timeslots)));
+    }
+    EXPECT_TRUE(EventJournal{journal_file}.retry().empty());
+}
+
+TEST(eventJournal, JournalsMovedMailsOnce) {
+    TemporaryDirectory tmp{"journal_moved"};
+    const auto journal_file = tmp.path / "events.journal";
+    const auto box = tmp.path / "box";
+    fs::create_directories(box / "cur");
+    fs::create_directories(box / "new");
+    std::ofstream{box / "new/1568202242.M1P1.host", std::ios::binary}
+            << read_test_file_without_ids("testfile_check_in_01.eml");
+
+    PipelineConfig config;
+    config.scan.layout = MailLayout::MAILDIR;
+    const std::chrono::nanoseconds no_slack{0};
+    for (int run = 0; run < 2; ++run) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        EventJournal journal{journal_file};
+        EXPECT_EQ(parse_directory_journaled(box, config, journal, nullptr, {}, no_slack).size(), 1u);
+        // Read by the client: moved to cur/ and flagged as seen.
+        if (run == 0)
+            fs::rename(box / "new/1568202242.M1P1.host", box / "cur/1568202242.M1P1.host:2,S");
+    }
+    EXPECT_EQ(EventJournal{journal_file}.replayed(), 1u);
+}
+
+TEST(eventJournal, SurvivesTornAppends) {
+    TemporaryDirectory tmp{"journal_torn"};
+    const auto journal_file = tmp.path / "events.journal";
+    EnklaveEvent in;
+    in.type = EnklaveEventType::CHECK_IN;
+    in.when = date::sys_seconds{std::chrono::seconds{1568202242}};
+    in.file = "/mails/in.eml";
+    in.message_id_hash = 42;
+    in.site = "enklave";
+    EnklaveEvent out = in;
+    out.type = EnklaveEventType::CHECK_OUT;
+    out.when += std::chrono::hours{4};
+    out.file = "/mails/out.eml";
+    out.message_id_hash = 0;
+    {
+        EventJournal journal{journal_file};
+        EXPECT_TRUE(journal.add(in));
+        EXPECT_FALSE(journal.add(in));
+        journal.commit(1);
+        EXPECT_TRUE(journal.add(out));
+        journal.commit(2);
+    }
+    const auto intact_size = fs::file_size(journal_file);
+    fs::resize_file(journal_file, intact_size - 3); // The last checkpoint is cut short.
+    {
+        EventJournal journal{journal_file};
+        ASSERT_EQ(journal.events().size(), 2u);
+        EXPECT_EQ(journal.checkpoint(), 1);
+        const auto &replayed = journal.events()[1];
+        EXPECT_EQ(replayed.type, EnklaveEventType::CHECK_OUT);
+        EXPECT_EQ(replayed.when, out.when);
+        EXPECT_EQ(replayed.file, out.file);
+        EXPECT_EQ(replayed.site, "enklave");
+        EXPECT_FALSE(journal.add(out));
+        journal.commit(3); // Compacts, since the replay found a damaged record.
+    }
+    {
+        EventJournal journal{journal_file};
+        EXPECT_EQ(journal.events().size(), 2u);
+        EXPECT_EQ(journal.checkpoint(), 3);
+    }
+    EXPECT_LT(fs::file_size(journal_file), intact_size);
+
+    std::ofstream{tmp.path / "other"} << "enklave-directory-cache 4\n";
+    EXPECT_THROW(EventJournal{tmp.path / "other"}, fs::filesystem_error);
+}
+
+TEST(eventJournal, CompactsPeriodically) {
+    TemporaryDirectory tmp{"journal_compact"};
+    const auto journal_file = tmp.path / "events.journal";
+    EventJournal journal{journal_file};
+    journal.commit(1);
+    const auto one_checkpoint = fs::file_size(journal_file);
+    for (std::int64_t run = 2; run <= static_cast<std::int64_t>(enklave::config::journal_compaction_checkpoints); ++run)
+        journal.commit(run);
+    EXPECT_GT(fs::file_size(journal_file), one_checkpoint);
+    journal.commit(100);
+    EXPECT_EQ(fs::file_size(journal_file), one_checkpoint);
+    EXPECT_EQ(EventJournal{journal_file}.checkpoint(), 100);
+}
+
+TEST(parseDirectory, PrunesByTimeRange) {
+    TemporaryDirectory tmp{"range"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019/09/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019/09/out.eml");
+    tmp.copy_test_file("testfile_check_in_02.eml", "archive/2018-03/old.eml"); // Outside by folder name.
+    tmp.copy_test_file("testfile_check_in_02.eml", "archive/misc/stale.eml"); // Outside by modification time.
+    tmp.copy_test_file("testfile_check_out_02.eml", "archive/misc/recent.eml");
+    tmp.copy_test_file("testfile_check_in_02.eml", "archive/box/cur/1568202242.M1P1.host:2,S");
+    tmp.copy_test_file("testfile_check_in_02.eml", "archive/box/cur/1262304000.M1P1.host:2,S"); // Delivered 2010.
+    const auto stale = tmp.path / "archive/misc/stale.eml";
+    fs::last_write_time(stale, fs::last_write_time(stale) - std::chrono::hours{24 * 365 * 10});
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        PipelineConfig config;
+        config.scan.layout = MailLayout::MAILDIR;
+        config.scan.backend = backend;
+        PipelineStats unbounded;
+        parse_directory(tmp.path / "archive", config, &unbounded);
+        EXPECT_EQ(unbounded.enumerate.items, 7u);
+
+        config.scan.range.since = parse_day("2019-09-01");
+        config.scan.range.until = parse_day("2019-10-01");
+        PipelineStats stats;
+        auto results = parse_directory(tmp.path / "archive", config, &stats);
+        EXPECT_EQ(results.size(), 4u);
+        EXPECT_EQ(stats.enumerate.items, 4u); // Pruned files are not even read.
+        for (auto &e: results) {
+            EXPECT_EQ(e.file.string().find("2018-03"), std::string::npos);
+            EXPECT_NE(e.file, stale);
+            EXPECT_EQ(e.file.string().find("1262304000"), std::string::npos);
+        }
+    }
+}
+
+TEST(parseDirectory, DropsCopiesOfMails) {
+    TemporaryDirectory tmp{"dedup"};
+    tmp.copy_test_file("testfile_check_in_01.eml", "export/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "export/out.eml");
+    tmp.copy_test_file("testfile_check_in_01.eml", "migrated/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "migrated/out.eml.gz.eml"); // Other name, same mail.
+    tmp.copy_test_file("testfile_check_in_02.eml", "migrated/next.eml"); // Same Message-Id, other time.
+
+    PipelineConfig config;
+    config.scan.recursive = true;
+    PipelineStats stats;
+    auto results = parse_directory(tmp.path, config, &stats);
+    EXPECT_EQ(results.size(), 3u);
+    EXPECT_EQ(stats.duplicates, 2u);
+    auto timeslots = compute_timeslots(results);
+    EXPECT_EQ("04:36:24", date::format("%T", compute_duration(timeslots)));
+}
+
+TEST(parseDirectory, ReadsLinkedFilesOnce) {
+    TemporaryDirectory tmp{"links"};
+    // Without a Message-Id, only the identity of their file tells the copies of a mail apart.
+    fs::create_directories(tmp.path / "snapshot.1");
+    std::ofstream{tmp.path / "snapshot.1/in.eml", std::ios::binary}
+            << read_test_file_without_ids("testfile_check_in_01.eml");
+    std::ofstream{tmp.path / "snapshot.1/out.eml", std::ios::binary}
+            << read_test_file_without_ids("testfile_check_out_01.eml");
+    fs::create_directories(tmp.path / "snapshot.2");
+    fs::create_hard_link(tmp.path / "snapshot.1/in.eml", tmp.path / "snapshot.2/in.eml");
+    fs::create_hard_link(tmp.path / "snapshot.1/out.eml", tmp.path / "snapshot.2/out.eml");
+    fs::create_directories(tmp.path / "latest");
+    fs::create_symlink(tmp.path / "snapshot.1/in.eml", tmp.path / "latest/in.eml");
+    const auto cache_file = tmp.path / "cache";
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.backend = backend;
+        PipelineStats stats;
+        auto results = parse_directory(tmp.path, config, &stats);
+        EXPECT_EQ(results.size(), 2u);
+        EXPECT_EQ(stats.enumerate.items, 2u);
+        EXPECT_EQ(stats.links, 3u);
+        EXPECT_EQ(stats.duplicates, 0u); // Links are dropped before they are read.
+    }
+
+    // Every directory is cached with the events of its links, even those that were not read.
+    {
+        DirectoryCache cold;
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.cache = &cold;
+        parse_directory(tmp.path, config);
+        cold.save(cache_file);
+    }
+    auto warm_scan = [&](std::size_t reused) {
+        DirectoryCache warm;
+        warm.load(cache_file);
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.cache = &warm;
+        auto results = parse_directory(tmp.path, config);
+        EXPECT_EQ(warm.reused(), reused);
+        return results;
+    };
+    EXPECT_EQ(warm_scan(3u).size(), 2u); // The copies cached for each link are recognized by their file.
+    fs::remove_all(tmp.path / "snapshot.1"); // Rotated out.
+    auto results = warm_scan(2u);
+    ASSERT_EQ(results.size(), 2u);
+    auto timeslots = compute_timeslots(results);
+    EXPECT_EQ("04:36:24", date::format("%T", compute_duration(timeslots)));
+}
+
+TEST(parseDirectory, AllocatesFromArena) {
+    std::pmr::monotonic_buffer_resource arena;
+    using Events = std::pmr::vector<EnklaveEvent>;
+    auto events = parse_directory<Events>(enklave::config::path_with_mails, PipelineConfig{}, nullptr, &arena);
+    EXPECT_EQ(events.get_allocator().resource(), &arena);
+    auto timeslots = compute_timeslots(events);
+    EXPECT_EQ(timeslots.get_allocator().resource(), &arena);
+    EXPECT_EQ("11:12:48", date::format("%T", compute_duration(timeslots)));
+
+    // The stages are stopped and joined before the failure of the calling thread is passed on.
+    EXPECT_THROW(parse_directory<Events>(enklave::config::path_with_mails, PipelineConfig{}, nullptr,
+                                         std::pmr::null_memory_resource()), std::bad_alloc);
+}
+
+TEST(propagatingAllocator, BuffersTravelWithMoves) {
+    std::pmr::unsynchronized_pool_resource pool;
+    ArenaString source{std::string(100, 'x').c_str(), &pool};
+    const auto *bytes = source.data();
+    ArenaString slot; // Bound to the default resource, like a queue slot.
+    slot = std::move(source);
+    EXPECT_EQ(slot.get_allocator().resource(), &pool);
+    EXPECT_EQ(slot.data(), bytes); // Not copied.
+}
+
+TEST(concurrentHashSet, InsertsEachHashOnce) {
+    ConcurrentHashSet set;
+    constexpr int threads = 4;
+    constexpr std::uint64_t per_thread = 20000;
+    std::atomic<std::uint64_t> inserted{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&set, &inserted, t]() {
+            // Ranges of neighbouring threads overlap by half.
+            for (std::uint64_t i = 0; i < per_thread; ++i) {
+                const auto hash = (t * per_thread / 2 + i + 1) * 0x9e3779b97f4a7c15ull;
+                if (set.insert(hash))
+                    ++inserted;
+            }
+        });
+    }
+    for (auto &w: workers)
+        w.join();
+    const auto distinct = (threads + 1) * per_thread / 2;
+    EXPECT_EQ(inserted, distinct);
+    EXPECT_EQ(set.size(), distinct);
+    EXPECT_TRUE(set.insert(0)); // 0 is a valid hash, too.
+    EXPECT_FALSE(set.insert(0));
+
+    EnklaveEvent without_id;
+    EXPECT_TRUE(first_copy(set, without_id));
+    EXPECT_TRUE(first_copy(set, without_id)); // Mails without Message-Id are always kept.
+}
+
+TEST(spanOfFolder, DatesInNames) {
+    using namespace date;
+    const auto year = span_of_folder("2019", std::nullopt);
+    ASSERT_TRUE(year);
+    EXPECT_EQ(year->first, sys_days{2019_y / jan / 1});
+    EXPECT_EQ(year->second, sys_days{2020_y / jan / 1});
+
+    const auto month = span_of_folder("09", year);
+    ASSERT_TRUE(month);
+    EXPECT_EQ(month->first, sys_days{2019_y / sep / 1});
+    EXPECT_EQ(month->second, sys_days{2019_y / oct / 1});
+
+    const auto day = span_of_folder("13", month);
+    ASSERT_TRUE(day);
+    EXPECT_EQ(day->first, sys_days{2019_y / sep / 13});
+
+    EXPECT_EQ(span_of_folder("2019_12", std::nullopt)->second, sys_days{2020_y / jan / 1});
+    EXPECT_EQ(span_of_folder("2019.09.30", std::nullopt)->first, sys_days{2019_y / sep / 30});
+    EXPECT_EQ(span_of_folder("inbox", month), month); // Inherited.
+    EXPECT_FALSE(span_of_folder("13", year) != year); // No month 13; inherited.
+    EXPECT_FALSE(span_of_folder("12345", std::nullopt));
+    EXPECT_FALSE(span_of_folder("09", std::nullopt));
+    // Names that only start with a date are no shards.
+    EXPECT_FALSE(span_of_folder("2015-2020", std::nullopt));
+    EXPECT_FALSE(span_of_folder("2019_backup", std::nullopt));
+    EXPECT_FALSE(span_of_folder("2020 projects", std::nullopt));
+    EXPECT_FALSE(span_of_folder("2019-12_backup", std::nullopt));
+    EXPECT_EQ(span_of_folder("2019-09-31", year), year); // No such day; inherited.
+
+    EXPECT_EQ(time_of_maildir_name("1568202242.M1P1.host:2,S"), sys_seconds{std::chrono::seconds{1568202242}});
+    EXPECT_FALSE(time_of_maildir_name("old.eml"));
+    EXPECT_EQ(parse_day("2019-09-13"), sys_seconds{sys_days{2019_y / sep / 13}});
+    EXPECT_FALSE(parse_day("2019-02-30"));
+    EXPECT_FALSE(parse_day("2019-9-13"));
+}
+
+TEST(isMailName, Extensions) {
+    EXPECT_TRUE(is_mail_name("a.eml", false));
+    EXPECT_TRUE(is_mail_name("a.eml.gz", false));
+    EXPECT_TRUE(is_mail_name("a.eml.zst", false));
+    EXPECT_FALSE(is_mail_name(".eml", false));
+    EXPECT_FALSE(is_mail_name("a.txt", false));
+    EXPECT_FALSE(is_mail_name("a.gz", false));
+    EXPECT_TRUE(is_mail_name("1568202242.M1P1.host:2,S", true));
+    EXPECT_FALSE(is_mail_name(".hidden", true));
+}
+
+TEST(parseMbox, SplitsMessagesWithoutExtracting) {
+    TemporaryDirectory tmp{"mbox"};
+    const fs::path mbox = tmp.path / "export.mbox";
+    const auto check_in = read_test_file("testfile_check_in_01.eml");
+    const auto check_out = read_test_file("testfile_check_out_01.eml");
+
+    // Large enough to be split into several ranges; every range boundary falls into some message.
+    constexpr int pairs = 40;
+    {
+        std::ofstream ofs{mbox, std::ios::binary};
+        for (int i = 0; i < pairs; ++i) {
+            // Distinct Message-Ids, otherwise all but the first pair are dropped as copies.
+            ofs << "From actions@enklave.de Fri Sep 11 11:43:48 2019\n" << with_message_id(check_in, i) << "\n";
+            ofs << "From actions@enklave.de Wed Sep 11 16:20:16 2019\n" << with_message_id(check_out, i) << "\n";
+        }
+        ofs << "From someone@example.com Thu Sep 12 10:00:00 2019\nSubject: Hi\n\n>From the body.\n";
+    }
+
+    auto results = parse_mbox(mbox, 3);
+    ASSERT_EQ(results.size(), 2u * pairs);
+    EXPECT_EQ(std::count_if(results.begin(), results.end(),
+                            [](const EnklaveEvent &e) { return e.type == EnklaveEventType::CHECK_IN; }), pairs);
+    EXPECT_EQ(parse_mbox(mbox, 1).size(), results.size());
+}
+
+TEST(parseMbox, DropsCopiesOfMails) {
+    TemporaryDirectory tmp{"mbox_dedup"};
+    const auto mbox = tmp.path / "twice.mbox";
+    {
+        std::ofstream ofs{mbox, std::ios::binary};
+        for (int copy = 0; copy < 2; ++copy) {
+            for (auto name: {"testfile_check_in_01.eml", "testfile_check_out_01.eml"})
+                ofs << "From someone@example.org Thu Jan  1 00:00:00 1970\n" << read_test_file(name) << "\n";
+        }
+    }
+    EXPECT_EQ(parse_mbox(mbox, 2).size(), 2u);
+}
+
+TEST(parseMbox, SkipsTruncatedFinalSeparator) {
+    TemporaryDirectory tmp{"mbox_truncated"};
+    const auto mbox = tmp.path / "truncated.mbox";
+    {
+        std::ofstream ofs{mbox, std::ios::binary};
+        ofs << "From someone@example.org Thu Jan  1 00:00:00 1970\n" << read_test_file("testfile_check_in_01.eml")
+            << "\nFrom b@c Thu Jan 1 00:00:00 1970";
+    }
+    for (unsigned threads: {1u, 2u}) {
+        const auto results = parse_mbox(mbox, threads);
+        ASSERT_EQ(results.size(), 1u);
+        EXPECT_EQ(results[0].type, EnklaveEventType::CHECK_IN);
+    }
+    EXPECT_EQ(mbox_message_header("From a@b", 0, std::string_view::npos).data(), nullptr);
+}
+
+TEST(findMboxSeparator, OnlyAtLineStart) {
+    const std::string data = "From a\nx From b\n>From c\nFrom d\n" + std::string(40, 'x') + "\nFrom e\n";
+    auto first = find_mbox_separator(data, 0);
+    EXPECT_EQ(first, 0u);
+    auto second = find_mbox_separator(data, first + 1);
+    EXPECT_EQ(data.substr(second, 6), "From d");
+    auto third = find_mbox_separator(data, second + 1);
+    EXPECT_EQ(data.substr(third, 6), "From e");
+    EXPECT_EQ(find_mbox_separator(data, third + 1), std::string::npos);
+}
+
+#ifdef ENKLAVE_HAS_ZLIB
+TEST(readHeader, Gzip) {
+    TemporaryDirectory tmp{"gzip"};
+    // A large body must not be decompressed to find the header.
+    const auto mail = read_test_file("testfile_check_in_01.eml") + std::string(1 << 22, 'x');
+    const auto file = tmp.path / "check_in.eml.gz";
+    gzFile gz = gzopen(file.c_str(), "wb");
+    ASSERT_NE(gz, nullptr);
+    gzwrite(gz, mail.data(), static_cast<unsigned>(mail.size()));
+    gzclose(gz);
+    std::ofstream{tmp.path / "corrupt.eml.gz"} << "this is not gzip";
+
+    EXPECT_EQ(read_header(file), read_header(fs::path{enklave::config::path_with_mails} / "testfile_check_in_01.eml"));
+    EXPECT_EQ(parse_file(file).type, EnklaveEventType::CHECK_IN);
+    EXPECT_THROW(read_header(tmp.path / "corrupt.eml.gz"), std::runtime_error);
+    EXPECT_EQ(parse_directory(tmp.path).size(), 1u); // Corrupt file is reported and skipped.
+}
+#endif
+
+#ifdef ENKLAVE_HAS_ZSTD
+TEST(readHeader, Zstd) {
+    TemporaryDirectory tmp{"zstd"};
+    const auto mail = read_test_file("testfile_check_out_01.eml") + std::string(1 << 22, 'x');
+    std::string compressed(ZSTD_compressBound(mail.size()), '\0');
+    compressed.resize(ZSTD_compress(compressed.data(), compressed.size(), mail.data(), mail.size(), 1));
+    std::ofstream{tmp.path / "check_out.eml.zst", std::ios::binary} << compressed;
+
+    EXPECT_EQ(parse_file(tmp.path / "check_out.eml.zst").type, EnklaveEventType::CHECK_OUT);
+    EXPECT_EQ(parse_directory(tmp.path).size(), 1u);
+}
+#endif
+
+/// Append a tar entry (ustar header followed by padded content) to archive.
+void append_tar_entry(std::string &archive, const std::string &name, const std::string &content, char type = '0') {
+    std::string header(512, '\0');
+    name.copy(header.data(), std::min<std::size_t>(name.size(), 100));
+    std::snprintf(header.data() + 100, 8, "%07o", 0644);
+    std::snprintf(header.data() + 124, 12, "%011zo", content.size());
+    header[156] = type;
+    std::string{"ustar\0" "00"}.copy(header.data() + 257, 8);
+    std::fill(header.begin() + 148, header.begin() + 156, ' ');
+    unsigned checksum = 0;
+    for (unsigned char c: header)
+        checksum += c;
+    std::snprintf(header.data() + 148, 8, "%06o", checksum);
+    archive += header + content + std::string((512 - content.size() % 512) % 512, '\0');
+}
+
+TEST(parseTar, ReadsMembersInPlace) {
+    TemporaryDirectory tmp{"tar"};
+    const std::string long_name = std::string(120, 'd') + "/check_out.eml";
+    std::string archive;
+    append_tar_entry(archive, "export/", "", '5');
+    append_tar_entry(archive, "export/check_in.eml", read_test_file("testfile_check_in_01.eml"));
+    append_tar_entry(archive, "././@LongLink", long_name + '\0', 'L');
+    append_tar_entry(archive, "truncated name", read_test_file("testfile_check_out_01.eml"));
+    append_tar_entry(archive, "export/notes.txt", "not a mail");
+    append_tar_entry(archive, "export/other.eml", read_test_file("testfile_enklave_other.eml"));
+    archive += std::string(1024, '\0');
+    std::ofstream{tmp.path / "export.tar", std::ios::binary} << archive;
+
+    auto members = index_tar(archive);
+    ASSERT_EQ(members.size(), 4u);
+    EXPECT_EQ(members[1].name, long_name);
+    EXPECT_EQ(members[1].content, read_test_file("testfile_check_out_01.eml"));
+
+    auto results = parse_tar(tmp.path / "export.tar", 2);
+    ASSERT_EQ(results.size(), 2u);
+    EXPECT_EQ(results[0].file.string(), (tmp.path / "export.tar").string() + ":export/check_in.eml");
+
+    EXPECT_THROW(index_tar(archive.substr(0, 1024)), std::runtime_error);
+}
+
+TEST(boundedQueue, ManyProducersAndConsumers) {
+    constexpr unsigned producers = 4;
+    constexpr unsigned consumers = 3;
+    constexpr int per_producer = 10000;
+    BoundedQueue<int> queue{8, producers};
+    std::atomic<long long> sum{0};
+    std::vector<std::thread> threads;
+
+    for (unsigned p = 0; p < producers; ++p) {
+        threads.emplace_back([&]() {
+            std::chrono::nanoseconds waited{0};
+            for (int i = 1; i <= per_producer; ++i)
+                queue.push(i, waited);
+            queue.producer_done();
+        });
+    }
+    for (unsigned c = 0; c < consumers; ++c) {
+        threads.emplace_back([&]() {
+            std::chrono::nanoseconds waited{0};
+            int item;
+            while (queue.pop(item, waited))
+                sum += item;
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    EXPECT_EQ(sum, producers * (per_producer * (per_producer + 1LL) / 2));
+
+    EXPECT_THROW((BoundedQueue<int>{std::numeric_limits<std::size_t>::max(), 1}), std::length_error);
+}
+
+TEST(parseOptions, PathAndPipeline) {
+    const char *argv[] = {"time_at_enklave", "/some/path", "--readers", "3", "--parsers", "0", "--stats"};
+    auto options = parse_options(7, argv);
+    EXPECT_EQ(options.path_with_mails, "/some/path");
+    EXPECT_EQ(options.pipeline.reader_threads, 3u);
+    EXPECT_EQ(options.pipeline.parser_threads, 0u);
+    EXPECT_TRUE(options.stats);
+
+    const char *bad[] = {"time_at_enklave", "--readers", "many"};
+    EXPECT_THROW(parse_options(3, bad), std::invalid_argument);
+
+    using namespace date;
+    const char *range[] = {"time_at_enklave", "--since", "2019-09-01", "--until", "2019-09-30"};
+    options = parse_options(5, range);
+    EXPECT_EQ(options.pipeline.scan.range.since, sys_seconds{sys_days{2019_y / sep / 1}});
+    EXPECT_EQ(options.pipeline.scan.range.until, sys_seconds{sys_days{2019_y / oct / 1}}); // Includes the day.
+
+    const char *reversed[] = {"time_at_enklave", "--since", "2019-09-30", "--until", "2019-09-01"};
+    EXPECT_THROW(parse_options(5, reversed), std::invalid_argument);
+    const char *one_day[] = {"time_at_enklave", "--since", "2019-09-13", "--until", "2019-09-13"};
+    EXPECT_NO_THROW(parse_options(5, one_day));
+
+    const char *bad_day[] = {"time_at_enklave", "--since", "yesterday"};
+    EXPECT_THROW(parse_options(3, bad_day), std::invalid_argument);
+
+    const char *rules[] = {"time_at_enklave", "--rules", "sites.conf"};
+    EXPECT_EQ(parse_options(3, rules).rules_file, "sites.conf");
+    const char *index[] = {"time_at_enklave", "--index", "slots.index"};
+    EXPECT_EQ(parse_options(3, index).index, "slots.index");
+    const char *query[] = {"time_at_enklave", "--query", "enklave.sock", "MEMBER enklave"};
+    const auto query_options = parse_options(4, query);
+    EXPECT_EQ(query_options.query_socket, "enklave.sock");
+    EXPECT_EQ(query_options.request, "MEMBER enklave");
+    const char *journal_and_cache[] = {"time_at_enklave", "--journal", "j", "--cache", "c"};
+    EXPECT_THROW(parse_options(5, journal_and_cache), std::invalid_argument);
+    const char *body_scan[] = {"time_at_enklave", "--body-scan", "4096"};
+    EXPECT_EQ(parse_options(3, body_scan).pipeline.body_scan_bytes, 4096u);
+    const char *no_capacity[] = {"time_at_enklave", "--queue-capacity", "0"};
+    EXPECT_THROW(parse_options(3, no_capacity), std::invalid_argument);
+    const char *huge_capacity[] = {"time_at_enklave", "--queue-capacity", "18446744073709551615"};
+    EXPECT_THROW(parse_options(3, huge_capacity), std::invalid_argument);
+}
+
 TEST(computeTimeslots, WithSuccess) {
     auto results = parse_directory(enklave::config::path_with_mails);
     auto slots = compute_timeslots(results);
@@ -77,3 +1319,394 @@ TEST(computeDuration, WithSuccess) {
     auto result = compute_duration(timeslots);
     EXPECT_EQ("11:12:48", date::format("%T", result));
 }
+
+TEST(computeDuration, ClippedToRange) {
+    using namespace date;
+    auto found_events = parse_directory(enklave::config::path_with_mails);
+    auto timeslots = compute_timeslots(found_events);
+    EXPECT_EQ(compute_duration(timeslots, TimeRange{}), compute_duration(timeslots));
+
+    TimeRange second_day;
+    second_day.since = sys_days{2019_y / sep / 12};
+    EXPECT_EQ("07:36:24", format("%T", compute_duration(timeslots, second_day)));
+
+    TimeRange afternoon; // Cuts through sessions on both days.
+    afternoon.since = sys_days{2019_y / sep / 11} + std::chrono::hours{16};
+    afternoon.until = sys_days{2019_y / sep / 12} + std::chrono::hours{16};
+    EXPECT_EQ("05:36:24", format("%T", compute_duration(timeslots, afternoon)));
+}
+
+TEST(queryIndex, AnswersLikeComputeDuration) {
+    using namespace date;
+    TemporaryDirectory tmp{"index"};
+    const auto index_file = tmp.path / "slots.index";
+    auto events = parse_directory(enklave::config::path_with_mails);
+    const auto fingerprint = fingerprint_of(events);
+    EXPECT_FALSE(QueryIndex::open(index_file, fingerprint).has_value());
+    QueryIndex::build(events).save(index_file);
+
+    auto index = QueryIndex::open(index_file, fingerprint);
+    ASSERT_TRUE(index.has_value());
+    EXPECT_FALSE(QueryIndex::open(index_file, fingerprint + 1).has_value());
+    ASSERT_EQ(index->sites(), 1u);
+    const auto site = index->find_site("enklave");
+    ASSERT_EQ(site, 0u);
+    EXPECT_EQ(index->find_site("other"), QueryIndex::npos);
+
+    auto timeslots = compute_timeslots(events);
+    ASSERT_EQ(index->slot_count(site), timeslots.size());
+    EXPECT_EQ(index->slot(site, 0).first, timeslots.front().first.when);
+    EXPECT_EQ(index->duration(site), compute_duration(timeslots));
+    // Bounds before, inside and after every slot.
+    const sys_seconds start = sys_days{2019_y / sep / 11};
+    for (int since = 0; since < 48; since += 3) {
+        for (int until = since; until <= 48; until += 5) {
+            TimeRange range;
+            range.since = start + std::chrono::hours{since};
+            range.until = start + std::chrono::hours{until};
+            EXPECT_EQ(index->duration(site, range), compute_duration(timeslots, range)) << since << " " << until;
+        }
+    }
+
+    // A damaged file is rebuilt instead of being trusted.
+    fs::resize_file(index_file, fs::file_size(index_file) - 20);
+    EXPECT_FALSE(QueryIndex::open(index_file, fingerprint).has_value());
+}
+
+TEST(queryIndex, FreshWhileSourceUnchanged) {
+    TemporaryDirectory tmp{"index_fresh"};
+    const auto index_file = tmp.path / "slots.index";
+    const auto archive = tmp.path / "archive";
+    tmp.copy_test_file("testfile_check_in_01.eml", "archive/2019-09/in.eml");
+    tmp.copy_test_file("testfile_check_out_01.eml", "archive/2019-09/out.eml");
+    fs::create_directories(archive / "2019-10");
+
+    for (auto backend: {ScanBackend::PORTABLE, ScanBackend::GETDENTS}) {
+        PipelineConfig config;
+        config.scan.recursive = true;
+        config.scan.backend = backend;
+        auto build_index = [&]() {
+            SourceStamps stamps{42};
+            config.scan.stamps = &stamps;
+            QueryIndex::build(parse_directory(archive, config), stamps).save(index_file);
+        };
+        // Changes must be stamped later than the build by at least one tick of the clock stamping files.
+        auto later = []() { std::this_thread::sleep_for(std::chrono::milliseconds{20}); };
+
+        build_index();
+        const auto index = QueryIndex::open_fresh(index_file, 42);
+        ASSERT_TRUE(index.has_value());
+        EXPECT_EQ(index->slot_count(0), 1u);
+        EXPECT_FALSE(QueryIndex::open_fresh(index_file, 43).has_value()); // Other rules or source.
+
+        later();
+        tmp.copy_test_file("testfile_check_in_02.eml", "archive/2019-10/in.eml");
+        EXPECT_FALSE(QueryIndex::open_fresh(index_file, 42).has_value());
+        build_index();
+        EXPECT_TRUE(QueryIndex::open_fresh(index_file, 42).has_value());
+
+        // An empty mail may still be written in place; the index is fresh until it is.
+        std::ofstream{archive / "2019-10/writing.eml"};
+        build_index();
+        EXPECT_TRUE(QueryIndex::open_fresh(index_file, 42).has_value());
+        later();
+        std::ofstream{archive / "2019-10/writing.eml", std::ios::binary} << read_test_file("testfile_check_out_02.eml");
+        EXPECT_FALSE(QueryIndex::open_fresh(index_file, 42).has_value());
+
+        // Stamps of a source with an unreadable mail or of a scan restricted to a range never vouch for it.
+        std::ofstream{archive / "2019-10/broken.eml.gz", std::ios::binary} << "not gzip";
+        build_index();
+        EXPECT_FALSE(QueryIndex::open_fresh(index_file, 42).has_value());
+        fs::remove(archive / "2019-10/broken.eml.gz");
+        config.scan.range.since = date::sys_days{date::year{2019} / 10 / 1};
+        build_index();
+        EXPECT_FALSE(QueryIndex::open_fresh(index_file, 42).has_value());
+
+        fs::remove(archive / "2019-10/in.eml");
+        fs::remove(archive / "2019-10/writing.eml");
+        later();
+    }
+    // An index without stamps is never fresh.
+    QueryIndex::build(parse_directory(archive)).save(index_file);
+    EXPECT_FALSE(QueryIndex::open_fresh(index_file, 0).has_value());
+}
+
+TEST(answerQuery, Requests) {
+    const auto index = QueryIndex::build(parse_directory(enklave::config::path_with_mails));
+    EXPECT_EQ(answer_query(index, "TOTAL"), "OK 40368");
+    EXPECT_EQ(answer_query(index, "RANGE 2019-09-12 -"), "OK 27384");
+    EXPECT_EQ(answer_query(index, "RANGE - -"), "OK 40368");
+    EXPECT_EQ(answer_query(index, "MEMBER enklave 2019-09-11 2019-09-11"), "OK 12984");
+    EXPECT_EQ(answer_query(index, "BUCKETS 2019-09-10 2019-09-13"), "OK 0 12984 27384 0");
+    EXPECT_EQ(answer_query(index, "MEMBER other"), "ERR unknown site other");
+    EXPECT_EQ(answer_query(index, "RANGE 2019-9-12 -").substr(0, 3), "ERR");
+    EXPECT_EQ(answer_query(index, "BUCKETS - 2019-09-13").substr(0, 3), "ERR");
+    EXPECT_EQ(answer_query(index, "").substr(0, 3), "ERR");
+}
+
+TEST(sharedResults, ReadersSeeConsistentResults) {
+    const std::string name = "/enklave_test_" + std::to_string(::getpid());
+    SharedResultsWriter::remove(name);
+    SharedResultsWriter writer{name};
+    SharedResultsReader reader{name};
+    SharedResults read;
+    EXPECT_FALSE(reader.read(read));
+
+    // Results of the test data, with totals clipped to a range.
+    const auto index = QueryIndex::build(parse_directory(enklave::config::path_with_mails));
+    TimeRange range;
+    range.since = date::sys_days{date::year{2019} / 9 / 12};
+    const auto published_at = date::sys_seconds{std::chrono::seconds{1568000000}};
+    writer.publish(shared_results_of(index, range, published_at));
+    ASSERT_TRUE(reader.read(read));
+    EXPECT_EQ(read.generation, 1u);
+    EXPECT_EQ(read.published_at, 1568000000);
+    ASSERT_EQ(read.sites.size(), 1u);
+    EXPECT_EQ(read.sites[0].name, "enklave");
+    EXPECT_EQ(read.sites[0].total_seconds, 27384);
+    EXPECT_EQ(read.sites[0].slot_count, index.slot_count(0));
+    ASSERT_EQ(read.recent.size(), index.slot_count(0));
+    EXPECT_EQ(read.recent.back().end, index.slot(0, index.slot_count(0) - 1).second.time_since_epoch().count());
+
+    // Every value of a generation is derived from it; a reader must never see two generations mixed.
+    auto generation = [](std::int64_t g) {
+        SharedResults results;
+        results.published_at = g;
+        results.sites.assign(g % 16 + 1, SharedSite{"site" + std::to_string(g), g, 1});
+        results.recent.assign(g % 64 + 1, SharedSlot{0, g, -g});
+        return results;
+    };
+    writer.publish(generation(1));
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i) {
+        readers.emplace_back([&] {
+            SharedResultsReader own{name};
+            SharedResults results;
+            while (!done) {
+                if (!own.read(results))
+                    continue;
+                const auto g = results.published_at;
+                bool consistent = results.sites.size() == static_cast<std::size_t>(g % 16 + 1);
+                for (const auto &site: results.sites)
+                    consistent &= site.total_seconds == g && site.name == "site" + std::to_string(g);
+                for (const auto &slot: results.recent)
+                    consistent &= slot.begin == g && slot.end == -g;
+                torn += !consistent;
+            }
+        });
+    }
+    for (std::int64_t g = 2; g < 20000; ++g)
+        writer.publish(generation(g));
+    done = true;
+    for (auto &t: readers)
+        t.join();
+    EXPECT_EQ(torn, 0);
+
+    // A writer that died while publishing leaves the sequence odd: readers give up instead of spinning, and the next
+    // writer discards the torn results.
+    auto *segment = static_cast<enklave::detail::SharedSegment *>(enklave::detail::map_shared_segment(name, true));
+    const auto sequence = segment->sequence.load();
+    segment->sequence.store(sequence + 1);
+    segment->site_count.store(3);
+    EXPECT_FALSE(reader.read(read));
+    SharedResultsWriter next{name};
+    ASSERT_TRUE(reader.read(read));
+    EXPECT_TRUE(read.sites.empty());
+    next.publish(generation(7));
+    ASSERT_TRUE(reader.read(read));
+    EXPECT_EQ(read.generation, sequence / 2 + 2);
+    EXPECT_EQ(read.published_at, 7);
+    ::munmap(segment, sizeof(*segment));
+    SharedResultsWriter::remove(name);
+}
+
+TEST(snapshotPublisher, ReadersSeeWholeSnapshots) {
+    // A snapshot is consistent if all its values are equal; deleted snapshots are overwritten first.
+    struct Values {
+        std::vector<int> values;
+
+        ~Values() {
+            std::fill(values.begin(), values.end(), -1);
+        }
+    };
+    SnapshotPublisher<Values> publisher;
+    {
+        SnapshotPublisher<Values>::Reader reader{publisher};
+        EXPECT_FALSE(reader.pin());
+    }
+    publisher.publish(std::make_unique<const Values>(Values{std::vector<int>(64, 0)}));
+
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            SnapshotPublisher<Values>::Reader reader{publisher};
+            while (!done) {
+                const auto pinned = reader.pin();
+                const auto first = pinned->values.front();
+                torn += first < 0 || std::any_of(pinned->values.begin(), pinned->values.end(), [first](int v) {
+                    return v != first;
+                });
+            }
+        });
+    }
+    for (int version = 1; version <= 2000; ++version)
+        publisher.publish(std::make_unique<const Values>(Values{std::vector<int>(64, version)}));
+    done = true;
+    for (auto &t: readers)
+        t.join();
+    EXPECT_EQ(torn, 0);
+
+    // Once no reader is pinned, every retired snapshot is reclaimed.
+    publisher.reclaim();
+    EXPECT_EQ(publisher.retired_count(), 0u);
+    SnapshotPublisher<Values>::Reader reader{publisher};
+    {
+        const auto pinned = reader.pin();
+        publisher.publish(std::make_unique<const Values>(Values{std::vector<int>(64, -2)}));
+        EXPECT_EQ(publisher.retired_count(), 1u);
+        EXPECT_EQ(pinned->values.front(), 2000);
+    }
+    publisher.reclaim();
+    EXPECT_EQ(publisher.retired_count(), 0u);
+    EXPECT_EQ(reader.pin()->values.front(), -2);
+}
+
+TEST(queryDaemon, AnswersOverSocket) {
+    TemporaryDirectory tmp{"daemon"};
+    const auto socket = tmp.path / "enklave.sock";
+    const auto all_events = parse_directory(enklave::config::path_with_mails);
+    std::atomic<std::size_t> visible{2};
+    DaemonConfig daemon_config;
+    daemon_config.threads = 2;
+    daemon_config.refresh_interval = std::chrono::hours{1};
+    QueryDaemon daemon{socket, [&] {
+        return std::vector<EnklaveEvent>(all_events.begin(), all_events.begin() + visible.load());
+    }, daemon_config};
+
+    const auto first = query_daemon(socket, "TOTAL");
+    EXPECT_EQ(first.substr(0, 3), "OK ");
+    EXPECT_FALSE(daemon.refresh()); // Same events, same index.
+
+    visible = all_events.size();
+    EXPECT_TRUE(daemon.refresh());
+    std::vector<std::thread> clients;
+    std::atomic<int> correct{0};
+    for (int i = 0; i < 4; ++i) {
+        clients.emplace_back([&] {
+            for (int j = 0; j < 25; ++j)
+                correct += query_daemon(socket, "TOTAL") == "OK 40368";
+        });
+    }
+    for (auto &t: clients)
+        t.join();
+    EXPECT_EQ(correct, 100);
+
+    daemon.stop();
+    EXPECT_FALSE(fs::exists(socket));
+    EXPECT_THROW(query_daemon(socket, "TOTAL"), fs::filesystem_error);
+}
+
+TEST(queryDaemon, IdleClientsDontBlockOthers) {
+    TemporaryDirectory tmp{"daemon_idle"};
+    const auto socket = tmp.path / "enklave.sock";
+    const auto events = parse_directory(enklave::config::path_with_mails);
+    DaemonConfig daemon_config;
+    daemon_config.threads = 1;
+    daemon_config.refresh_interval = std::chrono::hours{1};
+    daemon_config.idle_timeout = std::chrono::milliseconds{200};
+    QueryDaemon daemon{socket, [&] { return events; }, daemon_config};
+
+    // Clients that connect and never send a request.
+    std::vector<int> idle;
+    for (int i = 0; i < 4; ++i) {
+        sockaddr_un address{};
+        idle.push_back(enklave::detail::unix_socket(socket, address));
+        ASSERT_EQ(::connect(idle.back(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)), 0);
+    }
+    EXPECT_EQ(query_daemon(socket, "TOTAL"), "OK 40368");
+
+    // They are disconnected once idle for too long.
+    for (const int fd: idle) {
+        char byte;
+        EXPECT_EQ(::recv(fd, &byte, 1, 0), 0);
+        ::close(fd);
+    }
+}
+
+TEST(queryDaemon, ReplacesOnlyStaleSockets) {
+    TemporaryDirectory tmp{"daemon_socket"};
+    const auto socket = tmp.path / "enklave.sock";
+    const auto events = parse_directory(enklave::config::path_with_mails);
+    auto ingest = [&] { return events; };
+
+    std::ofstream{socket} << "not a socket";
+    EXPECT_THROW(QueryDaemon(socket, ingest), fs::filesystem_error);
+    EXPECT_EQ(fs::file_size(socket), 12u);
+    fs::remove(socket);
+
+    // Left by a daemon that is gone.
+    sockaddr_un address{};
+    const int stale = enklave::detail::unix_socket(socket, address);
+    ASSERT_EQ(::bind(stale, reinterpret_cast<const sockaddr *>(&address), sizeof(address)), 0);
+    ::close(stale);
+    QueryDaemon daemon{socket, ingest};
+
+    EXPECT_THROW(QueryDaemon(socket, ingest), fs::filesystem_error);
+    EXPECT_EQ(query_daemon(socket, "TOTAL"), "OK 40368");
+}
+
+TEST(queryDaemon, RefreshesOverCachedFolder) {
+    TemporaryDirectory tmp{"daemon_cache"};
+    const auto socket = tmp.path / "enklave.sock";
+    const auto cache_file = tmp.path / "cache";
+    const auto archive = tmp.path / "archive";
+    // Without Message-Id, copies of a mail can't be told apart, so an event stored twice would count twice.
+    for (const auto &[name, target]: {std::pair{"testfile_check_in_01.eml", "2019-09/in.eml"},
+                                      std::pair{"testfile_check_out_01.eml", "2019-09/out.eml"}}) {
+        std::istringstream mail{read_test_file(name)};
+        fs::create_directories(archive / "2019-09");
+        std::ofstream out{archive / target, std::ios::binary};
+        for (std::string line; std::getline(mail, line);) {
+            if (line.rfind("Message-Id:", 0) != 0 && line.rfind("X-Pm-External-Id:", 0) != 0)
+                out << line << '\n';
+        }
+    }
+
+    // Ingest like the daemon of main: one cache for every refresh.
+    DirectoryCache cache;
+    PipelineConfig config;
+    config.scan.recursive = true;
+    config.scan.cache = &cache;
+    std::size_t reused = 0;
+    DaemonConfig daemon_config;
+    daemon_config.threads = 1;
+    daemon_config.refresh_interval = std::chrono::hours{1};
+    QueryDaemon daemon{socket, [&] {
+        auto events = parse_directory(archive, config);
+        reused = cache.reused();
+        cache.save(cache_file);
+        cache.next_run();
+        return events;
+    }, daemon_config};
+    const auto total = query_daemon(socket, "TOTAL");
+    EXPECT_EQ(total, "OK 16584");
+    const auto cache_size = fs::file_size(cache_file);
+
+    for (int refresh = 0; refresh < 2; ++refresh) {
+        EXPECT_FALSE(daemon.refresh()); // Same events, same index.
+        EXPECT_EQ(reused, 2u); // Root and shard.
+        EXPECT_EQ(fs::file_size(cache_file), cache_size);
+    }
+    EXPECT_EQ(query_daemon(socket, "TOTAL"), total);
+
+    // A restarted daemon loads every event once.
+    DirectoryCache restarted;
+    restarted.load(cache_file);
+    config.scan.cache = &restarted;
+    EXPECT_EQ(parse_directory(archive, config).size(), 2u);
+    EXPECT_EQ(restarted.reused(), 2u);
+}
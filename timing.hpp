@@ -0,0 +1,115 @@
+#ifndef TIME_AT_ENKLAVE_TIMING_HPP
+#define TIME_AT_ENKLAVE_TIMING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+#include <time.h>
+
+namespace enklave {
+    namespace detail {
+        /// CPU time the calling thread has consumed; a vDSO call on Linux, i.e. no system call.
+        std::chrono::nanoseconds thread_cpu_time() {
+            timespec ts{};
+            ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec};
+        }
+    }
+
+    /** Counters of one phase of a run, summed over all calls; each phase has a cache line of its own.
+     *
+     * Phases are timed once per call of a whole phase (e.g. once per sort), not per item, so the counters stay
+     * compiled in.
+     */
+    struct alignas(64) PhaseCounters {
+        std::atomic<std::uint64_t> calls{0};
+        std::atomic<std::uint64_t> items{0};
+        std::atomic<std::uint64_t> wall_ns{0};
+        std::atomic<std::uint64_t> cpu_ns{0};
+    };
+
+    /// Times the scope it lives in and adds wall and CPU time to a PhaseCounters; does nothing for nullptr.
+    class PhaseTimer {
+    public:
+        /// @param items Number of items the phase handles, e.g. events sorted.
+        explicit PhaseTimer(PhaseCounters *counters, std::uint64_t items = 0) : counters{counters}, items{items} {
+            if (counters) {
+                wall_start = std::chrono::steady_clock::now();
+                cpu_start = detail::thread_cpu_time();
+            }
+        }
+
+        PhaseTimer(const PhaseTimer &) = delete;
+
+        PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+        ~PhaseTimer() {
+            if (!counters)
+                return;
+            const std::chrono::nanoseconds wall = std::chrono::steady_clock::now() - wall_start;
+            const auto cpu = detail::thread_cpu_time() - cpu_start;
+            counters->calls.fetch_add(1, std::memory_order_relaxed);
+            counters->items.fetch_add(items, std::memory_order_relaxed);
+            counters->wall_ns.fetch_add(static_cast<std::uint64_t>(wall.count()), std::memory_order_relaxed);
+            counters->cpu_ns.fetch_add(static_cast<std::uint64_t>(cpu.count()), std::memory_order_relaxed);
+        }
+
+        /// Set the number of items once it is known, e.g. after filtering.
+        void set_items(std::uint64_t count) {
+            items = count;
+        }
+
+    private:
+        PhaseCounters *counters;
+        std::uint64_t items;
+        std::chrono::steady_clock::time_point wall_start;
+        std::chrono::nanoseconds cpu_start{0};
+    };
+
+    /// Phases after ingestion, i.e. of \ref compute_timeslots, the summation and the output of a run.
+    struct PhaseStats {
+        /// Items: events sorted.
+        PhaseCounters sort;
+        /// Items: impossible events removed.
+        PhaseCounters filter;
+        /// Items: timeslots paired.
+        PhaseCounters pair;
+        /// Items: timeslots summed.
+        PhaseCounters sum;
+        /// Items: events and results printed.
+        PhaseCounters output;
+    };
+
+    /// Pretty-print the counters of the phases after ingestion to terminal.
+    std::ostream &operator<<(std::ostream &out, const PhaseStats &stats) {
+        // Leave the stream formatted as it was, e.g. for later output to std::cout.
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        auto print = [&out](const char *name, const PhaseCounters &c) {
+            auto ms = [](const std::atomic<std::uint64_t> &ns) { return static_cast<double>(ns.load()) / 1e6; };
+            const auto seconds = static_cast<double>(c.wall_ns.load()) / 1e9;
+            out << std::left << std::setw(10) << name << std::right
+                << " calls: " << std::setw(4) << c.calls.load()
+                << " items: " << std::setw(8) << c.items.load()
+                << std::fixed << std::setprecision(3)
+                << " wall: " << std::setw(8) << ms(c.wall_ns) << " ms"
+                << " cpu: " << std::setw(8) << ms(c.cpu_ns) << " ms"
+                << std::setprecision(0)
+                << " items/s: " << std::setw(10) << (seconds > 0 ? static_cast<double>(c.items.load()) / seconds : 0)
+                << std::endl;
+        };
+        print("sort", stats.sort);
+        print("filter", stats.filter);
+        print("pair", stats.pair);
+        print("sum", stats.sum);
+        print("output", stats.output);
+        out.flags(flags);
+        out.precision(precision);
+        return out;
+    }
+}
+
+#endif //TIME_AT_ENKLAVE_TIMING_HPP